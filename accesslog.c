@@ -0,0 +1,323 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file contains the access log. Workers queue records on their
+         own lock-free ring and a writer thread turns them into lines, 
+         writing many at once.
+*/
+#define _GNU_SOURCE
+#include "accesslog.h"
+#include "connops.h"
+#include "serverops.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+static int log_fd = -1;
+static log_format_t log_format;
+// Rings of every thread that has logged, newest first
+static _Atomic(struct log_ring*) log_rings;
+static __thread struct log_ring* thread_ring;
+// Releases a thread's ring when it exits
+static pthread_key_t ring_key;
+
+static struct log_ring* log_ring_register(void);
+static void log_ring_release(void* ring);
+static void* log_writer(void* arg);
+static size_t log_format_record(char* line, struct log_record* record, 
+                                time_t now, char* date);
+static void log_write(struct iovec* iov, int iovcnt);
+
+/*
+ * Function: access_log_init
+ * --------------------
+ *  Opens the access log and starts the thread that writes it.
+ * 
+ *  path: File to append to, LOG_STDOUT for stdout, or LOG_OFF to disable 
+ *  logging.
+ *  format: Format of each line.
+ * 
+ *  returns: Nothing.
+ */
+void access_log_init(char* path, log_format_t format) {
+    pthread_t writer;
+
+    if (strcmp(path, LOG_OFF) == 0) {
+        return;
+    }
+    if (strcmp(path, LOG_STDOUT) == 0) {
+        log_fd = STDOUT_FILENO;
+    } else if ((log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 
+                            0644)) < 0) {
+        perror("access log");
+        exit(EXIT_FAILURE);
+    }
+    log_format = format;
+
+    if (pthread_key_create(&ring_key, log_ring_release) != 0) {
+        fprintf(stderr, "ERROR: Could not create access log key\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&writer, NULL, log_writer, NULL) != 0) {
+        fprintf(stderr, "ERROR: Could not start access log writer\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(writer);
+}
+
+/*
+ * Function: access_log
+ * --------------------
+ *  Queues a line for a served request. Never blocks: if the calling 
+ *  thread's ring is full the line is dropped and counted.
+ * 
+ *  path: Path of the request.
+ *  http_version: Protocol version of the response.
+ *  status: Status code of the response.
+ *  bytes: Bytes sent.
+ *  latency_ns: Time from the request being read to its last byte sent.
+ * 
+ *  returns: Nothing.
+ */
+void access_log(char* path, char* http_version, char* status, size_t bytes, 
+                uint64_t latency_ns) {
+    if (log_fd < 0) {
+        return;
+    }
+    struct log_ring* ring = thread_ring;
+    if (ring == NULL) {
+        ring = thread_ring = log_ring_register();
+    }
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->drops, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct log_record* record = &ring->records[tail % LOG_RING_SIZE];
+    record->status = status;
+    record->http_version = http_version;
+    record->bytes = bytes;
+    record->latency_ns = latency_ns;
+    // Overlong paths are truncated
+    strncpy(record->path, path, LOG_PATH_LEN - 1);
+    record->path[LOG_PATH_LEN - 1] = '\0';
+
+    // Publish the record to the writer
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/*
+ * Function: access_log_drops
+ * --------------------
+ *  Gets the number of lines dropped because a ring was full.
+ * 
+ *  returns: The count.
+ */
+unsigned long access_log_drops(void) {
+    unsigned long drops = 0;
+    for (struct log_ring* ring = atomic_load(&log_rings); ring != NULL;
+            ring = ring->next) {
+        drops += atomic_load_explicit(&ring->drops, memory_order_relaxed);
+    }
+    return drops;
+}
+
+/*
+ * Function: monotonic_ns
+ * --------------------
+ *  Gets the current monotonic time.
+ * 
+ *  returns: The time in nanoseconds.
+ */
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Function: log_ring_register
+ * --------------------
+ *  Gives the calling thread a ring, reusing one left by an exited thread 
+ *  once the writer has drained it, otherwise creating one and adding it 
+ *  to the list the writer drains. Happens once per thread.
+ * 
+ *  returns: The ring.
+ */
+static struct log_ring* log_ring_register(void) {
+    struct log_ring* ring = NULL;
+
+    for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+        bool released = false;
+        // With no producer left the tail is stable, so a drained ring 
+        // stays drained until it is claimed
+        if (!atomic_load_explicit(&ring->in_use, memory_order_acquire) && 
+                atomic_load_explicit(&ring->head, memory_order_acquire) == 
+                atomic_load_explicit(&ring->tail, memory_order_relaxed) && 
+                atomic_compare_exchange_strong(&ring->in_use, &released, 
+                                            true)) {
+            break;
+        }
+    }
+
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct log_ring));
+        malloc_check(ring);
+        atomic_init(&ring->in_use, true);
+
+        // Rings are only ever added, so a plain push is safe
+        ring->next = atomic_load(&log_rings);
+        while (!atomic_compare_exchange_weak(&log_rings, &ring->next, 
+                                            ring)) {
+        }
+    }
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+/*
+ * Function: log_ring_release
+ * --------------------
+ *  Gives up an exiting thread's ring. Records still on it are written out 
+ *  before another thread can claim it.
+ * 
+ *  ring: The ring.
+ * 
+ *  returns: Nothing.
+ */
+static void log_ring_release(void* ring) {
+    atomic_store_explicit(&((struct log_ring*)ring)->in_use, false, 
+                        memory_order_release);
+}
+
+/*
+ * Function: log_writer
+ * --------------------
+ *  Drains every ring into a set of buffers and writes them with one 
+ *  writev, sleeping briefly whenever there is nothing to write. Never 
+ *  returns.
+ * 
+ *  arg: Unused.
+ * 
+ *  returns: NULL.
+ */
+static void* log_writer(void* arg) {
+    (void)arg;
+    char* buffers = malloc(LOG_BUFFERS * LOG_BUFFER_LEN);
+    malloc_check(buffers);
+    struct iovec iov[LOG_BUFFERS];
+    struct timespec idle = { 0, LOG_IDLE_NS };
+
+    while (true) {
+        int iovcnt = 0;
+        size_t len = 0;
+        time_t now = time(NULL);
+        char date[HTTP_DATE_LEN + 1];
+        struct tm tm;
+        strftime(date, sizeof(date), HTTP_DATE_FORMAT, gmtime_r(&now, &tm));
+
+        for (struct log_ring* ring = atomic_load(&log_rings); ring != NULL;
+                ring = ring->next) {
+            size_t head = atomic_load_explicit(&ring->head, 
+                                            memory_order_relaxed);
+            size_t tail = atomic_load_explicit(&ring->tail, 
+                                            memory_order_acquire);
+            for (; head != tail; head++) {
+                // Move to the next buffer when a line might not fit
+                if (LOG_BUFFER_LEN - len < LOG_LINE_MAX) {
+                    iov[iovcnt].iov_base = buffers + iovcnt * LOG_BUFFER_LEN;
+                    iov[iovcnt++].iov_len = len;
+                    len = 0;
+                    if (iovcnt == LOG_BUFFERS) {
+                        log_write(iov, iovcnt);
+                        iovcnt = 0;
+                    }
+                }
+                len += log_format_record( 
+                        buffers + iovcnt * LOG_BUFFER_LEN + len, 
+                        &ring->records[head % LOG_RING_SIZE], now, date);
+            }
+            // Hand the slots back to the worker
+            atomic_store_explicit(&ring->head, head, memory_order_release);
+        }
+
+        if (len > 0) {
+            iov[iovcnt].iov_base = buffers + iovcnt * LOG_BUFFER_LEN;
+            iov[iovcnt++].iov_len = len;
+        }
+        if (iovcnt > 0) {
+            log_write(iov, iovcnt);
+        } else {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: log_format_record
+ * --------------------
+ *  Formats a record as one line of the configured format.
+ * 
+ *  line: Buffer with room for LOG_LINE_MAX bytes.
+ *  record: The record.
+ *  now: Time to stamp the line with.
+ *  date: The same time as an HTTP date.
+ * 
+ *  returns: The length of the line.
+ */
+static size_t log_format_record(char* line, struct log_record* record, 
+                                time_t now, char* date) {
+    int n = 0;
+
+    if (log_format == LOG_FORMAT_COMPACT) {
+        n = snprintf(line, LOG_LINE_MAX, "%lld %s %zu %llu %s\n", 
+                    (long long)now, record->status, record->bytes, 
+                    (unsigned long long)(record->latency_ns / 1000), 
+                    record->path);
+    } else {
+        n = snprintf(line, LOG_LINE_MAX, "[%s] %s %s %s %s %zu %.3fms\n", 
+                    date, GET_METHOD, record->path, record->http_version, 
+                    record->status, record->bytes, 
+                    record->latency_ns / 1e6);
+    }
+    return n < LOG_LINE_MAX ? (size_t)n : LOG_LINE_MAX - 1;
+}
+
+/*
+ * Function: log_write
+ * --------------------
+ *  Writes out a batch of buffers, finishing any partial write.
+ * 
+ *  iov: The buffers, which are modified.
+ *  iovcnt: The number of buffers.
+ * 
+ *  returns: Nothing.
+ */
+static void log_write(struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(log_fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // Nothing sensible to do, the lines are lost
+            perror("access log write");
+            return;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
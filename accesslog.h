@@ -0,0 +1,104 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "ring.h"
+
+#define LOG_RING_SIZE 4096
+#define LOG_PATH_LEN 232
+#define LOG_LINE_MAX 512
+#define LOG_BUFFERS 8
+#define LOG_BUFFER_LEN 65536
+#define LOG_IDLE_NS 2000000
+#define LOG_STDOUT "-"
+#define LOG_OFF "off"
+
+typedef enum log_format {
+    // [time] GET path version status bytes latency
+    LOG_FORMAT_TEXT,
+    // unix-seconds status bytes latency-us path
+    LOG_FORMAT_COMPACT
+} log_format_t;
+
+/*
+ * One served request. Status and version point at string constants, so 
+ * only the path is copied.
+ */
+struct log_record {
+    char* status;
+    char* http_version;
+    size_t bytes;
+    uint64_t latency_ns;
+    char path[LOG_PATH_LEN];
+};
+
+/*
+ * A single-producer single-consumer ring of records. Every thread that 
+ * logs gets its own, so workers never contend with each other, and the 
+ * writer thread is the only consumer. When a thread exits its ring is 
+ * released, and once drained it is handed to the next thread that logs.
+ */
+struct log_ring {
+    // Next record the writer reads, only advanced by the writer
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    // Next record the worker fills, only advanced by the worker
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    atomic_ulong drops;
+    // Whether a live thread owns the ring
+    atomic_bool in_use;
+    struct log_ring* next;
+    struct log_record records[LOG_RING_SIZE];
+};
+
+/*
+ * Function: access_log_init
+ * --------------------
+ *  Opens the access log and starts the thread that writes it.
+ * 
+ *  path: File to append to, LOG_STDOUT for stdout, or LOG_OFF to disable 
+ *  logging.
+ *  format: Format of each line.
+ * 
+ *  returns: Nothing.
+ */
+void access_log_init(char* path, log_format_t format);
+
+/*
+ * Function: access_log
+ * --------------------
+ *  Queues a line for a served request. Never blocks: if the calling 
+ *  thread's ring is full the line is dropped and counted.
+ * 
+ *  path: Path of the request.
+ *  http_version: Protocol version of the response.
+ *  status: Status code of the response.
+ *  bytes: Bytes sent.
+ *  latency_ns: Time from the request being read to its last byte sent.
+ * 
+ *  returns: Nothing.
+ */
+void access_log(char* path, char* http_version, char* status, size_t bytes, 
+                uint64_t latency_ns);
+
+/*
+ * Function: access_log_drops
+ * --------------------
+ *  Gets the number of lines dropped because a ring was full.
+ * 
+ *  returns: The count.
+ */
+unsigned long access_log_drops(void);
+
+/*
+ * Function: monotonic_ns
+ * --------------------
+ *  Gets the current monotonic time.
+ * 
+ *  returns: The time in nanoseconds.
+ */
+uint64_t monotonic_ns(void);
+
+#endif
@@ -0,0 +1,187 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file contains the per-connection arena that holds request
+         memory, and the slab pool that connections are taken from.
+*/
+#include "arena.h"
+#include "serverops.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+static atomic_ulong arena_slab_alloc_count;
+
+/*
+ * Function: arena_block_create
+ * --------------------
+ *  Allocates an empty arena block.
+ * 
+ *  size: Bytes the block can hold.
+ * 
+ *  returns: Pointer to the block.
+ */
+static struct arena_block* arena_block_create(size_t size) {
+    struct arena_block* block = malloc(sizeof(struct arena_block) + size);
+    malloc_check(block);
+    atomic_fetch_add_explicit(&arena_slab_alloc_count, 1, memory_order_relaxed);
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+/*
+ * Function: arena_init
+ * --------------------
+ *  Sets up an arena with one block.
+ * 
+ *  arena: The arena.
+ *  size: Bytes in the first block.
+ * 
+ *  returns: Nothing.
+ */
+void arena_init(arena_t* arena, size_t size) {
+    arena->head = arena_block_create(size);
+}
+
+/*
+ * Function: arena_alloc
+ * --------------------
+ *  Allocates memory from an arena. It is freed by the next reset.
+ * 
+ *  arena: The arena.
+ *  size: Bytes to allocate.
+ * 
+ *  returns: Pointer to the memory, aligned to ARENA_ALIGN.
+ */
+void* arena_alloc(arena_t* arena, size_t size) {
+    struct arena_block* block = arena->head;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (block->size - block->used < size) {
+        // Chain a block at least twice the size of the last one
+        size_t block_size = block->size * 2;
+        if (block_size < size) {
+            block_size = size;
+        }
+        block = arena_block_create(block_size);
+        block->next = arena->head;
+        arena->head = block;
+    }
+    void* ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+/*
+ * Function: arena_reset
+ * --------------------
+ *  Frees everything allocated from an arena. Takes constant time unless 
+ *  the arena had to grow since the last reset.
+ * 
+ *  arena: The arena.
+ * 
+ *  returns: Nothing.
+ */
+void arena_reset(arena_t* arena) {
+    struct arena_block* block = arena->head;
+    if (block->next == NULL) {
+        block->used = 0;
+        return;
+    }
+
+    // Replace the chain with one block that would have held it all, but 
+    // don't let one huge burst pin memory for the arena's whole life
+    size_t total = 0;
+    while (block != NULL) {
+        struct arena_block* next = block->next;
+        total += block->size;
+        free(block);
+        block = next;
+    }
+    if (total > ARENA_MAX_RETAIN) {
+        total = ARENA_BLOCK_SIZE;
+    }
+    arena->head = arena_block_create(total);
+}
+
+/*
+ * Function: arena_destroy
+ * --------------------
+ *  Frees an arena's blocks.
+ * 
+ *  arena: The arena.
+ * 
+ *  returns: Nothing.
+ */
+void arena_destroy(arena_t* arena) {
+    struct arena_block* block = arena->head;
+    while (block != NULL) {
+        struct arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+/*
+ * Function: slab_get
+ * --------------------
+ *  Takes an object from a pool, carving a new slab if none are free.
+ * 
+ *  slab: The pool.
+ * 
+ *  returns: Pointer to the object.
+ */
+void* slab_get(slab_t* slab) {
+    pthread_mutex_lock(&slab->lock);
+    if (slab->free_list == NULL) {
+        // Keep every object aligned like the first
+        size_t size = (slab->object_size + ARENA_ALIGN - 1) &
+                        ~(size_t)(ARENA_ALIGN - 1);
+        char* objects = calloc(SLAB_OBJECTS, size);
+        malloc_check(objects);
+        atomic_fetch_add_explicit(&arena_slab_alloc_count, 1, memory_order_relaxed);
+        for (size_t i = 0; i < SLAB_OBJECTS; i++) {
+            struct slab_object* object = 
+                (struct slab_object*)(objects + i * size);
+            object->next = slab->free_list;
+            slab->free_list = object;
+        }
+    }
+    struct slab_object* object = slab->free_list;
+    slab->free_list = object->next;
+    pthread_mutex_unlock(&slab->lock);
+    return object;
+}
+
+/*
+ * Function: slab_put
+ * --------------------
+ *  Returns an object to its pool.
+ * 
+ *  slab: The pool.
+ *  object: The object.
+ * 
+ *  returns: Nothing.
+ */
+void slab_put(slab_t* slab, void* object) {
+    pthread_mutex_lock(&slab->lock);
+    ((struct slab_object*)object)->next = slab->free_list;
+    slab->free_list = object;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+/*
+ * Function: arena_slab_allocs
+ * --------------------
+ *  Gets the number of times arenas and slabs have called malloc. This 
+ *  stays flat once they have grown to the load. Allocations made 
+ *  anywhere else, such as by the file cache, are not counted.
+ * 
+ *  returns: The count.
+ */
+unsigned long arena_slab_allocs(void) {
+    return atomic_load_explicit(&arena_slab_alloc_count, memory_order_relaxed);
+}
@@ -0,0 +1,131 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_MAX_RETAIN 65536
+#define ARENA_ALIGN 16
+#define SLAB_OBJECTS 64
+
+/*
+ * A bump-pointer allocator for memory that lives until the next reset. 
+ * Requests that do not fit chain another block, and the next reset folds 
+ * them into one block big enough for all of them, so an arena settles at 
+ * its high-water mark and stops calling malloc.
+ */
+struct arena_block {
+    struct arena_block* next;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) char data[];
+};
+
+typedef struct arena {
+    // Block being allocated from, earlier blocks follow it
+    struct arena_block* head;
+} arena_t;
+
+/*
+ * A pool of equal-sized objects carved from slabs of SLAB_OBJECTS. Freed 
+ * objects go on a free list for reuse, slabs are never returned. Objects 
+ * are zeroed when first carved, apart from the free list link in their 
+ * first bytes, and keep their contents when reused.
+ */
+struct slab_object {
+    struct slab_object* next;
+};
+
+typedef struct slab {
+    pthread_mutex_t lock;
+    size_t object_size;
+    struct slab_object* free_list;
+} slab_t;
+
+#define SLAB_INITIALIZER(type) \
+    { PTHREAD_MUTEX_INITIALIZER, sizeof(type), NULL }
+
+/*
+ * Function: arena_init
+ * --------------------
+ *  Sets up an arena with one block.
+ * 
+ *  arena: The arena.
+ *  size: Bytes in the first block.
+ * 
+ *  returns: Nothing.
+ */
+void arena_init(arena_t* arena, size_t size);
+
+/*
+ * Function: arena_alloc
+ * --------------------
+ *  Allocates memory from an arena. It is freed by the next reset.
+ * 
+ *  arena: The arena.
+ *  size: Bytes to allocate.
+ * 
+ *  returns: Pointer to the memory, aligned to ARENA_ALIGN.
+ */
+void* arena_alloc(arena_t* arena, size_t size);
+
+/*
+ * Function: arena_reset
+ * --------------------
+ *  Frees everything allocated from an arena. Takes constant time unless 
+ *  the arena had to grow since the last reset.
+ * 
+ *  arena: The arena.
+ * 
+ *  returns: Nothing.
+ */
+void arena_reset(arena_t* arena);
+
+/*
+ * Function: arena_destroy
+ * --------------------
+ *  Frees an arena's blocks.
+ * 
+ *  arena: The arena.
+ * 
+ *  returns: Nothing.
+ */
+void arena_destroy(arena_t* arena);
+
+/*
+ * Function: slab_get
+ * --------------------
+ *  Takes an object from a pool, carving a new slab if none are free.
+ * 
+ *  slab: The pool.
+ * 
+ *  returns: Pointer to the object.
+ */
+void* slab_get(slab_t* slab);
+
+/*
+ * Function: slab_put
+ * --------------------
+ *  Returns an object to its pool.
+ * 
+ *  slab: The pool.
+ *  object: The object.
+ * 
+ *  returns: Nothing.
+ */
+void slab_put(slab_t* slab, void* object);
+
+/*
+ * Function: arena_slab_allocs
+ * --------------------
+ *  Gets the number of times arenas and slabs have called malloc. This 
+ *  stays flat once they have grown to the load. Allocations made 
+ *  anywhere else, such as by the file cache, are not counted.
+ * 
+ *  returns: The count.
+ */
+unsigned long arena_slab_allocs(void);
+
+#endif
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Compares the epoll, thread pool and io_uring engines under keep-alive and
+# connection-per-request load, for a small in-memory file and a large
+# streamed one.
+# Usage: bench/bench_engines.sh [connections] [seconds]
+set -e
+
+CONNECTIONS=${1:-64}
+SECONDS_PER_RUN=${2:-5}
+PORT=8089
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+ROOT=$(mktemp -d)
+trap 'rm -rf "$ROOT"' EXIT
+
+printf '<html><body>hello</body></html>\n' > "$ROOT/index.html"
+head -c 1048576 /dev/urandom > "$ROOT/large.jpg"
+
+for ENGINE in epoll threads uring; do
+    "$DIR/server" 4 $PORT "$ROOT" --engine=$ENGINE > /dev/null 2>&1 &
+    SERVER=$!
+    sleep 0.5
+    for FILE in /index.html /large.jpg; do
+        for MODE in "" --close; do
+            printf 'engine=%s file=%s ' $ENGINE $FILE
+            "$DIR/bench/loadgen" $PORT $FILE $CONNECTIONS $SECONDS_PER_RUN \
+                $MODE
+        done
+    done
+    kill $SERVER
+    wait $SERVER 2> /dev/null || true
+done
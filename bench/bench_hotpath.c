@@ -0,0 +1,212 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file times the functions on the request hot path one at a
+         time, reporting the cost and heap allocations of each call, so a
+         change to one of them can be judged on its own.
+*/
+#define _GNU_SOURCE
+#include "connops.h"
+#include "serverops.h"
+#include "filecache.h"
+#include "queue.h"
+#include "ring.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ITERATIONS 1000000
+// Calls made before timing starts, to warm caches and branch predictors
+#define WARMUP_DIVISOR 10
+#define RING_CAPACITY 1024
+#define CONTENT_TYPE_LEN 64
+
+// The libc allocator, called by the counting wrappers below
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static atomic_ulong mallocs;
+
+static char* browser_request = 
+    "GET /static/js/app.3f9a1c.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Referer: https://www.example.com/account/settings?tab=profile\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+    "If-None-Match: \"ce8001-2c-6ad286c4\"\r\n"
+    "If-Modified-Since: Fri, 16 Oct 2026 20:19:16 GMT\r\n"
+    "\r\n";
+
+struct hotpath {
+    size_t request_len;
+    char file_path_full[64];
+    char* file_path;
+    int fd;
+    char content_type[CONTENT_TYPE_LEN];
+    char entity_headers[ENTITY_HEADERS_LEN + 1];
+    arena_t arena;
+    queue_t queue;
+    ring_t* ring;
+};
+
+/*
+ * Every allocation made in this process goes through these, so the count 
+ * includes allocations made inside the functions being timed.
+ */
+void* malloc(size_t size) {
+    atomic_fetch_add_explicit(&mallocs, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    atomic_fetch_add_explicit(&mallocs, 1, memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    atomic_fetch_add_explicit(&mallocs, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+/*
+ * Function: now_ns
+ * --------------------
+ *  Gets the current monotonic time.
+ * 
+ *  returns: The time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Function: measure
+ * --------------------
+ *  Times a function over many calls after a warm-up, and prints its cost 
+ *  per call.
+ * 
+ *  name: Name to print.
+ *  op: The function to time.
+ *  hp: State passed to the function.
+ *  iterations: Number of timed calls.
+ * 
+ *  returns: Nothing.
+ */
+static void measure(char* name, void (* op)(struct hotpath*), 
+                    struct hotpath* hp, size_t iterations) {
+    for (size_t i = 0; i < iterations / WARMUP_DIVISOR; i++) {
+        op(hp);
+    }
+    unsigned long allocs = atomic_load(&mallocs);
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        op(hp);
+        // Keep the compiler from dropping the call
+        __asm__ volatile("" : : "r"(hp) : "memory");
+    }
+    double ns = (double)(now_ns() - start) / iterations;
+    allocs = atomic_load(&mallocs) - allocs;
+    printf("%-28s %10.1f %12.3f\n", name, ns, (double)allocs / iterations);
+}
+
+/*
+ * The timed operations. Each makes one call with the same inputs the 
+ * server would see for a typical static file request.
+ */
+static void op_request_parse(struct hotpath* hp) {
+    struct http_request req;
+    request_init(&req);
+    request_parse(&req, browser_request, hp->request_len);
+}
+
+static void op_path_component_exists(struct hotpath* hp) {
+    (void)hp;
+    path_component_exists("static/js/vendor/app.3f9a1c.js");
+}
+
+static void op_open_beneath_root(struct hotpath* hp) {
+    close(open_beneath_root(hp->file_path));
+}
+
+static void op_file_stats(struct hotpath* hp) {
+    struct stat sb;
+    file_stats(hp->fd, hp->file_path, hp->content_type, &sb);
+}
+
+static void op_format_entity_headers(struct hotpath* hp) {
+    format_entity_headers(hp->entity_headers, ENTITY_HEADERS_LEN + 1, 
+                        "text/javascript", "gzip", true, 
+                        "ETag: \"ce8001-2c-6ad286c4\"\r\n", 18342);
+}
+
+static void op_create_response_headers(struct hotpath* hp) {
+    // The arena is reset per request in the server too
+    arena_reset(&hp->arena);
+    create_response_headers(STATUS_OK, STATUS_OK_M, hp->entity_headers, 
+                            HTTP_VERSION_1_1, true, &hp->arena);
+}
+
+static void op_queue(struct hotpath* hp) {
+    queue_enqueue(&hp->queue, hp);
+    queue_dequeue(&hp->queue);
+}
+
+static void op_ring(struct hotpath* hp) {
+    ring_enqueue(hp->ring, hp);
+    ring_dequeue(hp->ring);
+}
+
+int main(int argc, char** argv) {
+    struct hotpath hp = {0};
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 
+                        DEFAULT_ITERATIONS;
+    if (iterations == 0) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // A real file for file_stats to find, opened beneath its directory 
+    // as the server would
+    strcpy(hp.file_path_full, "/tmp/bench_hotpath_XXXXXX.html");
+    hp.fd = mkstemps(hp.file_path_full, strlen(".html"));
+    if (hp.fd < 0) {
+        perror("mkstemps");
+        return EXIT_FAILURE;
+    }
+    hp.file_path = strrchr(hp.file_path_full, '/') + 1;
+    file_cache_init("/tmp", 0, 0, 0);
+
+    hp.request_len = strlen(browser_request);
+    arena_init(&hp.arena, ARENA_BLOCK_SIZE);
+    hp.ring = ring_create(RING_CAPACITY);
+    op_format_entity_headers(&hp);
+
+    printf("%-28s %10s %12s\n", "function", "ns/op", "allocs/op");
+    measure("request_parse", op_request_parse, &hp, iterations);
+    measure("path_component_exists", op_path_component_exists, &hp, 
+            iterations);
+    measure("open_beneath_root", op_open_beneath_root, &hp, iterations);
+    measure("file_stats", op_file_stats, &hp, iterations);
+    measure("format_entity_headers", op_format_entity_headers, &hp, 
+            iterations);
+    measure("create_response_headers", op_create_response_headers, &hp, 
+            iterations);
+    measure("queue_enqueue+dequeue", op_queue, &hp, iterations);
+    measure("ring_enqueue+dequeue", op_ring, &hp, iterations);
+
+    close(hp.fd);
+    unlink(hp.file_path_full);
+    ring_free(hp.ring);
+    arena_destroy(&hp.arena);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Measures connection setup on loopback under each listener setting: every
+# request opens a new connection, so latency covers the handshake, the
+# accept and the first response. Requests are sent at a fixed rate below
+# saturation, so queueing does not hide the setup cost; the backlog-10 run
+# shows the handshake drops of the old default when connections arrive in
+# bursts.
+# Usage: bench/bench_listener.sh [engine] [connections] [seconds] [rate]
+set -e
+
+ENGINE=${1:-threads}
+CONNECTIONS=${2:-64}
+SECONDS_PER_RUN=${3:-5}
+RATE=${4:-4000}
+PORT=8091
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+ROOT=$(mktemp -d)
+trap 'kill $SERVER 2> /dev/null || true; rm -rf "$ROOT"' EXIT
+
+printf '<html><body>hello</body></html>\n' > "$ROOT/index.html"
+
+# Listeners only take Fast Open with bit 2 of the sysctl set
+if [ $(( $(cat /proc/sys/net/ipv4/tcp_fastopen) & 2 )) -eq 0 ]; then
+    echo "note: net.ipv4.tcp_fastopen lacks the server bit, fastopen runs" \
+        "fall back to a normal handshake" >&2
+fi
+
+run() {
+    NAME=$1
+    SERVER_ARGS=$2
+    LOADGEN_ARGS=$3
+    "$DIR/server" 4 $PORT "$ROOT" --engine=$ENGINE --access-log=off \
+        $SERVER_ARGS > /dev/null 2>&1 &
+    SERVER=$!
+    sleep 0.5
+    printf 'listener=%s ' $NAME
+    "$DIR/bench/loadgen" $PORT /index.html $CONNECTIONS $SECONDS_PER_RUN \
+        --close --rate=$RATE $LOADGEN_ARGS
+    kill $SERVER
+    wait $SERVER 2> /dev/null || true
+}
+
+run backlog-10 --backlog=10 ""
+run default "" ""
+run nodelay-off --nodelay=off ""
+run defer-accept --defer-accept=5 ""
+run fastopen --fastopen=256 --fastopen
+run defer+fastopen "--defer-accept=5 --fastopen=256" --fastopen
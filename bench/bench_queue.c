@@ -0,0 +1,252 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file benchmarks handing work from one producer to a pool of 
+         consumer threads, comparing the mutex/condvar linked-list queue, 
+         the lock-free ring and per-worker work-stealing queues.
+*/
+#define _GNU_SOURCE
+#include "queue.h"
+#include "ring.h"
+#include "pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_ITEMS 200000
+#define DEFAULT_MAX_THREADS 64
+#define RING_CAPACITY 1024
+#define PARK_NS 1000000000ULL
+
+typedef enum impl {
+    IMPL_QUEUE,
+    IMPL_RING,
+    IMPL_FIFO
+} impl_t;
+
+static char* impl_names[] = { "queue", "ring", "fifo" };
+
+struct item {
+    uint64_t enqueued_ns;
+    uint64_t latency_ns;
+};
+
+struct bench {
+    impl_t impl;
+    size_t n_items;
+    struct item* items;
+    queue_t queue;
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t queue_cond;
+    ring_t* ring;
+    // The server's worker pool, with the benchmark's consumers as workers
+    struct worker_pool pool;
+};
+
+struct consumer {
+    struct bench* b;
+    struct worker_slot* slot;
+};
+
+// Consumers stop when they dequeue this
+static struct item stop_item;
+
+/*
+ * Function: now_ns
+ * --------------------
+ *  Gets the current monotonic time.
+ * 
+ *  returns: The time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Function: put
+ * --------------------
+ *  Hands one item to the consumers, the same way the server hands over a 
+ *  connection.
+ */
+static void put(struct bench* b, struct item* item) {
+    if (b->impl == IMPL_QUEUE) {
+        pthread_mutex_lock(&b->queue_mutex);
+        queue_enqueue(&b->queue, item);
+        pthread_cond_signal(&b->queue_cond);
+        pthread_mutex_unlock(&b->queue_mutex);
+    } else if (b->impl == IMPL_RING) {
+        ring_enqueue_wake(b->ring, item);
+    } else {
+        // Items stand in for connections, the pool never looks inside
+        pool_dispatch(&b->pool, (struct conn*)item, -1);
+    }
+}
+
+/*
+ * Function: take
+ * --------------------
+ *  Waits for and removes one item.
+ */
+static struct item* take(struct bench* b, struct worker_slot* slot) {
+    struct item* item = NULL;
+    if (b->impl == IMPL_QUEUE) {
+        pthread_mutex_lock(&b->queue_mutex);
+        while ((item = queue_dequeue(&b->queue)) == NULL) {
+            pthread_cond_wait(&b->queue_cond, &b->queue_mutex);
+        }
+        pthread_mutex_unlock(&b->queue_mutex);
+    } else if (b->impl == IMPL_RING) {
+        item = ring_dequeue_wait(b->ring);
+    } else {
+        while ((item = (struct item*)pool_take(&b->pool, slot)) == NULL) {
+            pool_park(&b->pool, slot, PARK_NS);
+        }
+    }
+    return item;
+}
+
+/*
+ * Function: consumer
+ * --------------------
+ *  Takes items until told to stop, recording each hand-off latency.
+ */
+static void* consumer(void* arg) {
+    struct consumer* c = arg;
+    struct item* item = NULL;
+
+    while ((item = take(c->b, c->slot)) != &stop_item) {
+        item->latency_ns = now_ns() - item->enqueued_ns;
+    }
+    if (c->slot != NULL) {
+        // Leave like a retiring worker, so stop items still on this queue 
+        // go to the others
+        atomic_store(&c->slot->busy, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (fifo_size(&c->slot->fifo) > 0) {
+            pool_wake(&c->b->pool, NULL);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: compare_latency
+ * --------------------
+ *  qsort comparator for latencies.
+ */
+static int compare_latency(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Function: run
+ * --------------------
+ *  Runs one producer against n_threads consumers and prints a result row.
+ */
+static void run(impl_t impl, size_t n_items, int n_threads) {
+    struct bench b = { impl, n_items, NULL, { NULL, NULL }, 
+                    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 
+                    { 0 } };
+    pthread_t threads[n_threads];
+    struct consumer consumers[n_threads];
+
+    b.items = calloc(n_items, sizeof(struct item));
+    uint64_t* latencies = malloc(sizeof(uint64_t) * n_items);
+    if (b.items == NULL || latencies == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (impl == IMPL_RING) {
+        b.ring = ring_create(RING_CAPACITY);
+    } else if (impl == IMPL_FIFO) {
+        // A fixed set of workers, so the pool never grows or retires
+        b.pool.dispatch = DISPATCH_LEAST;
+        b.pool.slots = aligned_alloc(CACHE_LINE, 
+                                n_threads * sizeof(struct worker_slot));
+        memset(b.pool.slots, 0, n_threads * sizeof(struct worker_slot));
+        for (int i = 0; i < n_threads; i++) {
+            fifo_init(&b.pool.slots[i].fifo, FIFO_CAPACITY);
+            b.pool.slots[i].pool = &b.pool;
+            b.pool.slots[i].cpu = b.pool.slots[i].node = -1;
+            atomic_store(&b.pool.slots[i].active, true);
+        }
+        atomic_store(&b.pool.n_slots, n_threads);
+        atomic_store(&b.pool.threads, n_threads);
+        b.pool.min_threads = b.pool.max_threads = n_threads;
+    }
+
+    for (int i = 0; i < n_threads; i++) {
+        consumers[i].b = &b;
+        consumers[i].slot = b.pool.slots != NULL ? &b.pool.slots[i] : NULL;
+        pthread_create(&threads[i], NULL, consumer, &consumers[i]);
+    }
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n_items; i++) {
+        b.items[i].enqueued_ns = now_ns();
+        put(&b, &b.items[i]);
+    }
+    for (int i = 0; i < n_threads; i++) {
+        put(&b, &stop_item);
+    }
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < n_items; i++) {
+        latencies[i] = b.items[i].latency_ns;
+        total += latencies[i];
+    }
+    qsort(latencies, n_items, sizeof(uint64_t), compare_latency);
+
+    printf("%-6s %7d %12.3f %12.0f %12llu %12llu\n", 
+            impl_names[impl], n_threads, 
+            n_items / (elapsed / 1e9) / 1e6, (double)total / n_items, 
+            (unsigned long long)latencies[n_items / 2], 
+            (unsigned long long)latencies[n_items * 99 / 100]);
+    fflush(stdout);
+
+    if (b.ring != NULL) {
+        ring_free(b.ring);
+    }
+    if (b.pool.slots != NULL) {
+        for (int i = 0; i < n_threads; i++) {
+            fifo_destroy(&b.pool.slots[i].fifo);
+        }
+        free(b.pool.slots);
+    }
+    free(latencies);
+    free(b.items);
+}
+
+/*
+ * Main entrypoint.
+ * 
+ * Usage: bench_queue [items] [max_threads]
+ */
+int main(int argc, char** argv) {
+    size_t n_items = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_ITEMS;
+    int max_threads = argc > 2 ? atoi(argv[2]) : DEFAULT_MAX_THREADS;
+    if (n_items == 0 || max_threads <= 0) {
+        fprintf(stderr, "usage: %s [items] [max_threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("# one producer, %zu items per run\n", n_items);
+    printf("%-6s %7s %12s %12s %12s %12s\n", "impl", "threads", "Mops/s", 
+            "mean_ns", "p50_ns", "p99_ns");
+    for (int n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        run(IMPL_QUEUE, n_items, n_threads);
+        run(IMPL_RING, n_items, n_threads);
+        run(IMPL_FIFO, n_items, n_threads);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Runs the macro-benchmark suite: starts the server on loopback against a
+# generated document root of small and large files and drives it with
+# loadgen. Each scenario prints one line of key=value pairs.
+# Usage: bench/bench_suite.sh [engine] [connections] [seconds] [rate]
+set -e
+
+ENGINE=${1:-epoll}
+CONNECTIONS=${2:-64}
+SECONDS_PER_RUN=${3:-5}
+RATE=${4:-20000}
+PORT=8090
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+ROOT=$(mktemp -d)
+trap 'kill $SERVER 2> /dev/null || true; rm -rf "$ROOT"' EXIT
+
+# Small files are served from the cache, large ones are streamed
+printf '<html><body>hello</body></html>\n' > "$ROOT/index.html"
+head -c 4096 /dev/urandom | base64 > "$ROOT/style.css"
+head -c 16384 /dev/urandom | base64 > "$ROOT/app.js"
+head -c 65536 /dev/urandom > "$ROOT/logo.jpg"
+head -c 1048576 /dev/urandom > "$ROOT/large.jpg"
+head -c 8388608 /dev/urandom > "$ROOT/huge.jpg"
+
+# Mostly small files with the odd large one, as a page load would be
+cat > "$ROOT/mix.txt" <<MIX
+/index.html
+/index.html
+/index.html
+/index.html
+/style.css
+/style.css
+/app.js
+/app.js
+/logo.jpg
+/large.jpg
+MIX
+
+"$DIR/server" 4 $PORT "$ROOT" --engine=$ENGINE --access-log=off \
+    > /dev/null 2>&1 &
+SERVER=$!
+sleep 0.5
+
+run() {
+    SCENARIO=$1
+    shift
+    printf 'scenario=%s engine=%s ' $SCENARIO $ENGINE
+    "$DIR/bench/loadgen" $PORT "$@"
+}
+
+run small_keepalive /index.html $CONNECTIONS $SECONDS_PER_RUN
+run small_close /index.html $CONNECTIONS $SECONDS_PER_RUN --close
+run large_keepalive /large.jpg $CONNECTIONS $SECONDS_PER_RUN
+run huge_keepalive /huge.jpg $CONNECTIONS $SECONDS_PER_RUN
+run mix_keepalive --mix="$ROOT/mix.txt" $CONNECTIONS $SECONDS_PER_RUN
+run mix_close --mix="$ROOT/mix.txt" $CONNECTIONS $SECONDS_PER_RUN --close
+run small_open /index.html $CONNECTIONS $SECONDS_PER_RUN --rate=$RATE
+run mix_open --mix="$ROOT/mix.txt" $CONNECTIONS $SECONDS_PER_RUN \
+    --rate=$RATE
@@ -0,0 +1,506 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file is an HTTP load generator. Each connection runs on its
+         own thread, either closed-loop, sending the next request as soon
+         as the last response is read, or open-loop, sending on a fixed
+         schedule so a slow server cannot hold the offered load down.
+*/
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_CONNECTIONS 64
+#define DEFAULT_SECONDS 5
+#define RESPONSE_BUFFER_LEN 65536
+#define REQUEST_LEN 512
+#define MIX_MAX 1024
+#define CLOSE_OPTION "--close"
+#define RATE_OPTION "--rate="
+#define MIX_OPTION "--mix="
+#define FASTOPEN_OPTION "--fastopen"
+#define CONTENT_LENGTH "\r\nContent-Length:"
+// Latencies are bucketed with 16 buckets per power of two nanoseconds
+#define HIST_SUB_BITS 4
+#define HIST_SUBS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUBS * 48)
+
+struct loadgen {
+    struct sockaddr_in addr;
+    // Requests to send, picked at random for each exchange
+    char (*requests)[REQUEST_LEN];
+    size_t* request_lens;
+    size_t n_requests;
+    // New connection for every request instead of keep-alive
+    bool close_each;
+    // Send the first request in the SYN with TCP Fast Open
+    bool fastopen;
+    // Seconds between requests on one connection, 0 for closed-loop
+    double interval;
+    int n_connections;
+    // Longest wait on one socket call, so a connection the server dropped 
+    // during the handshake ends as an error instead of outliving the run
+    struct timeval timeout;
+    double start;
+    atomic_bool stop;
+};
+
+/*
+ * What one connection measured. Each thread only writes its own, they are 
+ * added up once the run is over.
+ */
+struct client {
+    struct loadgen* lg;
+    int id;
+    uint64_t rng;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long long bytes;
+    unsigned long latencies[HIST_BUCKETS];
+};
+
+/*
+ * Function: now_seconds
+ * --------------------
+ *  Gets the current monotonic time.
+ * 
+ *  returns: The time in seconds.
+ */
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Function: sleep_until
+ * --------------------
+ *  Sleeps until a monotonic time.
+ * 
+ *  when: The time in seconds.
+ * 
+ *  returns: Nothing.
+ */
+static void sleep_until(double when) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)when;
+    ts.tv_nsec = (long)((when - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == 
+            EINTR) {
+    }
+}
+
+/*
+ * Function: latency_bucket
+ * --------------------
+ *  Finds the histogram bucket for a latency.
+ * 
+ *  ns: The latency in nanoseconds.
+ * 
+ *  returns: The bucket index.
+ */
+static int latency_bucket(uint64_t ns) {
+    if (ns < HIST_SUBS) {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int bucket = (msb - HIST_SUB_BITS + 1) * HIST_SUBS + 
+                (int)((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUBS - 1));
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+/*
+ * Function: latency_value
+ * --------------------
+ *  Gets the latency a bucket stands for, the middle of its range.
+ * 
+ *  bucket: The bucket index.
+ * 
+ *  returns: The latency in nanoseconds.
+ */
+static double latency_value(int bucket) {
+    if (bucket < HIST_SUBS) {
+        return bucket;
+    }
+    int msb = bucket / HIST_SUBS + HIST_SUB_BITS - 1;
+    uint64_t width = (uint64_t)1 << (msb - HIST_SUB_BITS);
+    uint64_t low = ((uint64_t)HIST_SUBS + bucket % HIST_SUBS) * width;
+    return low + width / 2.0;
+}
+
+/*
+ * Function: percentile
+ * --------------------
+ *  Gets a percentile of a latency histogram.
+ * 
+ *  latencies: The histogram.
+ *  count: Number of latencies in it.
+ *  p: The percentile, between 0 and 1.
+ * 
+ *  returns: The latency in microseconds, 0 if there are none.
+ */
+static double percentile(unsigned long* latencies, unsigned long count, 
+                        double p) {
+    unsigned long rank = (unsigned long)(p * count + 0.5);
+    unsigned long seen = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += latencies[i];
+        if (seen >= rank) {
+            return latency_value(i) / 1000;
+        }
+    }
+    return latency_value(HIST_BUCKETS - 1) / 1000;
+}
+
+/*
+ * Function: connect_server
+ * --------------------
+ *  Opens a connection to the server. With Fast Open the handshake is left 
+ *  to the first request.
+ * 
+ *  lg: The load generator.
+ * 
+ *  returns: The socket, or -1 on error.
+ */
+static int connect_server(struct loadgen* lg) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &lg->timeout, 
+                sizeof(lg->timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &lg->timeout, 
+                sizeof(lg->timeout));
+    if (!lg->fastopen && 
+            connect(fd, (struct sockaddr*)&lg->addr, sizeof(lg->addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Function: exchange
+ * --------------------
+ *  Sends one request and reads its whole response.
+ * 
+ *  fd: The connection.
+ *  request: The request.
+ *  request_len: Length of the request.
+ *  buffer: Buffer to read into.
+ *  fastopen_to: Address to connect to with the request in the SYN, or 
+ *  NULL if the connection is open.
+ * 
+ *  returns: The response length, or -1 on error.
+ */
+static ssize_t exchange(int fd, char* request, size_t request_len, 
+                        char* buffer, struct sockaddr_in* fastopen_to) {
+    size_t sent = 0;
+    while (sent < request_len) {
+        // Without a cookie yet the kernel sends a plain SYN and the data 
+        // once the handshake completes
+        ssize_t n = fastopen_to != NULL && sent == 0 ? 
+                    sendto(fd, request, request_len, 
+                        MSG_FASTOPEN | MSG_NOSIGNAL, 
+                        (struct sockaddr*)fastopen_to, sizeof(*fastopen_to)) : 
+                    send(fd, request + sent, request_len - sent, 
+                        MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+
+    // Read the headers, then however much body they announce
+    size_t len = 0, total = 0;
+    char* end = NULL;
+    while (end == NULL) {
+        ssize_t n = recv(fd, buffer + len, RESPONSE_BUFFER_LEN - 1 - len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        len += n;
+        buffer[len] = '\0';
+        end = strstr(buffer, "\r\n\r\n");
+        if (end == NULL && len == RESPONSE_BUFFER_LEN - 1) {
+            return -1;
+        }
+    }
+    size_t header_len = end - buffer + 4;
+    char* length = strcasestr(buffer, CONTENT_LENGTH);
+    size_t body_len = length != NULL && length < end ? 
+                    strtoul(length + strlen(CONTENT_LENGTH), NULL, 10) : 0;
+
+    total = header_len + body_len;
+    while (len < total) {
+        size_t want = total - len;
+        if (want > RESPONSE_BUFFER_LEN - 1) {
+            want = RESPONSE_BUFFER_LEN - 1;
+        }
+        ssize_t n = recv(fd, buffer, want, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        len += n;
+    }
+    return total;
+}
+
+/*
+ * Function: next_random
+ * --------------------
+ *  Steps a connection's xorshift generator.
+ * 
+ *  state: The generator state, never zero.
+ * 
+ *  returns: The next random number.
+ */
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/*
+ * Function: client
+ * --------------------
+ *  Runs one connection's request loop until told to stop.
+ * 
+ *  arg: The connection's client struct.
+ * 
+ *  returns: NULL.
+ */
+static void* client(void* arg) {
+    struct client* c = arg;
+    struct loadgen* lg = c->lg;
+    char* buffer = malloc(RESPONSE_BUFFER_LEN);
+    int fd = -1;
+    // Open-loop connections are staggered across one interval
+    double scheduled = lg->start + 
+                    lg->interval * c->id / lg->n_connections;
+
+    while (!atomic_load_explicit(&lg->stop, memory_order_relaxed)) {
+        double begin = now_seconds();
+        if (lg->interval > 0) {
+            if (scheduled > begin) {
+                sleep_until(scheduled);
+            }
+            // Measured from when it should have been sent, so time spent 
+            // behind schedule counts against the server
+            begin = scheduled;
+            scheduled += lg->interval;
+        }
+        bool fresh = fd < 0;
+        if (fd < 0 && (fd = connect_server(lg)) < 0) {
+            c->errors++;
+            continue;
+        }
+
+        size_t i = lg->n_requests > 1 ? 
+                    next_random(&c->rng) % lg->n_requests : 0;
+        ssize_t n = exchange(fd, lg->requests[i], lg->request_lens[i], 
+                            buffer, 
+                            fresh && lg->fastopen ? &lg->addr : NULL);
+        if (n < 0) {
+            c->errors++;
+        } else {
+            uint64_t ns = (uint64_t)((now_seconds() - begin) * 1e9);
+            c->latencies[latency_bucket(ns)]++;
+            c->requests++;
+            c->bytes += n;
+        }
+        if (n < 0 || lg->close_each) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Function: add_request
+ * --------------------
+ *  Adds a GET request for a path to the mix.
+ * 
+ *  lg: The load generator.
+ *  path: The path.
+ * 
+ *  returns: Nothing.
+ */
+static void add_request(struct loadgen* lg, char* path) {
+    if (lg->n_requests == MIX_MAX) {
+        return;
+    }
+    lg->request_lens[lg->n_requests] = snprintf( 
+                            lg->requests[lg->n_requests], REQUEST_LEN, 
+                            "GET %s HTTP/1.1\r\nHost: localhost\r\n%s\r\n", 
+                            path, lg->close_each ? 
+                            "Connection: close\r\n" : "");
+    lg->n_requests++;
+}
+
+/*
+ * Function: load_mix
+ * --------------------
+ *  Reads a request mix, one path per line. A path listed several times is 
+ *  requested that much more often. Blank lines and lines starting with 
+ *  '#' are skipped.
+ * 
+ *  lg: The load generator.
+ *  file: The mix file.
+ * 
+ *  returns: true if at least one path was read, false otherwise.
+ */
+static bool load_mix(struct loadgen* lg, char* file) {
+    char line[REQUEST_LEN];
+    FILE* f = fopen(file, "r");
+    if (f == NULL) {
+        perror(file);
+        return false;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && line[0] != '#') {
+            add_request(lg, line);
+        }
+    }
+    fclose(f);
+    return lg->n_requests > 0;
+}
+
+int main(int argc, char** argv) {
+    struct loadgen lg = {0};
+    int seconds = DEFAULT_SECONDS;
+    double rate = 0;
+    char* path = NULL, * mix = NULL;
+    char* positional[4] = {NULL};
+    int n_positional = 0;
+
+    lg.n_connections = DEFAULT_CONNECTIONS;
+    lg.addr.sin_family = AF_INET;
+    lg.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], CLOSE_OPTION) == 0) {
+            lg.close_each = true;
+        } else if (strcmp(argv[i], FASTOPEN_OPTION) == 0) {
+            lg.fastopen = true;
+        } else if (strncmp(argv[i], RATE_OPTION, strlen(RATE_OPTION)) == 0) {
+            rate = atof(argv[i] + strlen(RATE_OPTION));
+        } else if (strncmp(argv[i], MIX_OPTION, strlen(MIX_OPTION)) == 0) {
+            mix = argv[i] + strlen(MIX_OPTION);
+        } else if (n_positional < 4) {
+            positional[n_positional++] = argv[i];
+        }
+    }
+    // A request mix takes the place of the path
+    int arg = 0;
+    if (n_positional > 0) {
+        lg.addr.sin_port = htons(atoi(positional[arg++]));
+    }
+    if (mix == NULL && arg < n_positional) {
+        path = positional[arg++];
+    }
+    if (arg < n_positional) {
+        lg.n_connections = atoi(positional[arg++]);
+    }
+    if (arg < n_positional) {
+        seconds = atoi(positional[arg++]);
+    }
+    if (n_positional < 1 || (path == NULL && mix == NULL)) {
+        fprintf(stderr, "Usage: %s <port> <path> [connections] [seconds] "
+                "[%s] [%s] [%s<requests per second>]\n"
+                "       %s <port> %s<file> [connections] [seconds] ...\n", 
+                argv[0], CLOSE_OPTION, FASTOPEN_OPTION, RATE_OPTION, argv[0], 
+                MIX_OPTION);
+        return EXIT_FAILURE;
+    }
+    if (lg.n_connections <= 0 || seconds <= 0 || rate < 0) {
+        fprintf(stderr, "Invalid connection count, duration or rate\n");
+        return EXIT_FAILURE;
+    }
+
+    lg.requests = malloc(MIX_MAX * sizeof(*lg.requests));
+    lg.request_lens = malloc(MIX_MAX * sizeof(size_t));
+    if (mix != NULL) {
+        if (!load_mix(&lg, mix)) {
+            fprintf(stderr, "No paths in request mix %s\n", mix);
+            return EXIT_FAILURE;
+        }
+    } else {
+        add_request(&lg, path);
+    }
+    lg.timeout.tv_sec = seconds;
+    // The rate is shared out evenly between the connections
+    lg.interval = rate > 0 ? lg.n_connections / rate : 0;
+
+    pthread_t* threads = malloc(lg.n_connections * sizeof(pthread_t));
+    struct client* clients = calloc(lg.n_connections, sizeof(struct client));
+    lg.start = now_seconds();
+    for (int i = 0; i < lg.n_connections; i++) {
+        clients[i].lg = &lg;
+        clients[i].id = i;
+        clients[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        pthread_create(&threads[i], NULL, client, &clients[i]);
+    }
+    sleep(seconds);
+    atomic_store(&lg.stop, true);
+    for (int i = 0; i < lg.n_connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_seconds() - lg.start;
+
+    // Add up what every connection measured
+    struct client* total = &clients[0];
+    for (int i = 1; i < lg.n_connections; i++) {
+        total->requests += clients[i].requests;
+        total->errors += clients[i].errors;
+        total->bytes += clients[i].bytes;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            total->latencies[b] += clients[i].latencies[b];
+        }
+    }
+
+    printf("connections=%d mode=%s loop=%s paths=%zu requests=%lu "
+            "errors=%lu req_per_s=%.0f mb_per_s=%.1f p50_us=%.1f "
+            "p99_us=%.1f p999_us=%.1f\n", lg.n_connections, 
+            lg.close_each ? "close" : "keepalive", 
+            rate > 0 ? "open" : "closed", lg.n_requests, total->requests, 
+            total->errors, total->requests / elapsed, 
+            total->bytes / elapsed / (1024 * 1024), 
+            percentile(total->latencies, total->requests, 0.50), 
+            percentile(total->latencies, total->requests, 0.99), 
+            percentile(total->latencies, total->requests, 0.999));
+    free(clients);
+    free(threads);
+    free(lg.requests);
+    free(lg.request_lens);
+    return EXIT_SUCCESS;
+}
@@ -3,76 +3,323 @@ Author : Surya Venkatesh
 Purpose: This file contains the functions used for handling a 
          client connection.
 */
+#define _GNU_SOURCE
 #include "connops.h"
-#include "queue.h"
 #include "serverops.h"
+#include "filecache.h"
+#include "request.h"
+#include "arena.h"
+#include "accesslog.h"
+#include "metrics.h"
 #include <netdb.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/sendfile.h>
 #include <fcntl.h>
+#include <time.h>
+
+// Connections are reused along with their arenas rather than freed
+static slab_t conn_pool = SLAB_INITIALIZER(struct conn);
 
 /*
  * Function: handle_client
  * --------------------
- *  Handles a client connection.
+ *  Serves a client connection on a worker thread until it closes, then 
+ *  frees it.
  * 
- *  arg: Pointer to the argument struct.
+ *  conn: The connection.
+ *  shard: The shard whose counters to update.
  * 
- *  returns: NULL.
+ *  returns: Nothing.
  */
-void* handle_client(void* arg) {
-    if (arg == NULL) {
-        return NULL;
+void handle_client(struct conn* conn, struct shard* shard) {
+    metrics_observe(HIST_QUEUE_WAIT, monotonic_ns() - conn->accepted_ns);
+
+    // Bound how long a worker waits on an idle or stalled client
+    struct timeval timeout = { server_options.idle_timeout, 0 };
+    setsockopt(conn->clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, 
+                sizeof(timeout));
+    setsockopt(conn->clientfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, 
+                sizeof(timeout));
+
+    // The socket is blocking here, so the steps run straight through. A 
+    // timeout surfaces as CONN_AGAIN and ends the loop like an error.
+    while (conn_step(conn) == SUCCESS) {
+        atomic_fetch_add_explicit(&shard->requests, conn->n_responses, 
+                                memory_order_relaxed);
+        if (!conn_next_request(conn)) {
+            break;
+        }
     }
-    // Make queue to free memory
-    queue_t* free_queue = queue_create();
-    struct arg* args = (struct arg*)arg;
-    int clientfd = *(args->clientfd);
-    char* root_path = args->root_path;
-	char buffer[BUFFER_LEN + 1] = {0};
-    
-    // Read client request
-    if (read_request(clientfd, buffer) != SUCCESS) {
-        return close_and_clean(clientfd, free_queue);
+    conn_free(conn);
+}
+
+/*
+ * Function: conn_create
+ * --------------------
+ *  Creates the state for a new client connection.
+ * 
+ *  clientfd: Client file descriptor.
+ *  root_path: The root path of the server.
+ * 
+ *  returns: Pointer to the connection.
+ */
+struct conn* conn_create(int clientfd, char* root_path) {
+    struct conn* conn = slab_get(&conn_pool);
+    // Only a newly carved connection needs its arena set up
+    if (conn->arena.head == NULL) {
+        arena_init(&conn->arena, ARENA_BLOCK_SIZE);
     }
 
-	// READ REQUEST LINE
-	// Get only the first line of the request
-    if (strstr(buffer, END_OF_REQ_LINE) == NULL) {
-        fprintf(stderr, "ERROR, request line not found\n");
-        return close_and_clean(clientfd, free_queue);
-    }
-    char* request_line = NULL, * method = NULL, 
-        * file_path = NULL, * protocol_version = NULL;
-    if (!parse_request(buffer, &request_line, &method, 
-                        &file_path, &protocol_version)) {
-        fprintf(stderr, "ERROR, malformed request provided\n");
-        return close_and_clean(clientfd, free_queue);
+    conn->clientfd = clientfd;
+    conn->root_path = root_path;
+    conn->state = CONN_READ_REQUEST;
+    conn->buffer[0] = '\0';
+    conn->buffer_len = 0;
+    conn->parsed_len = 0;
+    conn->keep_alive = false;
+    conn->n_responses = 0;
+    conn->cur_response = 0;
+    conn->idle_prev = NULL;
+    conn->idle_next = NULL;
+    conn->last_active = 0;
+    conn->accepted_ns = monotonic_ns();
+    conn->recv_ns = 0;
+    conn->request_start_ns = 0;
+    request_init(&conn->request);
+    metrics_conn_opened();
+
+    return conn;
+}
+
+/*
+ * Function: conn_free
+ * --------------------
+ *  Closes the client socket and any open file, then returns the 
+ *  connection to the pool.
+ * 
+ *  conn: The connection.
+ * 
+ *  returns: Nothing.
+ */
+void conn_free(struct conn* conn) {
+    if (conn == NULL) return;
+    for (size_t i = conn->cur_response; i < conn->n_responses; i++) {
+        finish_response(&conn->responses[i]);
     }
+    close(conn->clientfd);
+    metrics_conn_closed();
+    // The arena's block stays with the connection for its next use
+    arena_reset(&conn->arena);
+    slab_put(&conn_pool, conn);
+}
+
+/*
+ * Function: conn_next_request
+ * --------------------
+ *  Readies a kept-alive connection for its next request, carrying over any 
+ *  bytes received after the end of the current one.
+ * 
+ *  conn: The connection.
+ * 
+ *  returns: true if the connection should stay open, false otherwise.
+ */
+bool conn_next_request(struct conn* conn) {
+    if (!conn->keep_alive) {
+        return false;
+    }
+
+    // Move the start of the next request to the front of the buffer
+    size_t leftover = conn->buffer_len - conn->parsed_len;
+    memmove(conn->buffer, conn->buffer + conn->parsed_len, leftover);
+    conn->buffer_len = leftover;
+    conn->buffer[leftover] = '\0';
+    conn->parsed_len = 0;
+
+    // Per-request memory is no longer needed
+    arena_reset(&conn->arena);
+    conn->n_responses = 0;
+    conn->cur_response = 0;
+    conn->state = CONN_READ_REQUEST;
+
+    return true;
+}
+
+/*
+ * Function: conn_received
+ * --------------------
+ *  Accounts for bytes received into the connection buffer, noting when 
+ *  the request they belong to started arriving.
+ * 
+ *  conn: The connection.
+ *  n: The number of bytes received.
+ * 
+ *  returns: Nothing.
+ */
+void conn_received(struct conn* conn, size_t n) {
+    conn->buffer_len += n;
+    // Null-terminate string
+    conn->buffer[conn->buffer_len] = '\0';
 
-	// Write request log
-	printf("%s %s %s\n", method, file_path, protocol_version);
+    conn->recv_ns = monotonic_ns();
+    if (conn->request_start_ns == 0) {
+        conn->request_start_ns = conn->recv_ns;
+    }
+}
 
+/*
+ * Function: conn_step
+ * --------------------
+ *  Drives the connection through its states until the response has been 
+ *  sent, an error occurs, or the socket would block.
+ * 
+ *  conn: The connection.
+ * 
+ *  returns: SUCCESS when done, CONN_AGAIN if it would block, or ERROR.
+ */
+int conn_step(struct conn* conn) {
+    int status = SUCCESS;
+
+    while (conn->state != CONN_DONE) {
+        switch (conn->state) {
+        case CONN_READ_REQUEST:
+            if ((status = read_request(conn)) != SUCCESS) return status;
+            conn->state = CONN_PREPARE_RESPONSE;
+            break;
+        case CONN_PREPARE_RESPONSE:
+            if ((status = prepare_responses(conn)) != SUCCESS) return status;
+            conn->state = CONN_SEND_RESPONSE;
+            break;
+        case CONN_SEND_RESPONSE:
+            if ((status = send_response(conn)) != SUCCESS) return status;
+            conn->state = CONN_DONE;
+            break;
+        case CONN_DONE:
+            break;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Function: prepare_responses
+ * --------------------
+ *  Prepares a response for every complete request in the buffer, so 
+ *  pipelined requests are all handled in one pass.
+ * 
+ *  conn: The connection.
+ * 
+ *  returns: SUCCESS or ERROR.
+ */
+int prepare_responses(struct conn* conn) {
+    struct http_request* req = &conn->request;
+
+    while (conn->n_responses < PIPELINE_MAX) {
+        parse_status_t status = request_parse(req, 
+                                conn->buffer + conn->parsed_len, 
+                                conn->buffer_len - conn->parsed_len);
+        if (status == PARSE_PARTIAL) {
+            break;
+        }
+        // Taken before the response is prepared, which may go to disk
+        uint64_t parsed_ns = monotonic_ns();
+        uint64_t parse_ns = conn->request_start_ns ? 
+                            parsed_ns - conn->request_start_ns : 0;
+
+        struct response* res = &conn->responses[conn->n_responses];
+        if (status == PARSE_ERROR || 
+                prepare_response(conn, req, res) != SUCCESS) {
+            // Still answer the requests before it, then hang up
+            conn->keep_alive = false;
+            return conn->n_responses > 0 ? SUCCESS : ERROR;
+        }
+        conn->n_responses++;
+        conn->parsed_len += req->length;
+        request_init(req);
+        metrics_observe(HIST_PARSE, parse_ns);
+        // Bytes already here for the next request came with the last read
+        conn->request_start_ns = conn->parsed_len < conn->buffer_len ? 
+                                conn->recv_ns : 0;
+
+        // Nothing after a request that closes the connection is answered
+        conn->keep_alive = res->keep_alive;
+        if (!res->keep_alive) {
+            break;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Function: request_ready
+ * --------------------
+ *  Parses what has arrived of the next request in the buffer, picking up 
+ *  where the last call stopped.
+ * 
+ *  conn: The connection.
+ * 
+ *  returns: true if the request is complete or malformed, false if more of 
+ *  it is needed.
+ */
+bool request_ready(struct conn* conn) {
+    return request_parse(&conn->request, conn->buffer + conn->parsed_len, 
+                        conn->buffer_len - conn->parsed_len) != PARSE_PARTIAL;
+}
+
+/*
+ * Function: prepare_response
+ * --------------------
+ *  Resolves the file for one parsed request and builds the response 
+ *  headers.
+ * 
+ *  conn: The connection.
+ *  req: The complete request, whose request line is modified.
+ *  res: The response to fill in.
+ * 
+ *  returns: SUCCESS or ERROR.
+ */
+int prepare_response(struct conn* conn, struct http_request* req, 
+                    struct response* res) {
+    res->start_ns = conn->request_start_ns ? conn->request_start_ns : 
+                    monotonic_ns();
+
+	// READ REQUEST LINE
+    char* http_version = NULL;
+    if (request_matches(req, req->version, HTTP_VERSION)) {
+        http_version = HTTP_VERSION;
+    } else if (request_matches(req, req->version, HTTP_VERSION_1_1)) {
+        http_version = HTTP_VERSION_1_1;
+    }
+    if (!request_matches(req, req->method, GET_METHOD) || 
+            http_version == NULL) {
+        fprintf(stderr, "ERROR, malformed request provided\n");
+        return ERROR;
+    }
+    res->keep_alive = wants_keep_alive(req, http_version);
+    char* file_path = request_token(req, req->path);
 
-	// Check if file exists in the root path
-	char* file_path_full = malloc(sizeof(char) * (strlen(root_path) + 
-                            strlen(file_path)) + EXTRA_INCASE_NOSLASH + 1);
-    malloc_check_close(file_path_full, clientfd, free_queue);
-    queue_enqueue(free_queue, file_path_full);
+    // Logged once the response has been sent
+    res->path = file_path;
+    res->http_version = http_version;
 
-	strcpy(file_path_full, root_path);
-    // Add trailing slash if not present at the start of file_path
-    if (strlen(file_path) > 0 && file_path[0] != '/') {
-        strcat(file_path_full, "/");
+    if (strcmp(file_path, METRICS_PATH) == 0) {
+        return prepare_metrics_response(conn, res, http_version);
     }
-	strcat(file_path_full, file_path);
+
+    // Files are opened relative to the root, so the path is used as it is
+    char* relative_path = file_path + strspn(file_path, "/");
 
     int file_status = 1;
-    size_t file_size = 0;
+    struct file_entry* file = NULL;
     // Check if file path contains path component
     if (path_component_exists(file_path)) {
         // 404 - Invalid path provided
@@ -80,83 +327,293 @@ void* handle_client(void* arg) {
     }
 
     // SEND RESPONSE
-    char status_code[STATUS_CODE_LEN + 1] = {0};
-    char content_type[MAX_CONTENT_TYPE_LEN + 1] = {0};
-    char status_message[MAX_CONTENT_M_LEN + 1] = {0};
-
-	if (file_status && (file_status = file_stats(file_path_full, file_path, 
-                                content_type, &file_size))) {
-		// File exists
-		strcpy(status_code, STATUS_OK);
-		strcpy(status_message, STATUS_OK_M);
+    char* entity_headers = NOT_FOUND_ENTITY_HEADERS;
+	if (file_status && 
+            (file = file_cache_get(relative_path)) != NULL) {
+		// File exists, swap in a precompressed variant if the client takes it
+        file = negotiate_encoding(file, req);
+        entity_headers = file->entity_headers;
 	} else {
 		// File doesn't exist
-		strcpy(status_code, STATUS_NF);
-		strcpy(status_message, STATUS_NF_M);
+        file_status = FILE_DOESNT_EXIST;
 	}
 
-    char* response = create_response_headers(file_status, status_code, 
-                status_message, content_type, file_size, clientfd, free_queue);
-    queue_enqueue(free_queue, response);
+    char* status_code = file_status ? STATUS_OK : STATUS_NF;
+    char* status_message = file_status ? STATUS_OK_M : STATUS_NF_M;
+    size_t first = 0, last = 0, body_len = file ? file->size : 0;
+    char range_headers[ENTITY_HEADERS_LEN + CONTENT_RANGE_LEN + 1];
+    size_t value_len = 0;
+    char* value = NULL;
 
-    // Send response headers and body
-    if (send_response(clientfd, response, file_status, file_path_full, 
-                    file_size) != SUCCESS) {
-        return close_and_clean(clientfd, free_queue);
+    // Revalidation of an unchanged file gets its validators and no body
+    if (file && is_not_modified(file, req)) {
+        snprintf(range_headers, sizeof(range_headers), "%s%s", 
+                file->vary ? VARY_ENCODING_HEADER : "", file->validators);
+        entity_headers = range_headers;
+        status_code = STATUS_NOT_MODIFIED;
+        status_message = STATUS_NOT_MODIFIED_M;
+        file_cache_release(file);
+        file = NULL;
+        body_len = 0;
+    }
+
+    // Send only the requested slice of the file
+    if (file && (value = request_header(req, HEADER_RANGE, &value_len)) && 
+            if_range_matches(file, req)) {
+        switch (parse_range(value, value_len, file->size, &first, &last)) {
+            case RANGE_PARTIAL: {
+                body_len = last - first + 1;
+                int n = format_entity_headers(range_headers, 
+                            sizeof(range_headers), file->content_type, 
+                            encoding_name(file->encoding), file->vary, 
+                            file->validators, body_len);
+                snprintf(range_headers + n, sizeof(range_headers) - n, 
+                        "Content-Range: bytes %zu-%zu/%zu\r\n", first, last, 
+                        file->size);
+                entity_headers = range_headers;
+                status_code = STATUS_PARTIAL;
+                status_message = STATUS_PARTIAL_M;
+                break;
+            }
+            case RANGE_UNSATISFIABLE:
+                snprintf(range_headers, sizeof(range_headers), 
+                        "Content-Range: bytes */%zu\r\n%s", file->size, 
+                        NOT_FOUND_ENTITY_HEADERS);
+                entity_headers = range_headers;
+                status_code = STATUS_RANGE;
+                status_message = STATUS_RANGE_M;
+                // Nothing of the file is sent
+                file_cache_release(file);
+                file = NULL;
+                body_len = 0;
+                break;
+            case RANGE_FULL:
+                break;
+        }
     }
 
-    return close_and_clean(clientfd, free_queue);
+    char* response = create_response_headers(status_code, status_message, 
+                entity_headers, http_version, res->keep_alive, &conn->arena);
+
+    res->status_code = status_code;
+    res->headers = response;
+    res->headers_len = strlen(response);
+    res->sent = 0;
+    res->file_status = file_status;
+    res->file = file;
+    // Small files are served straight from memory
+    res->body = file && file->data ? file->data + first : NULL;
+    res->file_offset = first;
+    res->file_end = first + body_len;
+    res->file_size = body_len;
+
+    return SUCCESS;
+}
+
+/*
+ * Function: prepare_metrics_response
+ * --------------------
+ *  Builds a response carrying the server metrics in its body.
+ * 
+ *  conn: The connection.
+ *  res: The response to fill in.
+ *  http_version: Protocol version to respond with.
+ * 
+ *  returns: SUCCESS.
+ */
+int prepare_metrics_response(struct conn* conn, struct response* res, 
+                            char* http_version) {
+    char entity_headers[ENTITY_HEADERS_LEN];
+    char* body = arena_alloc(&conn->arena, METRICS_BODY_MAX);
+    size_t body_len = metrics_format(body, METRICS_BODY_MAX);
+
+    // Always fresh, and not offered in ranges
+    snprintf(entity_headers, sizeof(entity_headers), 
+            "Content-Type: %s\r\nContent-Length: %zu\r\n"
+            "Cache-Control: no-store\r\n", METRICS_CONTENT_TYPE, body_len);
+    res->status_code = STATUS_OK;
+    res->headers = create_response_headers(STATUS_OK, STATUS_OK_M, 
+                    entity_headers, http_version, res->keep_alive, 
+                    &conn->arena);
+    res->headers_len = strlen(res->headers);
+    res->sent = 0;
+    res->file_status = FILE_EXISTS;
+    res->file = NULL;
+    res->body = body;
+    res->file_offset = 0;
+    res->file_end = body_len;
+    res->file_size = body_len;
+
+    return SUCCESS;
+}
+
+/*
+ * Function: parse_range
+ * --------------------
+ *  Parses a Range header value against a file, accepting a single 
+ *  "bytes=first-last", "bytes=first-" or "bytes=-suffix" range.
+ * 
+ *  value: The header value.
+ *  value_len: Length of the header value.
+ *  size: Size of the file.
+ *  first: Set to the first byte of the range.
+ *  last: Set to the last byte of the range.
+ * 
+ *  returns: RANGE_PARTIAL, RANGE_UNSATISFIABLE, or RANGE_FULL if the header 
+ *  should be ignored.
+ */
+range_t parse_range(char* value, size_t value_len, size_t size, 
+                    size_t* first, size_t* last) {
+    char* end = value + value_len;
+    size_t unit_len = strlen(RANGE_UNIT);
+
+    if (value_len < unit_len || strncasecmp(value, RANGE_UNIT, unit_len)) {
+        return RANGE_FULL;
+    }
+    char* p = value + unit_len;
+    // Several ranges would need a multipart body, send the whole file instead
+    if (memchr(p, ',', end - p) != NULL) {
+        return RANGE_FULL;
+    }
+
+    size_t start = 0, stop = 0;
+    bool has_start = parse_range_number(&p, end, &start);
+    if (p >= end || *p != '-') {
+        return RANGE_FULL;
+    }
+    p++;
+    bool has_stop = parse_range_number(&p, end, &stop);
+    if (p != end || (!has_start && !has_stop) || 
+            (has_start && has_stop && stop < start)) {
+        return RANGE_FULL;
+    }
+
+    if (!has_start) {
+        // The last stop bytes of the file
+        if (stop == 0 || size == 0) {
+            return RANGE_UNSATISFIABLE;
+        }
+        *first = stop < size ? size - stop : 0;
+        *last = size - 1;
+        return RANGE_PARTIAL;
+    }
+    if (start >= size) {
+        return RANGE_UNSATISFIABLE;
+    }
+    *first = start;
+    *last = has_stop && stop < size ? stop : size - 1;
+    return RANGE_PARTIAL;
+}
+
+/*
+ * Function: parse_range_number
+ * --------------------
+ *  Parses the decimal number at the start of a range.
+ * 
+ *  p: Start of the number, moved past it.
+ *  end: End of the header value.
+ *  number: Set to the number.
+ * 
+ *  returns: true if there was a number, false otherwise.
+ */
+bool parse_range_number(char** p, char* end, size_t* number) {
+    char* digits = *p;
+    size_t n = 0;
+
+    while (*p < end && **p >= '0' && **p <= '9') {
+        size_t digit = **p - '0';
+        // Saturate, anything this large is past the end of any file
+        n = n > (SIZE_MAX - digit) / 10 ? SIZE_MAX : n * 10 + digit;
+        (*p)++;
+    }
+    *number = n;
+    return *p > digits;
+}
+
+/*
+ * Function: negotiate_encoding
+ * --------------------
+ *  Picks the most preferred precompressed variant of a file that the client 
+ *  accepts, falling back to the file itself.
+ * 
+ *  file: The uncompressed file, released if a variant is returned.
+ *  req: The parsed request.
+ * 
+ *  returns: The file to serve.
+ */
+struct file_entry* negotiate_encoding(struct file_entry* file, 
+                                    struct http_request* req) {
+    size_t value_len = 0;
+    char* value = NULL;
+
+    for (encoding_t i = ENCODING_IDENTITY + 1; i < ENCODINGS; i++) {
+        if (!file->has_variant[i]) {
+            continue;
+        }
+        // Only look at the header once a variant could be served
+        if (value == NULL && 
+                (value = request_header(req, HEADER_ACCEPT_ENCODING, 
+                                        &value_len)) == NULL) {
+            return file;
+        }
+        if (!accepts_encoding(value, value_len, encoding_name(i))) {
+            continue;
+        }
+        struct file_entry* variant = file_cache_get_variant(file, i);
+        if (variant != NULL) {
+            file_cache_release(file);
+            return variant;
+        }
+    }
+    return file;
 }
 
 /*
  * Function: send_response
  * --------------------
- *  Sends the response to the client.
+ *  Sends every prepared response in order, resuming from wherever the last 
+ *  call stopped. Headers and in-memory bodies of consecutive responses are 
+ *  gathered into one write, corked so they share packets with any file 
+ *  that follows.
  * 
- *  clientfd: Client file descriptor.
- *  response: Response to be sent.
- *  file_status: Status of the file.
- *  file_path_full: Full path of the file.
- *  file_size: Size of the file.
+ *  conn: The connection.
  * 
- *  returns: SUCCESS or ERROR.
+ *  returns: SUCCESS, CONN_AGAIN or ERROR.
  */
-int send_response(int clientfd, char* response, int file_status, 
-                    char* file_path_full, size_t file_size) {
+int send_response(struct conn* conn) {
+    // Each response contributes its headers and possibly a cached body
+    struct iovec iov[2 * PIPELINE_MAX];
+    struct msghdr msg = {0};
     ssize_t n = 0;
-    size_t total_sent = 0, bytes_left = strlen(response);
-	while (total_sent < strlen(response)) {
-        n = send(clientfd, response + total_sent, bytes_left, 0);
 
-        if (n < 0) {
-            perror("send");
-            return ERROR;
-        }
-        // Client disconnected
-        if (n == 0) {
-            if (total_sent == strlen(response)) {
-                break;
+    while (conn->cur_response < conn->n_responses) {
+        struct response* res = &conn->responses[conn->cur_response];
+
+        // SEND HEADERS AND CACHED BODIES
+        if (res->sent < response_memory_len(res)) {
+            bool file_follows = false;
+            msg.msg_iov = iov;
+            msg.msg_iovlen = gather_responses(conn, iov, &file_follows);
+
+            // MSG_MORE holds the headers back to share a packet with the body
+            n = sendmsg(conn->clientfd, &msg, 
+                        MSG_NOSIGNAL | (file_follows ? MSG_MORE : 0));
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return CONN_AGAIN;
+                if (errno == EINTR) continue;
+                perror("send");
+                return ERROR;
             }
             // Client disconnected before sending end of response
-            return ERROR;
-        }
-
-        total_sent += n;
-        bytes_left -= n;
-    }
+            if (n == 0) {
+                return ERROR;
+            }
 
-    int fd = -1;
-	// Get file descriptor
-	if (file_status) {
-		// File exists
-		fd = open(file_path_full, O_RDONLY);
-		if (fd < 0) {
-			perror("open");
-            return ERROR;
-		}
+            advance_responses(conn, n);
+            continue;
+        }
 
-		// Send file with sendfile and offset
-		off_t offset = 0;
+        // SEND FILE
         /*
         The benefits of sendfile:
         - Sendfile is more efficient than a combination of read and write 
@@ -167,73 +624,215 @@ int send_response(int clientfd, char* response, int file_status,
         compared to a combination of read and write calls 
         given it is only one call.
         */
-		while (sendfile(clientfd, fd, &offset, file_size) > 0);
-		if (offset < 0) {
-			perror("sendfile");
-            return ERROR;
-		}
-		// Cast offset as it is positive
-		if ((size_t)offset != file_size) {
-			perror("sendfile");
-            return ERROR;
-		}
+        while (response_streams_file(res) && 
+                res->file_offset < res->file_end) {
+            n = sendfile(conn->clientfd, res->file->fd, &res->file_offset, 
+                    res->file_end - res->file_offset);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return CONN_AGAIN;
+                if (errno == EINTR) continue;
+                perror("sendfile");
+                return ERROR;
+            }
+            // File shrank underneath us
+            if (n == 0) {
+                fprintf(stderr, "ERROR, file truncated while sending\n");
+                return ERROR;
+            }
+        }
 
-		// Close file descriptor
-		close(fd);
-	}
+        finish_response(res);
+        conn->cur_response++;
+    }
     return SUCCESS;
 }
 
+/*
+ * Function: gather_responses
+ * --------------------
+ *  Points an iovec at the unsent headers and in-memory bodies of the 
+ *  pending responses, up to and including the next response streaming a 
+ *  file.
+ * 
+ *  conn: The connection.
+ *  iov: The iovec to fill, with room for 2 * PIPELINE_MAX entries.
+ *  file_follows: Set to whether a file has to be streamed after these bytes.
+ * 
+ *  returns: The number of entries filled.
+ */
+int gather_responses(struct conn* conn, struct iovec* iov, 
+                    bool* file_follows) {
+    int iovcnt = 0;
+
+    *file_follows = false;
+    for (size_t i = conn->cur_response; i < conn->n_responses; i++) {
+        struct response* next = &conn->responses[i];
+        if (next->sent < next->headers_len) {
+            iov[iovcnt].iov_base = next->headers + next->sent;
+            iov[iovcnt].iov_len = next->headers_len - next->sent;
+            iovcnt++;
+        }
+        if (next->body != NULL && next->file_size > 0) {
+            size_t body_sent = next->sent > next->headers_len ? 
+                            next->sent - next->headers_len : 0;
+            iov[iovcnt].iov_base = next->body + body_sent;
+            iov[iovcnt].iov_len = next->file_size - body_sent;
+            iovcnt++;
+        }
+        if (response_streams_file(next)) {
+            *file_follows = true;
+            break;
+        }
+    }
+    return iovcnt;
+}
+
+/*
+ * Function: advance_responses
+ * --------------------
+ *  Accounts for bytes sent by a gathered write, completing each response 
+ *  that has no file to stream afterwards.
+ * 
+ *  conn: The connection.
+ *  n: The number of bytes sent.
+ * 
+ *  returns: Nothing.
+ */
+void advance_responses(struct conn* conn, size_t n) {
+    while (n > 0 && conn->cur_response < conn->n_responses) {
+        struct response* res = &conn->responses[conn->cur_response];
+        size_t left = response_memory_len(res) - res->sent;
+        size_t taken = n < left ? n : left;
+
+        if (res->sent == 0 && taken > 0) {
+            metrics_observe(HIST_FIRST_BYTE, monotonic_ns() - res->start_ns);
+        }
+        res->sent += taken;
+        n -= taken;
+        if (res->sent < response_memory_len(res) || 
+                response_streams_file(res)) {
+            // Partially sent, or its file goes out next
+            return;
+        }
+        finish_response(res);
+        conn->cur_response++;
+    }
+}
+
+/*
+ * Function: response_memory_len
+ * --------------------
+ *  Gets the number of bytes of a response sent from memory, its headers 
+ *  plus the body when it is cached in memory.
+ * 
+ *  res: The response.
+ * 
+ *  returns: The length.
+ */
+size_t response_memory_len(struct response* res) {
+    return res->headers_len + (res->body != NULL ? res->file_size : 0);
+}
+
+/*
+ * Function: response_streams_file
+ * --------------------
+ *  Checks if a response body has to be sent from its file.
+ * 
+ *  res: The response.
+ * 
+ *  returns: true if the body is sent with sendfile, false otherwise.
+ */
+bool response_streams_file(struct response* res) {
+    return res->file_status && res->body == NULL && res->file_size > 0;
+}
+
+/*
+ * Function: finish_response
+ * --------------------
+ *  Logs a response once it has been sent, or abandoned, and releases the 
+ *  file it held.
+ * 
+ *  res: The response.
+ * 
+ *  returns: Nothing.
+ */
+void finish_response(struct response* res) {
+    // Count what actually went out, which falls short if abandoned
+    size_t bytes = res->sent;
+    if (response_streams_file(res)) {
+        bytes += res->file_offset - (res->file_end - res->file_size);
+    }
+    uint64_t latency_ns = monotonic_ns() - res->start_ns;
+    access_log(res->path, res->http_version, res->status_code, bytes, 
+                latency_ns);
+    metrics_observe(HIST_REQUEST, latency_ns);
+    metrics_response(res->status_code, bytes);
+
+    // Cached files stay open, the cache closes them once unused
+    file_cache_release(res->file);
+    res->file = NULL;
+}
+
 /*
  * Function: read_request
  * --------------------
- *  Reads the request from the client.
+ *  Reads the request from the client into the connection buffer, resuming 
+ *  from wherever the last call stopped.
  * 
- *  clientfd: Client file descriptor.
- *  buffer: Buffer to store the request.
+ *  conn: The connection.
  * 
- *  returns: SUCCESS or ERROR.
+ *  returns: SUCCESS, CONN_AGAIN or ERROR.
  */
-int read_request(int clientfd, char* buffer) {
+int read_request(struct conn* conn) {
     ssize_t n = 0;
-    size_t total_recv = 0, bytes_left = BUFFER_LEN;
+
+    // Bytes carried over from the previous request may already hold this one
+    bool complete = request_ready(conn);
+    if (complete) {
+        return SUCCESS;
+    }
+
     // Read characters from the connection, then process
-    // n is number of characters read
-	while (total_recv < BUFFER_LEN) {
-        n = recv(clientfd, buffer + total_recv, bytes_left, 0);
+    // n is number of characters read. Once a request is complete, keep 
+    // draining without blocking so every pipelined request that has arrived 
+    // is answered in the same pass.
+	while (conn->buffer_len < BUFFER_LEN) {
+        n = recv(conn->clientfd, conn->buffer + conn->buffer_len, 
+                BUFFER_LEN - conn->buffer_len, complete ? MSG_DONTWAIT : 0);
 
         // Check if there was an error reading from the connection
         if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
             perror("recv");
             return ERROR;
         }
         // Client disconnected
         if (n == 0) {
-            if (strstr(buffer, END_OF_REQUEST) != NULL) {
+            if (complete) {
                 break;
             }
             // Client disconnected before sending end of request
             return ERROR;
         }
 
-        total_recv += n;
-        bytes_left -= n;
+        conn_received(conn, n);
 
-        // Check if buffer contains end of request
-        if (strstr(buffer, END_OF_REQUEST) != NULL) {
-            break;
-        }
-
-        // Check if buffer has been filled
-        if (total_recv == BUFFER_LEN) {
-            fprintf(stderr, "ERROR, buffer full\n");
-            return ERROR;
+        // Only the newly received bytes are parsed
+        if (!complete) {
+            complete = request_ready(conn);
         }
     }
-    // Null-terminate string
-    buffer[total_recv] = '\0';
 
-    return SUCCESS; 
+    if (complete) {
+        return SUCCESS;
+    }
+    if (conn->buffer_len == BUFFER_LEN) {
+        // Buffer has been filled without a complete request
+        fprintf(stderr, "ERROR, buffer full\n");
+        return ERROR;
+    }
+    return CONN_AGAIN; 
 }
 
 /*
@@ -241,148 +840,430 @@ int read_request(int clientfd, char* buffer) {
  * --------------------
  *  Creates the response headers.
  * 
- *  file_status: Status of the file.
  *  status_code: Status code of the response.
  *  status_message: Status message of the response.
- *  content_type: Content type of the response.
- *  file_size: Size of the file.
- *  clientfd: Client file descriptor.
- *  free_queue: Free queue.
+ *  entity_headers: Preformatted header lines describing the body.
+ *  http_version: Protocol version to respond with.
+ *  keep_alive: Whether the connection stays open afterwards.
+ *  arena: Arena to allocate the headers from.
  * 
  *  returns: Pointer to the response headers.
  */
-char* create_response_headers(int file_status, char* status_code, 
-        char* status_message, char* content_type, size_t file_size, 
-        int clientfd, queue_t* free_queue) {
+char* create_response_headers(char* status_code, char* status_message, 
+        char* entity_headers, char* http_version, bool keep_alive, 
+        arena_t* arena) {
     size_t response_len = 0, line_1_n = 0, line_2_n = 0, line_3_n = 0;
+    char* connection = NULL;
+
+    // Only spell out the connection header when it differs from the 
+    // default for the protocol version
+    bool is_1_1 = strcmp(http_version, HTTP_VERSION_1_1) == 0;
+    if (keep_alive && !is_1_1) {
+        connection = KEEP_ALIVE_TOKEN;
+    } else if (!keep_alive && is_1_1) {
+        connection = CLOSE_TOKEN;
+    }
 	
     // Get length of response headers
-    if (file_status) {
-        line_1_n = snprintf(NULL, 0, "%s %s %s\r\n", HTTP_VERSION, 
-                        status_code, status_message); 
-        line_2_n = snprintf(NULL, 0, "Content-Type: %s\r\n", content_type);
-        line_3_n = snprintf(NULL, 0, "Content-Length: %zu\r\n\r\n", file_size);
-        response_len = line_1_n + line_2_n + line_3_n;
-    } else {
-        line_1_n = snprintf(NULL, 0, "%s %s %s\r\n", HTTP_VERSION, 
-                        status_code, status_message);
-        line_3_n = snprintf(NULL, 0, "Content-Length: %zu\r\n\r\n", file_size);
-        response_len = line_1_n + line_3_n;
-    }
-
-    char line_1[line_1_n + 1], line_2[line_2_n + 1], line_3[line_3_n + 1];
-    memset(line_1, 0, line_1_n + 1);
-    memset(line_2, 0, line_2_n + 1);
-    memset(line_3, 0, line_3_n + 1);
-
-    char* response = malloc(sizeof(char) * response_len + 1);
-    malloc_check_close(response, clientfd, free_queue);
+    line_1_n = snprintf(NULL, 0, "%s %s %s\r\n", http_version, 
+                    status_code, status_message); 
+    if (connection) {
+        line_2_n = snprintf(NULL, 0, "%s: %s\r\n", CONNECTION_HEADER, 
+                        connection);
+    }
+    line_3_n = strlen(entity_headers);
+    response_len = line_1_n + line_2_n + line_3_n + strlen(END_OF_REQ_LINE);
+
+    char* response = arena_alloc(arena, response_len + 1);
 
     // Create response header lines
-    sprintf(line_1, "%s %s %s\r\n", HTTP_VERSION, status_code, 
+    char* line = response;
+    line += sprintf(line, "%s %s %s\r\n", http_version, status_code, 
                 status_message);
-    if (file_status) sprintf(line_2, "Content-Type: %s\r\n", content_type);
-    sprintf(line_3, "Content-Length: %zu\r\n\r\n", file_size);
-
-    // Create response
-    strcpy(response, line_1);
-    if (file_status) strcat(response, line_2);
-    strcat(response, line_3);
+    if (connection) {
+        line += sprintf(line, "%s: %s\r\n", CONNECTION_HEADER, connection);
+    }
+    strcpy(line, entity_headers);
+    strcpy(line + line_3_n, END_OF_REQ_LINE);
 
     return response;
 }
 
 /*
- * Function: path_component_exists
+ * Function: format_entity_headers
  * --------------------
- *  Checks if the path component exists.
+ *  Writes the Content-Type, Content-Encoding, Content-Length, Vary and 
+ *  Accept-Ranges header lines, followed by the validators.
  * 
- *  file_path: Path to the file.
+ *  buffer: Buffer to write to.
+ *  len: Size of the buffer.
+ *  content_type: Content type of the file, NULL to leave it out.
+ *  content_encoding: Content coding of the file, NULL if not encoded.
+ *  vary: Whether the body depends on the request's Accept-Encoding.
+ *  validators: Preformatted ETag and Last-Modified lines, or NULL.
+ *  file_size: Size of the file.
  * 
- *  returns: true if the path component exists, false otherwise.
+ *  returns: The number of characters written.
  */
-bool path_component_exists(char* file_path) {
-    // Append "/" to start of file_path_copy if it doesn't exist
-    // Add "/" to end for testing purposes
-    char* file_path_copy = malloc(sizeof(char) * 
-                            (strlen(file_path) + 
-                            (2 * EXTRA_INCASE_NOSLASH) + 1));
-    malloc_check(file_path_copy);
-
-    strcpy(file_path_copy, "/");
-    strcat(file_path_copy, file_path);
-    strcat(file_path_copy, "/");
-
-    // Check if file_path contains /../
-    if (strstr(file_path_copy, PATH_COMPONENT)) {
-        free(file_path_copy);
+int format_entity_headers(char* buffer, size_t len, char* content_type, 
+            char* content_encoding, bool vary, char* validators, 
+            size_t file_size) {
+    return snprintf(buffer, len, 
+                    "%s%s%s%s%s%sContent-Length: %zu\r\n%s" 
+                    ACCEPT_RANGES_HEADER "%s", 
+                    content_type ? "Content-Type: " : "", 
+                    content_type ? content_type : "", 
+                    content_type ? END_OF_REQ_LINE : "", 
+                    content_encoding ? "Content-Encoding: " : "", 
+                    content_encoding ? content_encoding : "", 
+                    content_encoding ? END_OF_REQ_LINE : "", 
+                    file_size, vary ? VARY_ENCODING_HEADER : "", 
+                    validators ? validators : "");
+}
+
+/*
+ * Function: format_validators
+ * --------------------
+ *  Writes the ETag and Last-Modified header lines of a file. The ETag is 
+ *  built from the inode, size and modification time, and names the content 
+ *  coding so each precompressed variant has its own.
+ * 
+ *  buffer: Buffer to write to.
+ *  len: Size of the buffer.
+ *  ino: Inode of the file.
+ *  size: Size of the file.
+ *  mtime: Modification time of the file.
+ *  content_encoding: Content coding of the file, NULL if not encoded.
+ * 
+ *  returns: The number of characters written.
+ */
+int format_validators(char* buffer, size_t len, ino_t ino, size_t size, 
+                    time_t mtime, char* content_encoding) {
+    char date[HTTP_DATE_LEN + 1] = {0};
+    struct tm tm;
+    gmtime_r(&mtime, &tm);
+    strftime(date, sizeof(date), HTTP_DATE_FORMAT, &tm);
+
+    return snprintf(buffer, len, "%s: \"%lx-%zx-%llx%s%s\"\r\n%s: %s\r\n", 
+                    ETAG_HEADER, (unsigned long)ino, size, 
+                    (unsigned long long)mtime, content_encoding ? "-" : "", 
+                    content_encoding ? content_encoding : "", 
+                    LAST_MODIFIED_HEADER, date);
+}
+
+/*
+ * Function: is_not_modified
+ * --------------------
+ *  Checks the conditional headers of a request against a file. 
+ *  If-None-Match takes precedence, If-Modified-Since is only used without 
+ *  it.
+ * 
+ *  file: The file.
+ *  req: The parsed request.
+ * 
+ *  returns: true if a 304 should be sent instead of the file, false 
+ *  otherwise.
+ */
+bool is_not_modified(struct file_entry* file, struct http_request* req) {
+    size_t value_len = 0;
+    char* value = request_header(req, HEADER_IF_NONE_MATCH, &value_len);
+    if (value != NULL) {
+        return etag_matches(value, value_len, file->etag, file->etag_len);
+    }
+
+    time_t since = 0;
+    value = request_header(req, HEADER_IF_MODIFIED_SINCE, &value_len);
+    return value != NULL && parse_http_date(value, value_len, &since) && 
+            file->mtime <= since;
+}
+
+/*
+ * Function: if_range_matches
+ * --------------------
+ *  Checks the If-Range header of a request, which only allows a range to be 
+ *  sent if the file is unchanged.
+ * 
+ *  file: The file.
+ *  req: The parsed request.
+ * 
+ *  returns: true if any Range header should be honoured, false otherwise.
+ */
+bool if_range_matches(struct file_entry* file, struct http_request* req) {
+    size_t value_len = 0;
+    char* value = request_header(req, HEADER_IF_RANGE, &value_len);
+    if (value == NULL) {
         return true;
     }
-    free(file_path_copy);
+    // Entity tags are compared strongly, so weak tags never match
+    if (*value == '"') {
+        return value_len == file->etag_len && 
+                strncmp(value, file->etag, value_len) == 0;
+    }
+    time_t date = 0;
+    return parse_http_date(value, value_len, &date) && file->mtime == date;
+}
+
+/*
+ * Function: etag_matches
+ * --------------------
+ *  Checks if an If-None-Match value lists an entity tag, using the weak 
+ *  comparison so "W/" prefixes are ignored.
+ * 
+ *  value: The header value.
+ *  value_len: Length of the header value.
+ *  etag: The quoted entity tag.
+ *  etag_len: Length of the entity tag.
+ * 
+ *  returns: true if the tag or "*" is listed, false otherwise.
+ */
+bool etag_matches(char* value, size_t value_len, char* etag, size_t etag_len) {
+    char* end = value + value_len;
+
+    while (value < end) {
+        while (value < end && (*value == ',' || *value == ' ' || 
+                *value == '\t')) {
+            value++;
+        }
+        if (value < end && *value == '*') {
+            return true;
+        }
+        if (end - value >= 2 && strncmp(value, "W/", 2) == 0) {
+            value += 2;
+        }
+        // The tag runs to its closing quote, which may not be followed by 
+        // a comma
+        char* tag_end = value < end && *value == '"' ? 
+                        memchr(value + 1, '"', end - value - 1) : NULL;
+        if (tag_end == NULL) {
+            return false;
+        }
+        tag_end++;
+        if ((size_t)(tag_end - value) == etag_len && 
+                strncmp(value, etag, etag_len) == 0) {
+            return true;
+        }
+        value = tag_end;
+    }
     return false;
 }
 
 /*
- * Function: parse_requests
+ * Function: parse_http_date
  * --------------------
- *  Parses the request.
+ *  Parses an HTTP date in the preferred IMF-fixdate format, such as 
+ *  "Sun, 06 Nov 1994 08:49:37 GMT".
  * 
- *  buffer: Buffer containing the request.
- *  request_line: Request line.
- *  method: Method of the request.
- *  file_path: Path to the file.
- *  protocol_version: Protocol version of the request.
+ *  value: The header value.
+ *  value_len: Length of the header value.
+ *  date: Set to the time.
  * 
- *  returns: true if the request was parsed successfully, false otherwise.
+ *  returns: true if the date was valid, false otherwise.
  */
-bool parse_request(char* buffer, char** request_line, char** method, 
-                    char** file_path, char** protocol_version) {
-    // Get first line of request
-    *request_line = strtok(buffer, END_OF_REQ_LINE);
-    if (*request_line == NULL) {
+bool parse_http_date(char* value, size_t value_len, time_t* date) {
+    if (value_len != HTTP_DATE_LEN) {
         return false;
     }
-	// Get the method
-	*method = strtok(*request_line, " ");
-    if (*method == NULL || strcmp(*method, GET_METHOD) != 0) {
+    // Header values are not terminated, so parse a copy
+    char copy[HTTP_DATE_LEN + 1];
+    memcpy(copy, value, HTTP_DATE_LEN);
+    copy[HTTP_DATE_LEN] = '\0';
+
+    struct tm tm = {0};
+    char* end = strptime(copy, HTTP_DATE_FORMAT, &tm);
+    if (end == NULL || *end != '\0') {
         return false;
     }
-	// Get the file path
-	*file_path = strtok(NULL, " ");
-    if (*file_path == NULL) {
+    *date = timegm(&tm);
+    return *date != -1;
+}
+
+/*
+ * Function: wants_keep_alive
+ * --------------------
+ *  Decides whether the connection persists after this request. HTTP/1.1 
+ *  persists unless the client sends "Connection: close", HTTP/1.0 only 
+ *  persists if it sends "Connection: keep-alive".
+ * 
+ *  req: The parsed request.
+ *  http_version: Protocol version of the request.
+ * 
+ *  returns: true if the connection should be kept alive, false otherwise.
+ */
+bool wants_keep_alive(struct http_request* req, char* http_version) {
+    size_t value_len = 0;
+    char* value = request_header(req, HEADER_CONNECTION, &value_len);
+
+    if (strcmp(http_version, HTTP_VERSION_1_1) == 0) {
+        return value == NULL || !has_token(value, value_len, CLOSE_TOKEN);
+    }
+    return value != NULL && has_token(value, value_len, KEEP_ALIVE_TOKEN);
+}
+
+/*
+ * Function: has_token
+ * --------------------
+ *  Checks if a comma separated header value contains a token, ignoring case.
+ * 
+ *  value: The header value.
+ *  value_len: Length of the header value.
+ *  token: The token to look for.
+ * 
+ *  returns: true if the token is present, false otherwise.
+ */
+bool has_token(char* value, size_t value_len, char* token) {
+    size_t token_len = strlen(token);
+    char* end = value + value_len;
+
+    while (value < end) {
+        // Skip separators before the next token
+        while (value < end && (*value == ',' || *value == ' ' || 
+                *value == '\t')) {
+            value++;
+        }
+        char* token_end = value;
+        while (token_end < end && *token_end != ',') {
+            token_end++;
+        }
+        // Ignore whitespace before the comma
+        char* trimmed = token_end;
+        while (trimmed > value && (trimmed[-1] == ' ' || trimmed[-1] == '\t')) {
+            trimmed--;
+        }
+        if ((size_t)(trimmed - value) == token_len && 
+                strncasecmp(value, token, token_len) == 0) {
+            return true;
+        }
+        value = token_end;
+    }
+    return false;
+}
+
+/*
+ * Function: accepts_encoding
+ * --------------------
+ *  Checks if an Accept-Encoding value allows a content coding. A coding 
+ *  listed with a q-value of zero is refused, and "*" stands for any coding 
+ *  not listed.
+ * 
+ *  value: The header value.
+ *  value_len: Length of the header value.
+ *  coding: The content coding to look for.
+ * 
+ *  returns: true if the coding is acceptable, false otherwise.
+ */
+bool accepts_encoding(char* value, size_t value_len, char* coding) {
+    size_t coding_len = strlen(coding);
+    char* end = value + value_len;
+    bool any = false;
+
+    while (value < end) {
+        while (value < end && (*value == ',' || *value == ' ' || 
+                *value == '\t')) {
+            value++;
+        }
+        if (value == end) {
+            break;
+        }
+        char* item_end = memchr(value, ',', end - value);
+        if (item_end == NULL) {
+            item_end = end;
+        }
+        char* token_end = value;
+        while (token_end < item_end && *token_end != ';' && 
+                *token_end != ' ' && *token_end != '\t') {
+            token_end++;
+        }
+        size_t token_len = token_end - value;
+        bool accepted = !qvalue_is_zero(token_end, item_end);
+
+        if (token_len == coding_len && 
+                strncasecmp(value, coding, coding_len) == 0) {
+            return accepted;
+        }
+        if (token_len == 1 && *value == '*') {
+            any = accepted;
+        }
+        value = item_end;
+    }
+    return any;
+}
+
+/*
+ * Function: qvalue_is_zero
+ * --------------------
+ *  Checks if the parameters of an Accept-Encoding item give it a q-value of 
+ *  zero, such as "q=0" or "q=0.000".
+ * 
+ *  params: Start of the parameters, following the coding.
+ *  end: End of the item.
+ * 
+ *  returns: true if the q-value is zero, false otherwise.
+ */
+bool qvalue_is_zero(char* params, char* end) {
+    char* q = params;
+    while (q + 2 <= end) {
+        if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=' && 
+                (q == params || q[-1] == ';' || q[-1] == ' ')) {
+            break;
+        }
+        q++;
+    }
+    if (q + 2 > end) {
         return false;
     }
-	// Get the protocol
-	*protocol_version = strtok(NULL, " ");
-    if (*protocol_version == NULL || strcmp(*protocol_version, 
-        HTTP_VERSION) != 0) {
+    q += 2;
+    if (q >= end || *q != '0') {
         return false;
     }
+    for (q++; q < end && *q != ';' && *q != ' ' && *q != '\t'; q++) {
+        if (*q != '.' && *q != '0') {
+            return false;
+        }
+    }
     return true;
 }
 
+/*
+ * Function: path_component_exists
+ * --------------------
+ *  Checks if the path has a ".." component.
+ * 
+ *  file_path: Path to the file.
+ * 
+ *  returns: true if the path component exists, false otherwise.
+ */
+bool path_component_exists(char* file_path) {
+    // Same as finding "/../" in "/" + file_path + "/", without the copy
+    size_t len = strlen(file_path);
+    for (char* dots = strstr(file_path, ".."); dots != NULL; 
+            dots = strstr(dots + 1, "..")) {
+        size_t i = dots - file_path;
+        if ((i == 0 || dots[-1] == '/') && 
+                (i + 2 == len || dots[2] == '/')) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /*
  * Function: file_status
  * --------------------
- *  Checks if the file exists. If it does, it checks if it is a valid file, 
- *  then sets the content type and size of the file.
+ *  Checks if an open file is a valid file, then sets the content type and 
+ *  stat information of the file.
  * 
- *  file_path_full: Path to the file.
+ *  fd: The open file.
+ *  file_path: Path to the file, used to find the extension.
  *  content_type: Content type of the file.
- *  file_size: Size of the file.
+ *  sb: Stat information of the file.
  * 
  *  returns: 1 if the file exists, 0 otherwise.
  */
-int file_stats(char* file_path_full, char* file_path, char* content_type, 
-                size_t* file_size) {
-    struct stat sb;
-	if (stat(file_path_full, &sb) == 0) {
+int file_stats(int fd, char* file_path, char* content_type, struct stat* sb) {
+	if (fstat(fd, sb) == 0) {
 		// File exists
-        // Get file size
-        *file_size = sb.st_size;
-
         // Check if it's a regular file
-        if (S_ISREG(sb.st_mode)) {
+        if (S_ISREG(sb->st_mode)) {
             if (strlen(file_path) == 0) return FILE_DOESNT_EXIST;
             // Get the last string starting with .
             char* file_path_noslash = file_path;
@@ -423,40 +1304,4 @@ int file_stats(char* file_path_full, char* file_path, char* content_type,
 	}
     // Directory or file does not exist
 	return FILE_DOESNT_EXIST;
-}
-
-/*
- * Function: malloc_check_close
- * --------------------
- *  Checks if malloc was successful. If it was not, it closes the socket and
- *  frees the queue, then exits.
- * 
- *  ptr: Pointer to the memory allocated.
- *  clientfd: Socket file descriptor.
- *  queue: free queue
- * 
- *  returns: Nothing.
- */
-void malloc_check_close(void* ptr, int clientfd, queue_t* queue) {
-    if (ptr == NULL) {
-        fprintf(stderr, "ERROR, malloc failed\n");
-        close_and_clean(clientfd, queue);
-        exit(EXIT_FAILURE);
-    }
-}
-
-/*
- * Function: close_and_clean
- * --------------------
- *  Closes the socket and frees the queue.
- * 
- *  clientfd: Socket file descriptor.
- *  free_queue: Free queue.
- * 
- *  returns: NULL.
- */
-void* close_and_clean(int clientfd, queue_t* free_queue) {
-    close(clientfd);
-    queue_clean(free_queue, free);
-    return NULL;
 }
\ No newline at end of file
@@ -2,8 +2,15 @@
 #define CONNOPS_H
 
 #include "connops.h"
-#include "queue.h"
+#include "request.h"
+#include "arena.h"
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #define BUFFER_LEN 2048
 #define GET_METHOD "GET"
@@ -11,9 +18,16 @@
 #define STATUS_OK_M "OK"
 #define STATUS_NF "404"
 #define STATUS_NF_M "Not Found"
+#define STATUS_PARTIAL "206"
+#define STATUS_PARTIAL_M "Partial Content"
+#define STATUS_NOT_MODIFIED "304"
+#define STATUS_NOT_MODIFIED_M "Not Modified"
+#define STATUS_RANGE "416"
+#define STATUS_RANGE_M "Range Not Satisfiable"
 #define STATUS_FORBIDDEN "403"
 #define STATUS_FORBIDDEN_M "Forbidden"
 #define HTTP_VERSION "HTTP/1.0"
+#define HTTP_VERSION_1_1 "HTTP/1.1"
 #define FILE_EXISTS 1
 #define FILE_DOESNT_EXIST 0
 #define STATUS_CODE_LEN 3
@@ -21,138 +35,564 @@
 #define N_SPACES_HEADER_LINE 1
 #define MAX_CONTENT_TYPE_LEN 24
 #define MAX_CONTENT_M_LEN 9
-#define END_OF_REQUEST "\r\n\r\n"
 #define END_OF_REQ_LINE "\r\n"
-#define EXTRA_INCASE_NOSLASH 1
 #define PATH_COMPONENT "/../"
 #define ERROR -1
 #define SUCCESS 0
+#define CONN_AGAIN 1
+#define CONNECTION_HEADER "Connection"
+#define HOST_HEADER "Host"
+#define KEEP_ALIVE_TOKEN "keep-alive"
+#define CLOSE_TOKEN "close"
+#define PIPELINE_MAX 16
+#define NOT_FOUND_ENTITY_HEADERS "Content-Length: 0\r\n"
+#define ACCEPT_ENCODING_HEADER "Accept-Encoding"
+#define VARY_ENCODING_HEADER "Vary: Accept-Encoding\r\n"
+#define ACCEPT_RANGES_HEADER "Accept-Ranges: bytes\r\n"
+#define RANGE_HEADER "Range"
+#define RANGE_UNIT "bytes="
+#define CONTENT_RANGE_LEN 64
+#define ETAG_HEADER "ETag"
+#define LAST_MODIFIED_HEADER "Last-Modified"
+#define IF_NONE_MATCH_HEADER "If-None-Match"
+#define IF_MODIFIED_SINCE_HEADER "If-Modified-Since"
+#define IF_RANGE_HEADER "If-Range"
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
+#define HTTP_DATE_LEN 29
 
 /*
- * Function: file_stats
+ * What a Range header asks of a file. Ranges that cannot be parsed, and 
+ * lists of several ranges, are ignored and the whole file is sent.
+ */
+typedef enum range {
+    RANGE_FULL,
+    RANGE_PARTIAL,
+    RANGE_UNSATISFIABLE
+} range_t;
+
+struct file_entry;
+struct shard;
+
+/*
+ * States a connection moves through. Each state can be resumed after the 
+ * socket would have blocked, which lets the event loop drive many 
+ * connections from one thread.
+ */
+typedef enum conn_state {
+    CONN_READ_REQUEST,
+    CONN_PREPARE_RESPONSE,
+    CONN_SEND_RESPONSE,
+    CONN_DONE
+} conn_state_t;
+
+struct response {
+    char* headers;
+    size_t headers_len;
+    // Body held in memory by the file cache, NULL to sendfile it instead
+    char* body;
+    // Bytes of the headers and in-memory body sent so far
+    size_t sent;
+    int file_status;
+    // Open file from the file cache, held until the body has been sent
+    struct file_entry* file;
+    // Next byte of the file to send, and the offset the body ends at
+    off_t file_offset;
+    off_t file_end;
+    // Length of the body, less than the file for a range
+    size_t file_size;
+    bool keep_alive;
+    // What the access log records once the response is finished
+    char* path;
+    char* http_version;
+    char* status_code;
+    uint64_t start_ns;
+};
+
+struct conn {
+    int clientfd;
+    char* root_path;
+    conn_state_t state;
+    char buffer[BUFFER_LEN + 1];
+    size_t buffer_len;
+    // Bytes of the buffer already turned into responses
+    size_t parsed_len;
+    bool keep_alive;
+    // Responses to pipelined requests, sent strictly in order
+    struct response responses[PIPELINE_MAX];
+    size_t n_responses;
+    size_t cur_response;
+    // Parse state of the next request in the buffer
+    struct http_request request;
+    // Memory for the responses being built, reset between batches
+    arena_t arena;
+    // When the connection was accepted, when bytes last arrived, and when 
+    // the first byte of the request being read arrived (0 if none yet)
+    uint64_t accepted_ns;
+    uint64_t recv_ns;
+    uint64_t request_start_ns;
+    // Idle list links and last activity, maintained by the event loop
+    struct conn* idle_prev;
+    struct conn* idle_next;
+    time_t last_active;
+};
+
+/*
+ * Function: conn_create
  * --------------------
- *  Checks if the file exists. If it does, it checks if it is a valid file, 
- *  then sets the content type and size of the file.
+ *  Creates the state for a new client connection.
  * 
- *  file_path_full: Path to the file.
- *  content_type: Content type of the file.
- *  file_size: Size of the file.
+ *  clientfd: Client file descriptor.
+ *  root_path: The root path of the server.
  * 
- *  returns: 1 if the file exists, 0 otherwise.
+ *  returns: Pointer to the connection.
  */
-int file_stats(char* file_path_full, char* file_path, 
-                char* content_type, size_t* file_size);
+struct conn* conn_create(int clientfd, char* root_path);
 
 /*
- * Function: handle_client
+ * Function: conn_free
  * --------------------
- *  Handles a client connection.
+ *  Closes the client socket and any open file, then returns the 
+ *  connection to the pool.
  * 
- *  arg: Pointer to the argument struct.
+ *  conn: The connection.
  * 
- *  returns: NULL.
+ *  returns: Nothing.
  */
-void* handle_client(void* arg);
+void conn_free(struct conn* conn);
 
 /*
- * Function: read_request
+ * Function: conn_received
  * --------------------
- *  Reads the request from the client.
+ *  Accounts for bytes received into the connection buffer, noting when 
+ *  the request they belong to started arriving.
  * 
- *  clientfd: Client file descriptor.
- *  buffer: Buffer to store the request.
+ *  conn: The connection.
+ *  n: The number of bytes received.
+ * 
+ *  returns: Nothing.
+ */
+void conn_received(struct conn* conn, size_t n);
+
+/*
+ * Function: prepare_metrics_response
+ * --------------------
+ *  Builds a response carrying the server metrics in its body.
+ * 
+ *  conn: The connection.
+ *  res: The response to fill in.
+ *  http_version: Protocol version to respond with.
+ * 
+ *  returns: SUCCESS.
+ */
+int prepare_metrics_response(struct conn* conn, struct response* res, 
+                            char* http_version);
+
+/*
+ * Function: conn_step
+ * --------------------
+ *  Drives the connection through its states until the response has been 
+ *  sent, an error occurs, or the socket would block.
+ * 
+ *  conn: The connection.
+ * 
+ *  returns: SUCCESS when done, CONN_AGAIN if it would block, or ERROR.
+ */
+int conn_step(struct conn* conn);
+
+/*
+ * Function: conn_next_request
+ * --------------------
+ *  Readies a kept-alive connection for its next request, carrying over any 
+ *  bytes received after the end of the current one.
+ * 
+ *  conn: The connection.
+ * 
+ *  returns: true if the connection should stay open, false otherwise.
+ */
+bool conn_next_request(struct conn* conn);
+
+/*
+ * Function: wants_keep_alive
+ * --------------------
+ *  Decides whether the connection persists after this request. HTTP/1.1 
+ *  persists unless the client sends "Connection: close", HTTP/1.0 only 
+ *  persists if it sends "Connection: keep-alive".
+ * 
+ *  req: The parsed request.
+ *  http_version: Protocol version of the request.
+ * 
+ *  returns: true if the connection should be kept alive, false otherwise.
+ */
+bool wants_keep_alive(struct http_request* req, char* http_version);
+
+/*
+ * Function: has_token
+ * --------------------
+ *  Checks if a comma separated header value contains a token, ignoring case.
+ * 
+ *  value: The header value.
+ *  value_len: Length of the header value.
+ *  token: The token to look for.
+ * 
+ *  returns: true if the token is present, false otherwise.
+ */
+bool has_token(char* value, size_t value_len, char* token);
+
+/*
+ * Function: prepare_responses
+ * --------------------
+ *  Prepares a response for every complete request in the buffer, so 
+ *  pipelined requests are all handled in one pass.
+ * 
+ *  conn: The connection.
  * 
  *  returns: SUCCESS or ERROR.
  */
-int read_request(int clientfd, char* buffer);
+int prepare_responses(struct conn* conn);
 
 /*
- * Function: send_response
+ * Function: request_ready
  * --------------------
- *  Sends the response to the client.
+ *  Parses what has arrived of the next request in the buffer, picking up 
+ *  where the last call stopped.
  * 
- *  clientfd: Client file descriptor.
- *  response: Response to be sent.
- *  file_status: Status of the file.
- *  file_path_full: Full path of the file.
- *  file_size: Size of the file.
+ *  conn: The connection.
+ * 
+ *  returns: true if the request is complete or malformed, false if more of 
+ *  it is needed.
+ */
+bool request_ready(struct conn* conn);
+
+/*
+ * Function: prepare_response
+ * --------------------
+ *  Resolves the file for one parsed request and builds the response 
+ *  headers.
+ * 
+ *  conn: The connection.
+ *  req: The complete request, whose request line is modified.
+ *  res: The response to fill in.
  * 
  *  returns: SUCCESS or ERROR.
  */
-int send_response(int clientfd, char* response, int file_status, 
-                    char* file_path_full, size_t file_size);
+int prepare_response(struct conn* conn, struct http_request* req, 
+                    struct response* res);
 
 /*
- * Function: create_response_headers
+ * Function: gather_responses
  * --------------------
- *  Creates the response headers.
+ *  Points an iovec at the unsent headers and in-memory bodies of the 
+ *  pending responses, up to and including the next response streaming a 
+ *  file.
  * 
- *  file_status: Status of the file.
- *  status_code: Status code of the response.
- *  status_message: Status message of the response.
- *  content_type: Content type of the response.
+ *  conn: The connection.
+ *  iov: The iovec to fill, with room for 2 * PIPELINE_MAX entries.
+ *  file_follows: Set to whether a file has to be streamed after these bytes.
+ * 
+ *  returns: The number of entries filled.
+ */
+int gather_responses(struct conn* conn, struct iovec* iov, 
+                    bool* file_follows);
+
+/*
+ * Function: advance_responses
+ * --------------------
+ *  Accounts for bytes sent by a gathered write, completing each response 
+ *  that has no file to stream afterwards.
+ * 
+ *  conn: The connection.
+ *  n: The number of bytes sent.
+ * 
+ *  returns: Nothing.
+ */
+void advance_responses(struct conn* conn, size_t n);
+
+/*
+ * Function: response_memory_len
+ * --------------------
+ *  Gets the number of bytes of a response sent from memory, its headers 
+ *  plus the body when it is cached in memory.
+ * 
+ *  res: The response.
+ * 
+ *  returns: The length.
+ */
+size_t response_memory_len(struct response* res);
+
+/*
+ * Function: response_streams_file
+ * --------------------
+ *  Checks if a response body has to be sent from its file.
+ * 
+ *  res: The response.
+ * 
+ *  returns: true if the body is sent with sendfile, false otherwise.
+ */
+bool response_streams_file(struct response* res);
+
+/*
+ * Function: finish_response
+ * --------------------
+ *  Logs a response once it has been sent, or abandoned, and releases the 
+ *  file it held.
+ * 
+ *  res: The response.
+ * 
+ *  returns: Nothing.
+ */
+void finish_response(struct response* res);
+
+/*
+ * Function: file_stats
+ * --------------------
+ *  Checks if an open file is a valid file, then sets the content type and 
+ *  stat information of the file.
+ * 
+ *  fd: The open file.
+ *  file_path: Path to the file, used to find the extension.
+ *  content_type: Content type of the file.
+ *  sb: Stat information of the file.
+ * 
+ *  returns: 1 if the file exists, 0 otherwise.
+ */
+int file_stats(int fd, char* file_path, char* content_type, struct stat* sb);
+
+/*
+ * Function: format_entity_headers
+ * --------------------
+ *  Writes the Content-Type, Content-Encoding, Content-Length, Vary and 
+ *  Accept-Ranges header lines, followed by the validators.
+ * 
+ *  buffer: Buffer to write to.
+ *  len: Size of the buffer.
+ *  content_type: Content type of the file, NULL to leave it out.
+ *  content_encoding: Content coding of the file, NULL if not encoded.
+ *  vary: Whether the body depends on the request's Accept-Encoding.
+ *  validators: Preformatted ETag and Last-Modified lines, or NULL.
  *  file_size: Size of the file.
- *  clientfd: Client file descriptor.
- *  free_queue: Free queue.
  * 
- *  returns: Pointer to the response headers.
+ *  returns: The number of characters written.
  */
-char* create_response_headers(int file_status, char* status_code, 
-    char* status_message, char* content_type, size_t file_size, 
-    int clientfd, queue_t* free_queue);
+int format_entity_headers(char* buffer, size_t len, char* content_type, 
+            char* content_encoding, bool vary, char* validators, 
+            size_t file_size);
 
 /*
- * Function: path_component_exists
+ * Function: format_validators
  * --------------------
- *  Checks if the path component exists.
+ *  Writes the ETag and Last-Modified header lines of a file. The ETag is 
+ *  built from the inode, size and modification time, and names the content 
+ *  coding so each precompressed variant has its own.
  * 
- *  file_path: Path to the file.
+ *  buffer: Buffer to write to.
+ *  len: Size of the buffer.
+ *  ino: Inode of the file.
+ *  size: Size of the file.
+ *  mtime: Modification time of the file.
+ *  content_encoding: Content coding of the file, NULL if not encoded.
  * 
- *  returns: true if the path component exists, false otherwise.
+ *  returns: The number of characters written.
  */
-bool path_component_exists(char* file_path);
+int format_validators(char* buffer, size_t len, ino_t ino, size_t size, 
+                    time_t mtime, char* content_encoding);
 
 /*
- * Function: parse_requests
+ * Function: is_not_modified
  * --------------------
- *  Parses the request.
+ *  Checks the conditional headers of a request against a file. 
+ *  If-None-Match takes precedence, If-Modified-Since is only used without 
+ *  it.
  * 
- *  buffer: Buffer containing the request.
- *  request_line: Request line.
- *  method: Method of the request.
- *  file_path: Path to the file.
- *  protocol_version: Protocol version of the request.
+ *  file: The file.
+ *  req: The parsed request.
+ * 
+ *  returns: true if a 304 should be sent instead of the file, false 
+ *  otherwise.
+ */
+bool is_not_modified(struct file_entry* file, struct http_request* req);
+
+/*
+ * Function: if_range_matches
+ * --------------------
+ *  Checks the If-Range header of a request, which only allows a range to be 
+ *  sent if the file is unchanged.
+ * 
+ *  file: The file.
+ *  req: The parsed request.
+ * 
+ *  returns: true if any Range header should be honoured, false otherwise.
+ */
+bool if_range_matches(struct file_entry* file, struct http_request* req);
+
+/*
+ * Function: etag_matches
+ * --------------------
+ *  Checks if an If-None-Match value lists an entity tag, using the weak 
+ *  comparison so "W/" prefixes are ignored.
+ * 
+ *  value: The header value.
+ *  value_len: Length of the header value.
+ *  etag: The quoted entity tag.
+ *  etag_len: Length of the entity tag.
+ * 
+ *  returns: true if the tag or "*" is listed, false otherwise.
+ */
+bool etag_matches(char* value, size_t value_len, char* etag, size_t etag_len);
+
+/*
+ * Function: parse_http_date
+ * --------------------
+ *  Parses an HTTP date in the preferred IMF-fixdate format, such as 
+ *  "Sun, 06 Nov 1994 08:49:37 GMT".
+ * 
+ *  value: The header value.
+ *  value_len: Length of the header value.
+ *  date: Set to the time.
+ * 
+ *  returns: true if the date was valid, false otherwise.
+ */
+bool parse_http_date(char* value, size_t value_len, time_t* date);
+
+/*
+ * Function: parse_range
+ * --------------------
+ *  Parses a Range header value against a file, accepting a single 
+ *  "bytes=first-last", "bytes=first-" or "bytes=-suffix" range.
+ * 
+ *  value: The header value.
+ *  value_len: Length of the header value.
+ *  size: Size of the file.
+ *  first: Set to the first byte of the range.
+ *  last: Set to the last byte of the range.
+ * 
+ *  returns: RANGE_PARTIAL, RANGE_UNSATISFIABLE, or RANGE_FULL if the header 
+ *  should be ignored.
+ */
+range_t parse_range(char* value, size_t value_len, size_t size, 
+                    size_t* first, size_t* last);
+
+/*
+ * Function: parse_range_number
+ * --------------------
+ *  Parses the decimal number at the start of a range.
+ * 
+ *  p: Start of the number, moved past it.
+ *  end: End of the header value.
+ *  number: Set to the number.
  * 
- *  returns: true if the request was parsed successfully, false otherwise.
+ *  returns: true if there was a number, false otherwise.
  */
-bool parse_request(char* buffer, char** request_line, char** method, 
-                    char** file_path, char** protocol_version);
+bool parse_range_number(char** p, char* end, size_t* number);
 
 /*
- * Function: malloc_check_close
+ * Function: negotiate_encoding
  * --------------------
- *  Checks if malloc was successful. If it was not, it closes the socket and
- *  frees the queue, then exits.
+ *  Picks the most preferred precompressed variant of a file that the client 
+ *  accepts, falling back to the file itself.
  * 
- *  ptr: Pointer to the memory allocated.
- *  clientfd: Socket file descriptor.
- *  queue: free queue
+ *  file: The uncompressed file, released if a variant is returned.
+ *  req: The parsed request.
+ * 
+ *  returns: The file to serve.
+ */
+struct file_entry* negotiate_encoding(struct file_entry* file, 
+                                    struct http_request* req);
+
+/*
+ * Function: accepts_encoding
+ * --------------------
+ *  Checks if an Accept-Encoding value allows a content coding. A coding 
+ *  listed with a q-value of zero is refused, and "*" stands for any coding 
+ *  not listed.
+ * 
+ *  value: The header value.
+ *  value_len: Length of the header value.
+ *  coding: The content coding to look for.
+ * 
+ *  returns: true if the coding is acceptable, false otherwise.
+ */
+bool accepts_encoding(char* value, size_t value_len, char* coding);
+
+/*
+ * Function: qvalue_is_zero
+ * --------------------
+ *  Checks if the parameters of an Accept-Encoding item give it a q-value of 
+ *  zero, such as "q=0" or "q=0.000".
+ * 
+ *  params: Start of the parameters, following the coding.
+ *  end: End of the item.
+ * 
+ *  returns: true if the q-value is zero, false otherwise.
+ */
+bool qvalue_is_zero(char* params, char* end);
+
+/*
+ * Function: handle_client
+ * --------------------
+ *  Serves a client connection on a worker thread until it closes, then 
+ *  frees it.
+ * 
+ *  conn: The connection.
+ *  shard: The shard whose counters to update.
  * 
  *  returns: Nothing.
  */
-void malloc_check_close(void* ptr, int clientfd, queue_t* queue);
+void handle_client(struct conn* conn, struct shard* shard);
+
+/*
+ * Function: read_request
+ * --------------------
+ *  Reads the request from the client into the connection buffer, resuming 
+ *  from wherever the last call stopped.
+ * 
+ *  conn: The connection.
+ * 
+ *  returns: SUCCESS, CONN_AGAIN or ERROR.
+ */
+int read_request(struct conn* conn);
+
+/*
+ * Function: send_response
+ * --------------------
+ *  Sends every prepared response in order, resuming from wherever the last 
+ *  call stopped. Headers and in-memory bodies of consecutive responses are 
+ *  gathered into one write, corked so they share packets with any file 
+ *  that follows.
+ * 
+ *  conn: The connection.
+ * 
+ *  returns: SUCCESS, CONN_AGAIN or ERROR.
+ */
+int send_response(struct conn* conn);
+
+/*
+ * Function: create_response_headers
+ * --------------------
+ *  Creates the response headers.
+ * 
+ *  status_code: Status code of the response.
+ *  status_message: Status message of the response.
+ *  entity_headers: Preformatted header lines describing the body.
+ *  http_version: Protocol version to respond with.
+ *  keep_alive: Whether the connection stays open afterwards.
+ *  arena: Arena to allocate the headers from.
+ * 
+ *  returns: Pointer to the response headers.
+ */
+char* create_response_headers(char* status_code, char* status_message, 
+    char* entity_headers, char* http_version, bool keep_alive, 
+    arena_t* arena);
 
 /*
- * Function: close_and_clean
+ * Function: path_component_exists
  * --------------------
- *  Closes the socket and frees the queue.
+ *  Checks if the path has a ".." component.
  * 
- *  clientfd: Socket file descriptor.
- *  free_queue: Free queue.
+ *  file_path: Path to the file.
  * 
- *  returns: NULL.
+ *  returns: true if the path component exists, false otherwise.
  */
-void* close_and_clean(int clientfd, queue_t* free_queue);
+bool path_component_exists(char* file_path);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,251 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file contains the epoll event loop used to serve many 
+         connections from a single thread.
+*/
+#define _GNU_SOURCE
+#include "eventloop.h"
+#include "connops.h"
+#include "serverops.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+/*
+ * Function: run_event_loop
+ * --------------------
+ *  Serves every connection from a single thread using edge-triggered 
+ *  epoll. Never returns.
+ * 
+ *  shard: The shard whose listener to serve.
+ * 
+ *  returns: Nothing.
+ */
+void run_event_loop(struct shard* shard) {
+    struct epoll_event ev = {0}, events[MAX_EVENTS];
+    struct event_loop loop = { -1, shard->sockfd, shard->root_path, shard, 
+                            NULL, NULL };
+
+    if (set_nonblocking(loop.sockfd) != SUCCESS) {
+        exit(EXIT_FAILURE);
+    }
+
+    loop.epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epollfd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    // The listener is the only entry whose data is not a connection
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop.epollfd, EPOLL_CTL_ADD, loop.sockfd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    while (true) {
+        // Only wake up periodically while there is something to time out
+        int timeout = loop.idle_head != NULL ? IDLE_CHECK_MS : -1;
+        int n = epoll_wait(loop.epollfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct conn* conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections(&loop);
+                continue;
+            }
+
+            // Resume the connection wherever it would have blocked
+            serve_connection(&loop, conn);
+        }
+
+        close_idle(&loop);
+    }
+}
+
+/*
+ * Function: accept_connections
+ * --------------------
+ *  Accepts every pending connection on the listener and registers each one 
+ *  with the epoll instance.
+ * 
+ *  loop: The event loop.
+ * 
+ *  returns: Nothing.
+ */
+void accept_connections(struct event_loop* loop) {
+    struct epoll_event ev = {0};
+
+    // Edge-triggered, so drain the backlog until it would block
+    while (true) {
+        int clientfd = accept4(loop->sockfd, NULL, NULL, 
+                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept4");
+            return;
+        }
+        atomic_fetch_add_explicit(&loop->shard->accepted, 1, 
+                                memory_order_relaxed);
+
+        struct conn* conn = conn_create(clientfd, loop->root_path);
+
+        // Wait for both directions up front so no re-arming is needed when 
+        // the connection switches from reading to writing
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, clientfd, &ev) < 0) {
+            perror("epoll_ctl");
+            conn_free(conn);
+            continue;
+        }
+
+        // Request bytes often arrive with the connection, so try right away
+        serve_connection(loop, conn);
+    }
+}
+
+/*
+ * Function: serve_connection
+ * --------------------
+ *  Runs a connection until it would block, serving each kept-alive request 
+ *  in turn. Frees the connection once it is finished.
+ * 
+ *  loop: The event loop.
+ *  conn: The connection.
+ * 
+ *  returns: Nothing.
+ */
+void serve_connection(struct event_loop* loop, struct conn* conn) {
+    int status = SUCCESS;
+
+    while ((status = conn_step(conn)) == SUCCESS) {
+        atomic_fetch_add_explicit(&loop->shard->requests, conn->n_responses, 
+                                memory_order_relaxed);
+        if (!conn_next_request(conn)) {
+            break;
+        }
+    }
+
+    if (status == CONN_AGAIN) {
+        idle_touch(loop, conn);
+        return;
+    }
+    // Closing the socket also removes it from the epoll set
+    idle_remove(loop, conn);
+    conn_free(conn);
+}
+
+/*
+ * Function: idle_touch
+ * --------------------
+ *  Marks a connection as active now, moving it to the back of the idle list.
+ * 
+ *  loop: The event loop.
+ *  conn: The connection.
+ * 
+ *  returns: Nothing.
+ */
+void idle_touch(struct event_loop* loop, struct conn* conn) {
+    idle_remove(loop, conn);
+
+    conn->last_active = monotonic_seconds();
+    conn->idle_prev = loop->idle_tail;
+    conn->idle_next = NULL;
+    if (loop->idle_tail != NULL) {
+        loop->idle_tail->idle_next = conn;
+    } else {
+        loop->idle_head = conn;
+    }
+    loop->idle_tail = conn;
+}
+
+/*
+ * Function: idle_remove
+ * --------------------
+ *  Removes a connection from the idle list.
+ * 
+ *  loop: The event loop.
+ *  conn: The connection.
+ * 
+ *  returns: Nothing.
+ */
+void idle_remove(struct event_loop* loop, struct conn* conn) {
+    if (conn->idle_prev != NULL) {
+        conn->idle_prev->idle_next = conn->idle_next;
+    } else if (loop->idle_head == conn) {
+        loop->idle_head = conn->idle_next;
+    }
+    if (conn->idle_next != NULL) {
+        conn->idle_next->idle_prev = conn->idle_prev;
+    } else if (loop->idle_tail == conn) {
+        loop->idle_tail = conn->idle_prev;
+    }
+    conn->idle_prev = NULL;
+    conn->idle_next = NULL;
+}
+
+/*
+ * Function: close_idle
+ * --------------------
+ *  Closes every connection that has been idle for longer than the timeout.
+ * 
+ *  loop: The event loop.
+ * 
+ *  returns: Nothing.
+ */
+void close_idle(struct event_loop* loop) {
+    time_t now = monotonic_seconds();
+
+    // The list is ordered by activity, so stop at the first live connection
+    while (loop->idle_head != NULL && 
+            now - loop->idle_head->last_active >= server_options.idle_timeout) {
+        struct conn* conn = loop->idle_head;
+        idle_remove(loop, conn);
+        conn_free(conn);
+    }
+}
+
+/*
+ * Function: monotonic_seconds
+ * --------------------
+ *  Gets the current monotonic time.
+ * 
+ *  No parameters.
+ * 
+ *  returns: The time in seconds.
+ */
+time_t monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*
+ * Function: set_nonblocking
+ * --------------------
+ *  Puts a file descriptor into non-blocking mode.
+ * 
+ *  fd: The file descriptor.
+ * 
+ *  returns: SUCCESS or ERROR.
+ */
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return ERROR;
+    }
+    return SUCCESS;
+}
@@ -0,0 +1,116 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "connops.h"
+#include "serverops.h"
+#include <stdlib.h>
+#include <time.h>
+
+#define MAX_EVENTS 1024
+#define IDLE_CHECK_MS 1000
+
+struct event_loop {
+    int epollfd;
+    int sockfd;
+    char* root_path;
+    struct shard* shard;
+    // Connections ordered from least to most recently active
+    struct conn* idle_head;
+    struct conn* idle_tail;
+};
+
+/*
+ * Function: run_event_loop
+ * --------------------
+ *  Serves every connection from a single thread using edge-triggered 
+ *  epoll. Never returns.
+ * 
+ *  shard: The shard whose listener to serve.
+ * 
+ *  returns: Nothing.
+ */
+void run_event_loop(struct shard* shard);
+
+/*
+ * Function: set_nonblocking
+ * --------------------
+ *  Puts a file descriptor into non-blocking mode.
+ * 
+ *  fd: The file descriptor.
+ * 
+ *  returns: SUCCESS or ERROR.
+ */
+int set_nonblocking(int fd);
+
+/*
+ * Function: accept_connections
+ * --------------------
+ *  Accepts every pending connection on the listener and registers each one 
+ *  with the epoll instance.
+ * 
+ *  loop: The event loop.
+ * 
+ *  returns: Nothing.
+ */
+void accept_connections(struct event_loop* loop);
+
+/*
+ * Function: serve_connection
+ * --------------------
+ *  Runs a connection until it would block, serving each kept-alive request 
+ *  in turn. Frees the connection once it is finished.
+ * 
+ *  loop: The event loop.
+ *  conn: The connection.
+ * 
+ *  returns: Nothing.
+ */
+void serve_connection(struct event_loop* loop, struct conn* conn);
+
+/*
+ * Function: idle_touch
+ * --------------------
+ *  Marks a connection as active now, moving it to the back of the idle list.
+ * 
+ *  loop: The event loop.
+ *  conn: The connection.
+ * 
+ *  returns: Nothing.
+ */
+void idle_touch(struct event_loop* loop, struct conn* conn);
+
+/*
+ * Function: idle_remove
+ * --------------------
+ *  Removes a connection from the idle list.
+ * 
+ *  loop: The event loop.
+ *  conn: The connection.
+ * 
+ *  returns: Nothing.
+ */
+void idle_remove(struct event_loop* loop, struct conn* conn);
+
+/*
+ * Function: close_idle
+ * --------------------
+ *  Closes every connection that has been idle for longer than the timeout.
+ * 
+ *  loop: The event loop.
+ * 
+ *  returns: Nothing.
+ */
+void close_idle(struct event_loop* loop);
+
+/*
+ * Function: monotonic_seconds
+ * --------------------
+ *  Gets the current monotonic time.
+ * 
+ *  No parameters.
+ * 
+ *  returns: The time in seconds.
+ */
+time_t monotonic_seconds(void);
+
+#endif
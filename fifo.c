@@ -0,0 +1,150 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file is a bounded single-producer multi-consumer FIFO, used
+         to give each worker thread its own queue of connections.
+*/
+
+#include "fifo.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Function: fifo_init
+ * --------------------
+ *  Sets up an empty queue.
+ * 
+ *  fifo: The queue.
+ *  capacity: Number of slots, rounded up to a power of two.
+ * 
+ *  returns: Nothing.
+ */
+void fifo_init(fifo_t* fifo, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    fifo->cells = calloc(size, sizeof(*fifo->cells));
+    if (fifo->cells == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&fifo->head, 0);
+    atomic_init(&fifo->tail, 0);
+    fifo->mask = size - 1;
+}
+
+/*
+ * Function: fifo_push
+ * --------------------
+ *  Adds data at the tail. Only the acceptor may push.
+ * 
+ *  fifo: The queue.
+ *  data: Data to insert.
+ * 
+ *  returns: true if it was added, false if the queue is full.
+ */
+bool fifo_push(fifo_t* fifo, void* data) {
+    long tail = atomic_load_explicit(&fifo->tail, memory_order_relaxed);
+    long head = atomic_load_explicit(&fifo->head, memory_order_acquire);
+
+    // Never overwrite a cell a consumer may still be reading
+    if (tail - head > fifo->mask) {
+        return false;
+    }
+    atomic_store_explicit(&fifo->cells[tail & fifo->mask], data, 
+                        memory_order_relaxed);
+    // Publish the cell before the new tail makes it visible to consumers
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&fifo->tail, tail + 1, memory_order_relaxed);
+    return true;
+}
+
+/*
+ * Function: fifo_push_batch
+ * --------------------
+ *  Adds several items at the tail, publishing them to consumers together. 
+ *  Only the acceptor may push.
+ * 
+ *  fifo: The queue.
+ *  data: Data to insert, in order.
+ *  n: Number of items.
+ * 
+ *  returns: The number added, fewer than n if the queue filled up.
+ */
+size_t fifo_push_batch(fifo_t* fifo, void** data, size_t n) {
+    long tail = atomic_load_explicit(&fifo->tail, memory_order_relaxed);
+    long head = atomic_load_explicit(&fifo->head, memory_order_acquire);
+    size_t room = fifo->mask + 1 - (tail - head);
+
+    if (n > room) {
+        n = room;
+    }
+    for (size_t i = 0; i < n; i++) {
+        atomic_store_explicit(&fifo->cells[(tail + i) & fifo->mask], 
+                            data[i], memory_order_relaxed);
+    }
+    // One fence and one store of tail make the whole batch visible
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&fifo->tail, tail + n, memory_order_relaxed);
+    return n;
+}
+
+/*
+ * Function: fifo_take
+ * --------------------
+ *  Removes the oldest data from the head. Any thread may take.
+ * 
+ *  fifo: The queue.
+ * 
+ *  returns: Pointer to the data, or NULL if the queue is empty.
+ */
+void* fifo_take(fifo_t* fifo) {
+    while (true) {
+        long head = atomic_load_explicit(&fifo->head, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        long tail = atomic_load_explicit(&fifo->tail, 
+                                        memory_order_acquire);
+        if (head >= tail) {
+            return NULL;
+        }
+
+        // Read before claiming, the claim fails if the cell was taken
+        void* data = atomic_load_explicit(&fifo->cells[head & fifo->mask], 
+                                        memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(&fifo->head, &head, 
+                    head + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            return data;
+        }
+        // Another consumer got it first, try the next one
+    }
+}
+
+/*
+ * Function: fifo_size
+ * --------------------
+ *  Gets an approximate count of the items in the queue.
+ * 
+ *  fifo: The queue.
+ * 
+ *  returns: The number of items.
+ */
+size_t fifo_size(fifo_t* fifo) {
+    long head = atomic_load_explicit(&fifo->head, memory_order_relaxed);
+    long tail = atomic_load_explicit(&fifo->tail, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+/*
+ * Function: fifo_destroy
+ * --------------------
+ *  Frees the queue's slots. Items still in it are not freed.
+ * 
+ *  fifo: The queue.
+ * 
+ *  returns: Nothing.
+ */
+void fifo_destroy(fifo_t* fifo) {
+    free(fifo->cells);
+    fifo->cells = NULL;
+}
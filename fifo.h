@@ -0,0 +1,97 @@
+#ifndef FIFO_H
+#define FIFO_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "ring.h"
+
+#define FIFO_CAPACITY 64
+
+/*
+ * A bounded single-producer multi-consumer FIFO. The acceptor is the only 
+ * thread that pushes, at the tail, and every consumer, the owning worker 
+ * included, takes from the head with a CAS. Only the producer writes the 
+ * tail, so a push costs no atomic read-modify-write. There is no pop from 
+ * the tail: this is not a Chase-Lev deque and relies on none of its 
+ * invariants.
+ */
+typedef struct fifo {
+    _Alignas(CACHE_LINE) atomic_long head;
+    _Alignas(CACHE_LINE) atomic_long tail;
+    _Alignas(CACHE_LINE) long mask;
+    _Atomic(void*)* cells;
+} fifo_t;
+
+/*
+ * Function: fifo_init
+ * --------------------
+ *  Sets up an empty queue.
+ * 
+ *  fifo: The queue.
+ *  capacity: Number of slots, rounded up to a power of two.
+ * 
+ *  returns: Nothing.
+ */
+void fifo_init(fifo_t* fifo, size_t capacity);
+
+/*
+ * Function: fifo_push
+ * --------------------
+ *  Adds data at the tail. Only the acceptor may push.
+ * 
+ *  fifo: The queue.
+ *  data: Data to insert.
+ * 
+ *  returns: true if it was added, false if the queue is full.
+ */
+bool fifo_push(fifo_t* fifo, void* data);
+
+/*
+ * Function: fifo_push_batch
+ * --------------------
+ *  Adds several items at the tail, publishing them to consumers together. 
+ *  Only the acceptor may push.
+ * 
+ *  fifo: The queue.
+ *  data: Data to insert, in order.
+ *  n: Number of items.
+ * 
+ *  returns: The number added, fewer than n if the queue filled up.
+ */
+size_t fifo_push_batch(fifo_t* fifo, void** data, size_t n);
+
+/*
+ * Function: fifo_take
+ * --------------------
+ *  Removes the oldest data from the head. Any thread may take.
+ * 
+ *  fifo: The queue.
+ * 
+ *  returns: Pointer to the data, or NULL if the queue is empty.
+ */
+void* fifo_take(fifo_t* fifo);
+
+/*
+ * Function: fifo_size
+ * --------------------
+ *  Gets an approximate count of the items in the queue.
+ * 
+ *  fifo: The queue.
+ * 
+ *  returns: The number of items.
+ */
+size_t fifo_size(fifo_t* fifo);
+
+/*
+ * Function: fifo_destroy
+ * --------------------
+ *  Frees the queue's slots. Items still in it are not freed.
+ * 
+ *  fifo: The queue.
+ * 
+ *  returns: Nothing.
+ */
+void fifo_destroy(fifo_t* fifo);
+
+#endif
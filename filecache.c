@@ -0,0 +1,589 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file contains a cache of open files and their metadata, 
+         so hot files skip the stat, open and close on every request. 
+         Small files are kept in memory so they are sent with the headers.
+*/
+#define _GNU_SOURCE
+#include "filecache.h"
+#include "connops.h"
+#include "serverops.h"
+#include "eventloop.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+// Low bits pick the shard, the bits above them the bucket within it
+#define SHARD_OF(hash) ((hash) % FILE_CACHE_SHARDS)
+#define BUCKET_OF(hash) (((hash) / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS)
+#define KIND_OF(entry) ((entry)->data != NULL ? FILE_KIND_MEMORY : FILE_KIND_FD)
+
+static file_cache_shard_t cache_shards[FILE_CACHE_SHARDS];
+// Budgets of each shard, 0 when that kind is not cached
+static size_t shard_fd_capacity = 0;
+static size_t shard_byte_capacity = 0;
+static size_t small_file_limit = 0;
+// Files are opened relative to the root, beneath it when the kernel can 
+// enforce that
+static int root_fd = AT_FDCWD;
+static bool has_openat2 = false;
+
+static char* encoding_names[ENCODINGS] = { NULL, "br", "gzip" };
+static char* encoding_suffixes[ENCODINGS] = { NULL, ".br", ".gz" };
+
+/*
+ * Function: file_cache_init
+ * --------------------
+ *  Sets up the file cache, opening the root directory the files are 
+ *  served from.
+ * 
+ *  root_path: The root directory.
+ *  max_fds: Most files kept open by the cache, 0 to keep none open.
+ *  max_bytes: Most bytes of small files held in memory, 0 to hold none.
+ *  small_file_max: Largest file held in memory.
+ * 
+ *  returns: Nothing.
+ */
+void file_cache_init(char* root_path, size_t max_fds, size_t max_bytes, 
+                    size_t small_file_max) {
+    root_fd = open(root_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        perror("open root path");
+        exit(EXIT_FAILURE);
+    }
+    // openat2 needs 5.6, and may be filtered out by seccomp
+    struct open_how how = { .flags = O_PATH | O_CLOEXEC, 
+                            .resolve = RESOLVE_BENEATH };
+    int fd = syscall(SYS_openat2, root_fd, ".", &how, sizeof(how));
+    has_openat2 = fd >= 0;
+    if (has_openat2) {
+        close(fd);
+    } else {
+        fprintf(stderr, "openat2 unavailable (%s), resolving paths with "
+                "openat\n", strerror(errno));
+    }
+
+    memset(cache_shards, 0, sizeof(cache_shards));
+    for (size_t i = 0; i < FILE_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache_shards[i].lock, NULL);
+    }
+    // Round up so a small limit still caches something in every shard
+    shard_fd_capacity = (max_fds + FILE_CACHE_SHARDS - 1) / FILE_CACHE_SHARDS;
+    shard_byte_capacity = max_bytes / FILE_CACHE_SHARDS;
+    small_file_limit = shard_byte_capacity > 0 ? small_file_max : 0;
+}
+
+/*
+ * Function: lru_unlink
+ * --------------------
+ *  Removes an entry from its shard's LRU list. The shard lock must be held.
+ */
+static void lru_unlink(file_cache_shard_t* shard, file_entry_t* entry) {
+    file_kind_t kind = KIND_OF(entry);
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head[kind] = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail[kind] = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+/*
+ * Function: lru_append
+ * --------------------
+ *  Adds an entry as the most recently used. The shard lock must be held.
+ */
+static void lru_append(file_cache_shard_t* shard, file_entry_t* entry) {
+    file_kind_t kind = KIND_OF(entry);
+    entry->lru_prev = shard->lru_tail[kind];
+    entry->lru_next = NULL;
+    if (shard->lru_tail[kind] != NULL) {
+        shard->lru_tail[kind]->lru_next = entry;
+    } else {
+        shard->lru_head[kind] = entry;
+    }
+    shard->lru_tail[kind] = entry;
+}
+
+/*
+ * Function: unlink_entry
+ * --------------------
+ *  Removes an entry from its shard. The shard lock must be held, and the 
+ *  caller becomes responsible for the cache's reference.
+ */
+static void unlink_entry(file_cache_shard_t* shard, file_entry_t* entry) {
+    file_entry_t** link = 
+        &shard->buckets[BUCKET_OF(hash_path(entry->path) ^ entry->encoding)];
+    while (*link != NULL && *link != entry) {
+        link = &(*link)->hash_next;
+    }
+    if (*link == entry) {
+        *link = entry->hash_next;
+    }
+    entry->hash_next = NULL;
+    lru_unlink(shard, entry);
+    entry->cached = false;
+    if (KIND_OF(entry) == FILE_KIND_MEMORY) {
+        shard->memory_bytes -= entry->size;
+    } else {
+        shard->fd_count--;
+    }
+}
+
+/*
+ * Function: over_budget
+ * --------------------
+ *  Checks if adding an entry would take its kind over the shard's budget. 
+ *  The shard lock must be held.
+ */
+static bool over_budget(file_cache_shard_t* shard, file_entry_t* entry) {
+    if (KIND_OF(entry) == FILE_KIND_MEMORY) {
+        return shard->memory_bytes + entry->size > shard_byte_capacity;
+    }
+    return shard->fd_count + 1 > shard_fd_capacity;
+}
+
+/*
+ * Function: file_cache_get
+ * --------------------
+ *  Gets an open file, from the cache when possible. Only regular files with 
+ *  a known content type are returned.
+ * 
+ *  file_path: Path to the file, relative to the root.
+ * 
+ *  returns: A referenced entry, or NULL if there is no such file.
+ */
+file_entry_t* file_cache_get(char* file_path) {
+    return file_cache_lookup(file_path, NULL, ENCODING_IDENTITY);
+}
+
+/*
+ * Function: file_cache_get_variant
+ * --------------------
+ *  Gets the precompressed variant of a file, such as "foo.js.gz" for 
+ *  "foo.js", from the cache when possible.
+ * 
+ *  base: The uncompressed file.
+ *  encoding: The encoding wanted.
+ * 
+ *  returns: A referenced entry, or NULL if there is no such variant.
+ */
+file_entry_t* file_cache_get_variant(file_entry_t* base, encoding_t encoding) {
+    if (encoding == ENCODING_IDENTITY || !base->has_variant[encoding]) {
+        return NULL;
+    }
+
+    char* suffix = encoding_suffix(encoding);
+    char variant_path[strlen(base->path) + strlen(suffix) + 1];
+    strcpy(variant_path, base->path);
+    strcat(variant_path, suffix);
+
+    return file_cache_lookup(variant_path, base, encoding);
+}
+
+/*
+ * Function: file_cache_lookup
+ * --------------------
+ *  Looks a file up in the cache, loading and caching it on a miss.
+ * 
+ *  file_path: Path to the file, relative to the root.
+ *  base: The uncompressed file when looking up a variant, otherwise NULL.
+ *  encoding: The encoding of the file.
+ * 
+ *  returns: A referenced entry, or NULL if there is no such file.
+ */
+file_entry_t* file_cache_lookup(char* file_path, file_entry_t* base, 
+                                encoding_t encoding) {
+    if (shard_fd_capacity == 0 && shard_byte_capacity == 0) {
+        return file_cache_load(file_path, base, encoding);
+    }
+
+    // Variants share the path's hash, so mix the encoding in
+    unsigned int hash = hash_path(file_path) ^ encoding;
+    file_cache_shard_t* shard = &cache_shards[SHARD_OF(hash)];
+    file_entry_t** bucket = &shard->buckets[BUCKET_OF(hash)];
+    file_entry_t* entry = NULL;
+
+    // HIT
+    pthread_mutex_lock(&shard->lock);
+    for (entry = *bucket; entry != NULL; entry = entry->hash_next) {
+        if (entry->encoding == encoding && 
+                strcmp(entry->path, file_path) == 0) {
+            atomic_fetch_add(&entry->refs, 1);
+            lru_unlink(shard, entry);
+            lru_append(shard, entry);
+            shard->hits++;
+            if (entry->data != NULL) {
+                shard->memory_hits++;
+            }
+            break;
+        }
+    }
+    if (entry == NULL) {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (entry != NULL) {
+        if (file_cache_is_fresh(entry)) {
+            return entry;
+        }
+        // Changed on disk, drop it and load the new file below
+        file_cache_evict(entry);
+        file_cache_release(entry);
+    }
+
+    // MISS - open outside the lock, the disk may be slow
+    file_entry_t* loaded = file_cache_load(file_path, base, encoding);
+    if (loaded == NULL) {
+        return NULL;
+    }
+    file_kind_t kind = KIND_OF(loaded);
+
+    pthread_mutex_lock(&shard->lock);
+    // Another thread may have loaded it meanwhile
+    for (entry = *bucket; entry != NULL; entry = entry->hash_next) {
+        if (entry->encoding == encoding && 
+                strcmp(entry->path, file_path) == 0) {
+            break;
+        }
+    }
+    // Too big for the budget on its own, serve it without caching
+    bool fits = kind == FILE_KIND_MEMORY ? loaded->size <= shard_byte_capacity 
+                                        : shard_fd_capacity > 0;
+    file_entry_t* evicted = NULL;
+    if (entry == NULL && fits) {
+        // Make room by dropping the least recently used entries of its kind
+        while (over_budget(shard, loaded) && shard->lru_head[kind] != NULL) {
+            file_entry_t* victim = shard->lru_head[kind];
+            unlink_entry(shard, victim);
+            // Reuse hash_next to collect victims for release after unlock
+            victim->hash_next = evicted;
+            evicted = victim;
+        }
+
+        // The cache keeps its own reference
+        atomic_fetch_add(&loaded->refs, 1);
+        loaded->cached = true;
+        loaded->shard = SHARD_OF(hash);
+        loaded->hash_next = *bucket;
+        *bucket = loaded;
+        lru_append(shard, loaded);
+        if (kind == FILE_KIND_MEMORY) {
+            shard->memory_bytes += loaded->size;
+        } else {
+            shard->fd_count++;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    while (evicted != NULL) {
+        file_entry_t* next = evicted->hash_next;
+        evicted->hash_next = NULL;
+        file_cache_release(evicted);
+        evicted = next;
+    }
+    return loaded;
+}
+
+/*
+ * Function: file_cache_release
+ * --------------------
+ *  Drops a reference taken by file_cache_get, closing the file once no 
+ *  one uses it.
+ * 
+ *  entry: The entry.
+ * 
+ *  returns: Nothing.
+ */
+void file_cache_release(file_entry_t* entry) {
+    if (entry == NULL) {
+        return;
+    }
+    if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+        if (entry->fd >= 0) {
+            close(entry->fd);
+        }
+        free(entry->data);
+        free(entry->path);
+        free(entry);
+    }
+}
+
+/*
+ * Function: file_cache_load
+ * --------------------
+ *  Opens a file and builds an uncached entry for it.
+ * 
+ *  file_path: Path to the file, relative to the root.
+ *  base: The uncompressed file when loading a variant, otherwise NULL.
+ *  encoding: The encoding of the file.
+ * 
+ *  returns: An entry with one reference, or NULL if there is no such file.
+ */
+file_entry_t* file_cache_load(char* file_path, file_entry_t* base, 
+                            encoding_t encoding) {
+    char content_type[MAX_CONTENT_TYPE_LEN + 1] = {0};
+    struct stat sb;
+
+    // Open first and stat what was opened, so the file checked is the one 
+    // served
+    int fd = open_beneath_root(file_path);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (base != NULL) {
+        // A variant is served with the content type of the original
+        if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+            close(fd);
+            return NULL;
+        }
+        strcpy(content_type, base->content_type);
+    } else if (!file_stats(fd, file_path, content_type, &sb)) {
+        close(fd);
+        return NULL;
+    }
+
+    file_entry_t* entry = malloc(sizeof(file_entry_t));
+    malloc_check(entry);
+    entry->path = strdup(file_path);
+    malloc_check(entry->path);
+
+    entry->fd = fd;
+    entry->data = NULL;
+    entry->size = sb.st_size;
+    entry->mtime = sb.st_mtime;
+    entry->ino = sb.st_ino;
+    strcpy(entry->content_type, content_type);
+    entry->encoding = encoding;
+
+    // Look for precompressed variants once, here, so negotiating an 
+    // encoding for a cached file never needs a stat. Responses that could 
+    // have been encoded differently carry a Vary header.
+    memset(entry->has_variant, 0, sizeof(entry->has_variant));
+    bool vary = base != NULL;
+    for (int i = ENCODING_IDENTITY + 1; base == NULL && i < ENCODINGS; i++) {
+        char* suffix = encoding_suffix(i);
+        char variant_path[strlen(file_path) + strlen(suffix) + 1];
+        strcpy(variant_path, file_path);
+        strcat(variant_path, suffix);
+        struct stat variant_sb;
+        entry->has_variant[i] = fstatat(root_fd, variant_path, &variant_sb, 
+                                        0) == 0 && 
+                                S_ISREG(variant_sb.st_mode);
+        vary = vary || entry->has_variant[i];
+    }
+
+    entry->vary = vary;
+    format_validators(entry->validators, VALIDATORS_LEN + 1, entry->ino, 
+                    entry->size, entry->mtime, encoding_name(encoding));
+    // The ETag's value follows its header name
+    entry->etag = entry->validators + strlen(ETAG_HEADER) + 2;
+    entry->etag_len = strcspn(entry->etag, END_OF_REQ_LINE);
+    format_entity_headers(entry->entity_headers, ENTITY_HEADERS_LEN + 1, 
+                        entry->content_type, encoding_name(encoding), vary, 
+                        entry->validators, entry->size);
+    atomic_init(&entry->refs, 1);
+    atomic_init(&entry->checked, monotonic_seconds());
+    entry->cached = false;
+    entry->shard = 0;
+    entry->hash_next = NULL;
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+
+    // Small files live in memory so they go out in the same write as the 
+    // headers, and hold no descriptor
+    if (entry->size > 0 && entry->size <= small_file_limit && 
+            (entry->data = read_file(fd, entry->size)) != NULL) {
+        close(fd);
+        entry->fd = -1;
+    }
+
+    return entry;
+}
+
+/*
+ * Function: read_file
+ * --------------------
+ *  Reads a whole file into a new buffer.
+ * 
+ *  fd: The open file.
+ *  size: Size of the file.
+ * 
+ *  returns: The buffer, or NULL if the file could not be read.
+ */
+char* read_file(int fd, size_t size) {
+    char* data = malloc(size);
+    malloc_check(data);
+
+    size_t total_read = 0;
+    while (total_read < size) {
+        ssize_t n = pread(fd, data + total_read, size - total_read, 
+                        total_read);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        // Error, or the file shrank since it was stat'ed
+        if (n <= 0) {
+            free(data);
+            return NULL;
+        }
+        total_read += n;
+    }
+    return data;
+}
+
+/*
+ * Function: open_beneath_root
+ * --------------------
+ *  Opens a file for reading relative to the root. With openat2 the kernel 
+ *  refuses any path that would resolve outside the root, through ".." or 
+ *  a symlink, in the same walk that opens it. Without it, ".." components 
+ *  are already refused by the request path check.
+ * 
+ *  file_path: Path to the file, relative to the root.
+ * 
+ *  returns: The file descriptor, or -1 if it could not be opened.
+ */
+int open_beneath_root(char* file_path) {
+    // Non-blocking so a FIFO in the root cannot stall the open, it makes 
+    // no difference to regular files
+    int flags = O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC;
+
+    if (has_openat2) {
+        struct open_how how = { .flags = flags, 
+                        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS };
+        return syscall(SYS_openat2, root_fd, file_path, &how, sizeof(how));
+    }
+    return openat(root_fd, file_path, flags);
+}
+
+/*
+ * Function: file_cache_is_fresh
+ * --------------------
+ *  Checks, at most once every FILE_CACHE_REVALIDATE seconds, that the file 
+ *  on disk is still the one the entry describes.
+ * 
+ *  entry: The entry.
+ * 
+ *  returns: true if the entry can be used, false otherwise.
+ */
+bool file_cache_is_fresh(file_entry_t* entry) {
+    long now = monotonic_seconds();
+    if (now - atomic_load_explicit(&entry->checked, memory_order_relaxed) 
+            < FILE_CACHE_REVALIDATE) {
+        return true;
+    }
+
+    struct stat sb;
+    if (fstatat(root_fd, entry->path, &sb, 0) != 0 || 
+            sb.st_ino != entry->ino || sb.st_mtime != entry->mtime || 
+            (size_t)sb.st_size != entry->size) {
+        return false;
+    }
+    atomic_store_explicit(&entry->checked, now, memory_order_relaxed);
+    return true;
+}
+
+/*
+ * Function: file_cache_evict
+ * --------------------
+ *  Removes an entry from the cache if it is still cached.
+ * 
+ *  entry: The entry.
+ * 
+ *  returns: Nothing.
+ */
+void file_cache_evict(file_entry_t* entry) {
+    file_cache_shard_t* shard = &cache_shards[entry->shard];
+    bool dropped = false;
+
+    pthread_mutex_lock(&shard->lock);
+    if (entry->cached) {
+        unlink_entry(shard, entry);
+        dropped = true;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    // Give up the cache's reference
+    if (dropped) {
+        file_cache_release(entry);
+    }
+}
+
+/*
+ * Function: file_cache_stats
+ * --------------------
+ *  Adds up the counters of every shard.
+ * 
+ *  stats: The totals.
+ * 
+ *  returns: Nothing.
+ */
+void file_cache_stats(struct file_cache_stats* stats) {
+    memset(stats, 0, sizeof(struct file_cache_stats));
+    for (size_t i = 0; i < FILE_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache_shards[i].lock);
+        stats->hits += cache_shards[i].hits;
+        stats->memory_hits += cache_shards[i].memory_hits;
+        stats->misses += cache_shards[i].misses;
+        stats->fd_count += cache_shards[i].fd_count;
+        stats->memory_bytes += cache_shards[i].memory_bytes;
+        pthread_mutex_unlock(&cache_shards[i].lock);
+    }
+}
+
+/*
+ * Function: encoding_name
+ * --------------------
+ *  Gets the content coding name of an encoding, as used in headers.
+ * 
+ *  encoding: The encoding.
+ * 
+ *  returns: The name, or NULL for the identity encoding.
+ */
+char* encoding_name(encoding_t encoding) {
+    return encoding_names[encoding];
+}
+
+/*
+ * Function: encoding_suffix
+ * --------------------
+ *  Gets the file name suffix of an encoding's precompressed variants.
+ * 
+ *  encoding: The encoding.
+ * 
+ *  returns: The suffix, or NULL for the identity encoding.
+ */
+char* encoding_suffix(encoding_t encoding) {
+    return encoding_suffixes[encoding];
+}
+
+/*
+ * Function: hash_path
+ * --------------------
+ *  Hashes a path with FNV-1a.
+ * 
+ *  path: The path.
+ * 
+ *  returns: The hash.
+ */
+unsigned int hash_path(char* path) {
+    unsigned int hash = 2166136261u;
+    for (; *path != '\0'; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,275 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include "connops.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_BUCKETS 256
+#define FILE_CACHE_REVALIDATE 1
+#define FD_CACHE_DEFAULT 256
+#define MEM_CACHE_DEFAULT (16 * 1024 * 1024)
+#define SMALL_FILE_MAX_DEFAULT (64 * 1024)
+#define ENTITY_HEADERS_LEN 320
+#define VALIDATORS_LEN 128
+
+/*
+ * An open file and everything needed to answer a request for it. Small 
+ * files are read into memory instead of being kept open. Entries are 
+ * reference counted: the cache holds one reference while the entry is 
+ * cached and every in-flight response holds another, so an evicted file 
+ * stays open until the last response using it is finished.
+ */
+typedef struct file_entry file_entry_t;
+
+// Encodings a file may be stored in, in order of preference
+typedef enum encoding {
+    ENCODING_IDENTITY,
+    ENCODING_BR,
+    ENCODING_GZIP,
+    ENCODINGS
+} encoding_t;
+
+// Open files and in-memory files are budgeted and evicted separately
+typedef enum file_kind {
+    FILE_KIND_FD,
+    FILE_KIND_MEMORY,
+    FILE_KINDS
+} file_kind_t;
+
+struct file_entry {
+    // Relative to the root
+    char* path;
+    // Open file, -1 when the contents are held in data instead
+    int fd;
+    char* data;
+    size_t size;
+    time_t mtime;
+    ino_t ino;
+    char content_type[MAX_CONTENT_TYPE_LEN + 1];
+    // A precompressed variant is another entry for the same path
+    encoding_t encoding;
+    // Which precompressed variants sat next to the file when it was loaded
+    bool has_variant[ENCODINGS];
+    // Whether responses depend on the request's Accept-Encoding
+    bool vary;
+    // ETag and Last-Modified header lines, also sent with a 304
+    char validators[VALIDATORS_LEN + 1];
+    // Just the quoted ETag, for comparing against conditional requests
+    char* etag;
+    size_t etag_len;
+    // Content-Type, Content-Length, encoding and validator header lines, 
+    // ready to copy into a response
+    char entity_headers[ENTITY_HEADERS_LEN + 1];
+    atomic_int refs;
+    // Monotonic time the file was last checked against the disk
+    atomic_long checked;
+    bool cached;
+    unsigned int shard;
+    file_entry_t* hash_next;
+    file_entry_t* lru_prev;
+    file_entry_t* lru_next;
+};
+
+typedef struct file_cache_shard {
+    pthread_mutex_t lock;
+    file_entry_t* buckets[FILE_CACHE_BUCKETS];
+    // One list per kind, least recently used at the head
+    file_entry_t* lru_head[FILE_KINDS];
+    file_entry_t* lru_tail[FILE_KINDS];
+    size_t fd_count;
+    size_t memory_bytes;
+    unsigned long hits;
+    unsigned long memory_hits;
+    unsigned long misses;
+} file_cache_shard_t;
+
+struct file_cache_stats {
+    unsigned long hits;
+    unsigned long memory_hits;
+    unsigned long misses;
+    size_t fd_count;
+    size_t memory_bytes;
+};
+
+/*
+ * Function: file_cache_init
+ * --------------------
+ *  Sets up the file cache, opening the root directory the files are 
+ *  served from.
+ * 
+ *  root_path: The root directory.
+ *  max_fds: Most files kept open by the cache, 0 to keep none open.
+ *  max_bytes: Most bytes of small files held in memory, 0 to hold none.
+ *  small_file_max: Largest file held in memory.
+ * 
+ *  returns: Nothing.
+ */
+void file_cache_init(char* root_path, size_t max_fds, size_t max_bytes, 
+                    size_t small_file_max);
+
+/*
+ * Function: file_cache_stats
+ * --------------------
+ *  Adds up the counters of every shard.
+ * 
+ *  stats: The totals.
+ * 
+ *  returns: Nothing.
+ */
+void file_cache_stats(struct file_cache_stats* stats);
+
+/*
+ * Function: read_file
+ * --------------------
+ *  Reads a whole file into a new buffer.
+ * 
+ *  fd: The open file.
+ *  size: Size of the file.
+ * 
+ *  returns: The buffer, or NULL if the file could not be read.
+ */
+char* read_file(int fd, size_t size);
+
+/*
+ * Function: open_beneath_root
+ * --------------------
+ *  Opens a file for reading relative to the root. With openat2 the kernel 
+ *  refuses any path that would resolve outside the root, through ".." or 
+ *  a symlink, in the same walk that opens it. Without it, ".." components 
+ *  are already refused by the request path check.
+ * 
+ *  file_path: Path to the file, relative to the root.
+ * 
+ *  returns: The file descriptor, or -1 if it could not be opened.
+ */
+int open_beneath_root(char* file_path);
+
+/*
+ * Function: file_cache_get
+ * --------------------
+ *  Gets an open file, from the cache when possible. Only regular files with 
+ *  a known content type are returned.
+ * 
+ *  file_path: Path to the file, relative to the root.
+ * 
+ *  returns: A referenced entry, or NULL if there is no such file.
+ */
+file_entry_t* file_cache_get(char* file_path);
+
+/*
+ * Function: file_cache_get_variant
+ * --------------------
+ *  Gets the precompressed variant of a file, such as "foo.js.gz" for 
+ *  "foo.js", from the cache when possible.
+ * 
+ *  base: The uncompressed file.
+ *  encoding: The encoding wanted.
+ * 
+ *  returns: A referenced entry, or NULL if there is no such variant.
+ */
+file_entry_t* file_cache_get_variant(file_entry_t* base, encoding_t encoding);
+
+/*
+ * Function: file_cache_lookup
+ * --------------------
+ *  Looks a file up in the cache, loading and caching it on a miss.
+ * 
+ *  file_path: Path to the file, relative to the root.
+ *  base: The uncompressed file when looking up a variant, otherwise NULL.
+ *  encoding: The encoding of the file.
+ * 
+ *  returns: A referenced entry, or NULL if there is no such file.
+ */
+file_entry_t* file_cache_lookup(char* file_path, file_entry_t* base, 
+                                encoding_t encoding);
+
+/*
+ * Function: file_cache_release
+ * --------------------
+ *  Drops a reference taken by file_cache_get, closing the file once no 
+ *  one uses it.
+ * 
+ *  entry: The entry.
+ * 
+ *  returns: Nothing.
+ */
+void file_cache_release(file_entry_t* entry);
+
+/*
+ * Function: file_cache_load
+ * --------------------
+ *  Opens a file and builds an uncached entry for it.
+ * 
+ *  file_path: Path to the file, relative to the root.
+ *  base: The uncompressed file when loading a variant, otherwise NULL.
+ *  encoding: The encoding of the file.
+ * 
+ *  returns: An entry with one reference, or NULL if there is no such file.
+ */
+file_entry_t* file_cache_load(char* file_path, file_entry_t* base, 
+                            encoding_t encoding);
+
+/*
+ * Function: encoding_name
+ * --------------------
+ *  Gets the content coding name of an encoding, as used in headers.
+ * 
+ *  encoding: The encoding.
+ * 
+ *  returns: The name, or NULL for the identity encoding.
+ */
+char* encoding_name(encoding_t encoding);
+
+/*
+ * Function: encoding_suffix
+ * --------------------
+ *  Gets the file name suffix of an encoding's precompressed variants.
+ * 
+ *  encoding: The encoding.
+ * 
+ *  returns: The suffix, or NULL for the identity encoding.
+ */
+char* encoding_suffix(encoding_t encoding);
+
+/*
+ * Function: file_cache_is_fresh
+ * --------------------
+ *  Checks, at most once every FILE_CACHE_REVALIDATE seconds, that the file 
+ *  on disk is still the one the entry describes.
+ * 
+ *  entry: The entry.
+ * 
+ *  returns: true if the entry can be used, false otherwise.
+ */
+bool file_cache_is_fresh(file_entry_t* entry);
+
+/*
+ * Function: file_cache_evict
+ * --------------------
+ *  Removes an entry from the cache if it is still cached.
+ * 
+ *  entry: The entry.
+ * 
+ *  returns: Nothing.
+ */
+void file_cache_evict(file_entry_t* entry);
+
+/*
+ * Function: hash_path
+ * --------------------
+ *  Hashes a path with FNV-1a.
+ * 
+ *  path: The path.
+ * 
+ *  returns: The hash.
+ */
+unsigned int hash_path(char* path);
+
+#endif
@@ -0,0 +1,450 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file contains the server metrics. Each thread counts into its
+         own copy, which are only added up when the metrics are read.
+*/
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "connops.h"
+#include "serverops.h"
+#include "filecache.h"
+#include "arena.h"
+#include "accesslog.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+static struct shard* metrics_shards;
+static int metrics_n_shards;
+// Counters of every thread that has recorded anything, newest first
+static _Atomic(struct thread_metrics*) all_metrics;
+static __thread struct thread_metrics* local_metrics;
+// Counts of threads that have exited, guarded by retired_lock
+static struct thread_metrics retired_metrics;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+// Retires a thread's counters when it exits
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+
+static char* status_codes[STATUS_SLOTS] = {
+    STATUS_OK,
+    STATUS_PARTIAL,
+    STATUS_NOT_MODIFIED,
+    STATUS_FORBIDDEN,
+    STATUS_NF,
+    STATUS_RANGE,
+    STATUS_OTHER_str
+};
+
+static char* histogram_names[HISTOGRAMS] = {
+    "http_queue_wait_seconds", 
+    "http_request_parse_seconds", 
+    "http_time_to_first_byte_seconds", 
+    "http_request_duration_seconds"
+};
+
+static char* histogram_help[HISTOGRAMS] = {
+    "Time from accept to a worker thread taking the connection.", 
+    "Time from the first byte of a request arriving to it being parsed, "
+    "before the file is looked up.", 
+    "Time from the first byte of a request arriving to the first byte of "
+    "the response being written.", 
+    "Time from the first byte of a request arriving to the response being "
+    "finished."
+};
+
+/*
+ * Function: metrics_add
+ * --------------------
+ *  Adds one set of counters to another.
+ * 
+ *  to: Counters to add to, not written by any other thread.
+ *  from: Counters to add.
+ * 
+ *  returns: Nothing.
+ */
+static void metrics_add(struct thread_metrics* to, 
+                        struct thread_metrics* from) {
+    for (int i = 0; i < STATUS_SLOTS; i++) {
+        to->responses[i] += atomic_load_explicit(&from->responses[i], 
+                                                memory_order_relaxed);
+    }
+    to->bytes += atomic_load_explicit(&from->bytes, memory_order_relaxed);
+    to->conns_opened += atomic_load_explicit(&from->conns_opened, 
+                                            memory_order_relaxed);
+    to->conns_closed += atomic_load_explicit(&from->conns_closed, 
+                                            memory_order_relaxed);
+    for (int h = 0; h < HISTOGRAMS; h++) {
+        struct histogram* from_histogram = &from->histograms[h];
+        struct histogram* to_histogram = &to->histograms[h];
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            to_histogram->buckets[b] += atomic_load_explicit(
+                    &from_histogram->buckets[b], memory_order_relaxed);
+        }
+        to_histogram->count += atomic_load_explicit(&from_histogram->count, 
+                                                memory_order_relaxed);
+        to_histogram->sum_us += atomic_load_explicit(
+                &from_histogram->sum_us, memory_order_relaxed);
+    }
+}
+
+/*
+ * Function: metrics_retire
+ * --------------------
+ *  Moves an exiting thread's counts to the retired total and frees its 
+ *  counters for another thread.
+ * 
+ *  arg: The counters.
+ * 
+ *  returns: Nothing.
+ */
+static void metrics_retire(void* arg) {
+    struct thread_metrics* metrics = (struct thread_metrics*)arg;
+
+    // Under the lock a scrape sees the counts either here or there
+    pthread_mutex_lock(&retired_lock);
+    metrics_add(&retired_metrics, metrics);
+    memset(metrics, 0, offsetof(struct thread_metrics, in_use));
+    pthread_mutex_unlock(&retired_lock);
+    atomic_store_explicit(&metrics->in_use, false, memory_order_release);
+}
+
+/*
+ * Function: metrics_key_create
+ * --------------------
+ *  Creates the key that retires counters when their thread exits.
+ * 
+ *  returns: Nothing.
+ */
+static void metrics_key_create(void) {
+    if (pthread_key_create(&metrics_key, metrics_retire) != 0) {
+        fprintf(stderr, "ERROR: Could not create metrics key\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Function: thread_metrics
+ * --------------------
+ *  Gets the calling thread's counters on first use, reusing those of an 
+ *  exited thread when there are any.
+ * 
+ *  returns: The counters.
+ */
+static struct thread_metrics* thread_metrics(void) {
+    struct thread_metrics* metrics = local_metrics;
+    if (metrics != NULL) {
+        return metrics;
+    }
+    pthread_once(&metrics_key_once, metrics_key_create);
+
+    for (metrics = atomic_load(&all_metrics); metrics != NULL; 
+            metrics = metrics->next) {
+        bool released = false;
+        if (atomic_compare_exchange_strong(&metrics->in_use, &released, 
+                                            true)) {
+            break;
+        }
+    }
+
+    if (metrics == NULL) {
+        metrics = calloc(1, sizeof(struct thread_metrics));
+        malloc_check(metrics);
+        atomic_init(&metrics->in_use, true);
+
+        // Counters are only ever added, so a plain push is safe
+        metrics->next = atomic_load(&all_metrics);
+        while (!atomic_compare_exchange_weak(&all_metrics, &metrics->next, 
+                                            metrics)) {
+        }
+    }
+    pthread_setspecific(metrics_key, metrics);
+    return local_metrics = metrics;
+}
+
+/*
+ * Function: counter_add
+ * --------------------
+ *  Adds to a counter that only the calling thread writes.
+ * 
+ *  counter: The counter.
+ *  n: Amount to add.
+ * 
+ *  returns: Nothing.
+ */
+static inline void counter_add(atomic_ulong* counter, unsigned long n) {
+    atomic_store_explicit(counter, 
+                atomic_load_explicit(counter, memory_order_relaxed) + n, 
+                memory_order_relaxed);
+}
+
+/*
+ * Function: histogram_bucket
+ * --------------------
+ *  Finds the bucket for a latency. Below 2us each microsecond has a 
+ *  bucket, above that every power of two is split in two.
+ * 
+ *  us: The latency in microseconds.
+ * 
+ *  returns: The bucket index.
+ */
+static int histogram_bucket(uint64_t us) {
+    if (us < 2) {
+        return us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    int bucket = 2 * msb + ((us >> (msb - 1)) & 1);
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+/*
+ * Function: histogram_bound
+ * --------------------
+ *  Gets the exclusive upper bound of a bucket, which is the inclusive 
+ *  bound of the latencies metrics_observe counts in it.
+ * 
+ *  bucket: The bucket index, below HIST_BUCKETS - 1.
+ * 
+ *  returns: The bound in microseconds.
+ */
+static uint64_t histogram_bound(int bucket) {
+    if (bucket < 2) {
+        return bucket + 1;
+    }
+    int msb = bucket / 2;
+    uint64_t low = (uint64_t)(2 | (bucket & 1)) << (msb - 1);
+    return low + ((uint64_t)1 << (msb - 1));
+}
+
+/*
+ * Function: metrics_init
+ * --------------------
+ *  Gives the metrics the shards whose work queues they report on.
+ * 
+ *  shards: The shards.
+ *  n_shards: The number of shards.
+ * 
+ *  returns: Nothing.
+ */
+void metrics_init(struct shard* shards, int n_shards) {
+    metrics_shards = shards;
+    metrics_n_shards = n_shards;
+}
+
+/*
+ * Function: metrics_observe
+ * --------------------
+ *  Records a latency.
+ * 
+ *  id: The histogram.
+ *  ns: The latency in nanoseconds.
+ * 
+ *  returns: Nothing.
+ */
+void metrics_observe(histogram_id_t id, uint64_t ns) {
+    struct histogram* histogram = &thread_metrics()->histograms[id];
+    uint64_t us = ns / 1000;
+    // Prometheus bounds are inclusive, so a latency of exactly a bound, 
+    // rounded up to whole microseconds, goes in the bucket below it
+    uint64_t ceil_us = (ns + 999) / 1000;
+
+    counter_add(&histogram->buckets[histogram_bucket(
+                ceil_us > 0 ? ceil_us - 1 : 0)], 1);
+    counter_add(&histogram->count, 1);
+    counter_add(&histogram->sum_us, us);
+}
+
+/*
+ * Function: metrics_response
+ * --------------------
+ *  Counts a finished response.
+ * 
+ *  status_code: Status code of the response.
+ *  bytes: Bytes sent.
+ * 
+ *  returns: Nothing.
+ */
+void metrics_response(char* status_code, size_t bytes) {
+    struct thread_metrics* metrics = thread_metrics();
+    int slot = 0;
+
+    while (slot < STATUS_SLOT_OTHER && 
+            strcmp(status_codes[slot], status_code) != 0) {
+        slot++;
+    }
+    counter_add(&metrics->responses[slot], 1);
+    counter_add(&metrics->bytes, bytes);
+}
+
+/*
+ * Function: metrics_conn_opened
+ * --------------------
+ *  Counts a connection being opened.
+ * 
+ *  returns: Nothing.
+ */
+void metrics_conn_opened(void) {
+    counter_add(&thread_metrics()->conns_opened, 1);
+}
+
+/*
+ * Function: metrics_conn_closed
+ * --------------------
+ *  Counts a connection being closed.
+ * 
+ *  returns: Nothing.
+ */
+void metrics_conn_closed(void) {
+    counter_add(&thread_metrics()->conns_closed, 1);
+}
+
+/*
+ * Function: append
+ * --------------------
+ *  Appends formatted text to a buffer, stopping quietly once it is full.
+ * 
+ *  buffer: The buffer.
+ *  len: Size of the buffer.
+ *  used: Characters already in the buffer, advanced past the new text.
+ *  format: printf format.
+ * 
+ *  returns: Nothing.
+ */
+static void append(char* buffer, size_t len, size_t* used, 
+                    const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer + *used, len - *used, format, args);
+    va_end(args);
+
+    if (n > 0) {
+        *used += (size_t)n < len - *used ? (size_t)n : len - *used - 1;
+    }
+}
+
+/*
+ * Function: metrics_format
+ * --------------------
+ *  Adds up every thread's counters and writes them in the Prometheus text 
+ *  format.
+ * 
+ *  buffer: Buffer to write to.
+ *  len: Size of the buffer.
+ * 
+ *  returns: The number of characters written, at most len - 1.
+ */
+size_t metrics_format(char* buffer, size_t len) {
+    struct thread_metrics total = {0};
+    struct file_cache_stats cache;
+    size_t used = 0;
+
+    pthread_mutex_lock(&retired_lock);
+    metrics_add(&total, &retired_metrics);
+    for (struct thread_metrics* m = atomic_load(&all_metrics); m != NULL;
+            m = m->next) {
+        metrics_add(&total, m);
+    }
+    pthread_mutex_unlock(&retired_lock);
+
+    // COUNTERS
+    append(buffer, len, &used, "# HELP http_requests_total Responses sent, "
+            "by status code.\n# TYPE http_requests_total counter\n");
+    for (int i = 0; i < STATUS_SLOTS; i++) {
+        append(buffer, len, &used, "http_requests_total{code=\"%s\"} %lu\n", 
+                status_codes[i], total.responses[i]);
+    }
+    append(buffer, len, &used, "# HELP http_response_bytes_total Bytes "
+            "sent in responses.\n# TYPE http_response_bytes_total counter\n"
+            "http_response_bytes_total %lu\n", total.bytes);
+
+    // GAUGES
+    size_t queue_depth = 0;
+    int workers = 0, idle_workers = 0;
+    unsigned long started = 0, retired = 0, stolen = 0;
+    for (int i = 0; i < metrics_n_shards; i++) {
+        struct worker_pool* pool = &metrics_shards[i].pool;
+        queue_depth += pool_queued(pool);
+        stolen += atomic_load(&pool->stolen);
+        workers += atomic_load(&pool->threads);
+        idle_workers += atomic_load(&pool->idle);
+        started += atomic_load(&pool->grown);
+        retired += atomic_load(&pool->shrunk);
+    }
+    // A connection can close on another thread before its opening counts
+    long active = (long)(total.conns_opened - total.conns_closed);
+    append(buffer, len, &used, "# HELP http_connections_active Open client "
+            "connections.\n# TYPE http_connections_active gauge\n"
+            "http_connections_active %ld\n", active > 0 ? active : 0);
+    append(buffer, len, &used, "# HELP work_queue_depth Connections waiting "
+            "for a worker thread.\n# TYPE work_queue_depth gauge\n"
+            "work_queue_depth %zu\n", queue_depth);
+    append(buffer, len, &used, "# HELP worker_threads Worker threads in the "
+            "thread pools.\n# TYPE worker_threads gauge\n"
+            "worker_threads %d\n", workers);
+    append(buffer, len, &used, "# HELP worker_threads_idle Worker threads "
+            "waiting for a connection.\n# TYPE worker_threads_idle gauge\n"
+            "worker_threads_idle %d\n", idle_workers);
+    append(buffer, len, &used, "# HELP worker_threads_started_total Workers "
+            "started because connections were waiting.\n"
+            "# TYPE worker_threads_started_total counter\n"
+            "worker_threads_started_total %lu\n", started);
+    append(buffer, len, &used, "# HELP worker_threads_retired_total Workers "
+            "that exited after sitting idle.\n"
+            "# TYPE worker_threads_retired_total counter\n"
+            "worker_threads_retired_total %lu\n", retired);
+    append(buffer, len, &used, "# HELP worker_steals_total Connections a "
+            "worker took from another worker's queue.\n"
+            "# TYPE worker_steals_total counter\n"
+            "worker_steals_total %lu\n", stolen);
+
+    file_cache_stats(&cache);
+    unsigned long lookups = cache.hits + cache.misses;
+    append(buffer, len, &used, "# HELP file_cache_hits_total File cache "
+            "lookups that found the file.\n# TYPE file_cache_hits_total "
+            "counter\nfile_cache_hits_total %lu\n", cache.hits);
+    append(buffer, len, &used, "# HELP file_cache_memory_hits_total File "
+            "cache hits served from memory.\n"
+            "# TYPE file_cache_memory_hits_total counter\n"
+            "file_cache_memory_hits_total %lu\n", cache.memory_hits);
+    append(buffer, len, &used, "# HELP file_cache_misses_total File cache "
+            "lookups that had to open the file.\n"
+            "# TYPE file_cache_misses_total counter\n"
+            "file_cache_misses_total %lu\n", cache.misses);
+    append(buffer, len, &used, "# HELP file_cache_hit_ratio Share of file "
+            "cache lookups that hit.\n# TYPE file_cache_hit_ratio gauge\n"
+            "file_cache_hit_ratio %g\n", 
+            lookups > 0 ? (double)cache.hits / lookups : 0.0);
+    append(buffer, len, &used, "# HELP arena_slab_allocations_total Heap "
+            "allocations made by the connection slab and request arenas.\n"
+            "# TYPE arena_slab_allocations_total counter\n"
+            "arena_slab_allocations_total %lu\n", arena_slab_allocs());
+    append(buffer, len, &used, "# HELP access_log_dropped_total Access log "
+            "lines dropped because a ring was full.\n"
+            "# TYPE access_log_dropped_total counter\n"
+            "access_log_dropped_total %lu\n", access_log_drops());
+
+    // HISTOGRAMS
+    for (int h = 0; h < HISTOGRAMS; h++) {
+        struct histogram* histogram = &total.histograms[h];
+        char* name = histogram_names[h];
+        unsigned long cumulative = 0;
+
+        append(buffer, len, &used, "# HELP %s %s\n# TYPE %s histogram\n", 
+                name, histogram_help[h], name);
+        for (int b = 0; b < HIST_BUCKETS - 1; b++) {
+            cumulative += histogram->buckets[b];
+            // Printed from whole microseconds, as %g would round the bound 
+            // to 6 digits and could print it below its true value
+            uint64_t bound = histogram_bound(b);
+            append(buffer, len, &used, "%s_bucket{le=\"%llu.%06llu\"} %lu\n", 
+                    name, (unsigned long long)(bound / 1000000), 
+                    (unsigned long long)(bound % 1000000), cumulative);
+        }
+        append(buffer, len, &used, "%s_bucket{le=\"+Inf\"} %lu\n"
+                "%s_sum %g\n%s_count %lu\n", name, histogram->count, name, 
+                histogram->sum_us / 1e6, name, histogram->count);
+    }
+    return used;
+}
@@ -0,0 +1,134 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define METRICS_PATH "/__metrics"
+#define METRICS_BODY_MAX 32768
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+// Two buckets per power of two microseconds, the last one open-ended
+#define HIST_BUCKETS 54
+#define STATUS_OTHER_str "other"
+
+struct shard;
+
+/*
+ * Latencies recorded per request, in microseconds.
+ */
+typedef enum histogram_id {
+    // Accept to a worker thread picking the connection up
+    HIST_QUEUE_WAIT,
+    // First byte of a request arriving to it being parsed
+    HIST_PARSE,
+    // First byte of a request arriving to the first byte of its response 
+    // being written
+    HIST_FIRST_BYTE,
+    // First byte of a request arriving to its response being finished
+    HIST_REQUEST,
+    HISTOGRAMS
+} histogram_id_t;
+
+typedef enum status_slot {
+    STATUS_SLOT_OK,
+    STATUS_SLOT_PARTIAL,
+    STATUS_SLOT_NOT_MODIFIED,
+    STATUS_SLOT_FORBIDDEN,
+    STATUS_SLOT_NOT_FOUND,
+    STATUS_SLOT_RANGE,
+    STATUS_SLOT_OTHER,
+    STATUS_SLOTS
+} status_slot_t;
+
+struct histogram {
+    atomic_ulong buckets[HIST_BUCKETS];
+    atomic_ulong count;
+    atomic_ulong sum_us;
+};
+
+/*
+ * Counters owned by one thread. Only that thread writes them, with plain 
+ * loads and stores rather than read-modify-write atomics, and a scrape 
+ * adds up every thread's copy. When a thread exits its counts move to a 
+ * retired total and the copy is handed to the next thread.
+ */
+struct thread_metrics {
+    atomic_ulong responses[STATUS_SLOTS];
+    atomic_ulong bytes;
+    atomic_ulong conns_opened;
+    atomic_ulong conns_closed;
+    struct histogram histograms[HISTOGRAMS];
+    // Whether a live thread owns the counters
+    atomic_bool in_use;
+    struct thread_metrics* next;
+};
+
+/*
+ * Function: metrics_init
+ * --------------------
+ *  Gives the metrics the shards whose work queues they report on.
+ * 
+ *  shards: The shards.
+ *  n_shards: The number of shards.
+ * 
+ *  returns: Nothing.
+ */
+void metrics_init(struct shard* shards, int n_shards);
+
+/*
+ * Function: metrics_observe
+ * --------------------
+ *  Records a latency.
+ * 
+ *  id: The histogram.
+ *  ns: The latency in nanoseconds.
+ * 
+ *  returns: Nothing.
+ */
+void metrics_observe(histogram_id_t id, uint64_t ns);
+
+/*
+ * Function: metrics_response
+ * --------------------
+ *  Counts a finished response.
+ * 
+ *  status_code: Status code of the response.
+ *  bytes: Bytes sent.
+ * 
+ *  returns: Nothing.
+ */
+void metrics_response(char* status_code, size_t bytes);
+
+/*
+ * Function: metrics_conn_opened
+ * --------------------
+ *  Counts a connection being opened.
+ * 
+ *  returns: Nothing.
+ */
+void metrics_conn_opened(void);
+
+/*
+ * Function: metrics_conn_closed
+ * --------------------
+ *  Counts a connection being closed.
+ * 
+ *  returns: Nothing.
+ */
+void metrics_conn_closed(void);
+
+/*
+ * Function: metrics_format
+ * --------------------
+ *  Adds up every thread's counters and writes them in the Prometheus text 
+ *  format.
+ * 
+ *  buffer: Buffer to write to.
+ *  len: Size of the buffer.
+ * 
+ *  returns: The number of characters written, at most len - 1.
+ */
+size_t metrics_format(char* buffer, size_t len);
+
+#endif
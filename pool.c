@@ -0,0 +1,490 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file contains the worker pool behind the thread pool engine.
+         Each worker has its own queue of connections, idle workers steal
+         from busy ones, and the pool sizes itself to the load within the
+         configured bounds.
+*/
+#include "pool.h"
+#include "serverops.h"
+#include "connops.h"
+#include "accesslog.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * Function: pool_start
+ * --------------------
+ *  Sets up a shard's worker slots and starts its initial workers, sized 
+ *  and placed from the server options.
+ * 
+ *  pool: The pool.
+ *  shard: The shard the workers serve.
+ * 
+ *  returns: The number of workers started.
+ */
+int pool_start(struct worker_pool* pool, struct shard* shard) {
+    pool->shard = shard;
+    pool->dispatch = server_options.dispatch;
+    pool->min_threads = server_options.min_threads;
+    pool->max_threads = server_options.max_threads;
+    pool->idle_ns = (uint64_t)server_options.pool_idle * 1000000000ULL;
+    pool->grow_wait_ns = (uint64_t)server_options.grow_wait * 1000000ULL;
+
+    size_t slots_len = pool->max_threads * sizeof(struct worker_slot);
+    struct worker_slot* slots = aligned_alloc(CACHE_LINE, slots_len);
+    malloc_check(slots);
+    memset(slots, 0, slots_len);
+    for (int i = 0; i < pool->max_threads; i++) {
+        fifo_init(&slots[i].fifo, FIFO_CAPACITY);
+        slots[i].pool = pool;
+    }
+    pool->slots = slots;
+    for (int i = 0; i < pool->max_threads; i++) {
+        place_worker(pool, &slots[i]);
+    }
+
+    for (int i = 0; i < server_options.threads; i++) {
+        if (!pool_grow(pool)) {
+            break;
+        }
+    }
+    // Only growth under load is counted
+    atomic_store(&pool->grown, 0);
+    return atomic_load(&pool->threads);
+}
+
+/*
+ * Function: pool_dispatch
+ * --------------------
+ *  Pushes a connection onto a worker's queue and makes sure a worker will 
+ *  take it, waking a parked one or starting another. Only the accepting 
+ *  thread may dispatch.
+ * 
+ *  pool: The pool.
+ *  conn: The connection.
+ *  node: NUMA node that received the connection, or -1.
+ * 
+ *  returns: Nothing.
+ */
+void pool_dispatch(struct worker_pool* pool, struct conn* conn, int node) {
+    pool_dispatch_batch(pool, &conn, &node, 1);
+}
+
+/*
+ * Function: pool_dispatch_batch
+ * --------------------
+ *  Hands a batch of connections to the workers. Free workers get one 
+ *  each, the rest of the batch is pushed onto the least loaded queue in 
+ *  one go, and then as many workers are woken or started as there are 
+ *  connections left waiting. Only the accepting thread may dispatch.
+ * 
+ *  pool: The pool.
+ *  conns: The connections.
+ *  nodes: NUMA node that received each connection, or -1.
+ *  n: Number of connections, at most DISPATCH_BATCH.
+ * 
+ *  returns: Nothing.
+ */
+void pool_dispatch_batch(struct worker_pool* pool, struct conn** conns, 
+                        int* nodes, int n) {
+    struct worker_slot* pushed_to[DISPATCH_BATCH];
+    int pushed[DISPATCH_BATCH];
+    int n_runs = 0;
+    int n_slots = atomic_load(&pool->n_slots);
+
+    for (int i = 0; i < n; ) {
+        struct worker_slot* slot = pool_pick(pool, nodes[i]);
+        int index = slot - pool->slots;
+        int len = 1;
+
+        // A worker keeps its connection until the client closes, so once 
+        // none is free the rest of the batch waits together for thieves
+        if (pool->dispatch == DISPATCH_LEAST && 
+                (fifo_size(&slot->fifo) > 0 || 
+                atomic_load_explicit(&slot->busy, memory_order_relaxed))) {
+            len = n - i;
+        }
+
+        // A full queue passes the connections on to the next one. Back 
+        // pressure: when every queue is full, let the workers catch up.
+        for (int tries = 1; len > 0; tries++) {
+            int added = fifo_push_batch(&slot->fifo, (void**)&conns[i], 
+                                        len);
+            if (added > 0) {
+                pushed_to[n_runs] = slot;
+                pushed[n_runs++] = added;
+                i += added;
+                len -= added;
+            }
+            if (tries % n_slots == 0) {
+                sched_yield();
+            }
+            slot = &pool->slots[(index + tries) % n_slots];
+        }
+    }
+
+    // Pairs with the fence in pool_park, so either a worker sees the 
+    // connections before parking or we see it parked
+    atomic_thread_fence(memory_order_seq_cst);
+    int waiting = 0;
+    for (int i = 0; i < n_runs; i++) {
+        struct worker_slot* slot = pushed_to[i];
+        bool takes_one = pool_wake(pool, slot) || !atomic_load(&slot->busy);
+        waiting += pushed[i] - takes_one;
+    }
+    // Each connection left needs a worker of its own: have parked peers 
+    // steal them, and start more workers for the rest
+    while (waiting > 0 && (pool_wake(pool, NULL) || pool_grow(pool))) {
+        waiting--;
+    }
+}
+
+/*
+ * Function: pool_pick
+ * --------------------
+ *  Chooses the worker to give the next connection to, following the 
+ *  pool's dispatch policy. Least loaded dispatch prefers workers on the 
+ *  given node among equally loaded ones.
+ * 
+ *  pool: The pool.
+ *  node: NUMA node that received the connection, or -1.
+ * 
+ *  returns: The worker's slot.
+ */
+struct worker_slot* pool_pick(struct worker_pool* pool, int node) {
+    int n_slots = atomic_load(&pool->n_slots);
+    struct worker_slot* best = &pool->slots[0];
+
+    if (pool->dispatch == DISPATCH_ROUND_ROBIN) {
+        for (int i = 0; i < n_slots; i++) {
+            int index = (pool->next_slot + i) % n_slots;
+            if (atomic_load(&pool->slots[index].active)) {
+                pool->next_slot = index + 1;
+                return &pool->slots[index];
+            }
+        }
+        return best;
+    }
+
+    size_t best_load = SIZE_MAX;
+    for (int i = 0; i < n_slots; i++) {
+        struct worker_slot* slot = &pool->slots[i];
+        if (!atomic_load_explicit(&slot->active, memory_order_relaxed)) {
+            continue;
+        }
+        // On a tie a worker on the receiving node beats a remote one, and 
+        // a worker that is awake beats one that needs a wake-up
+        size_t load = 4 * (fifo_size(&slot->fifo) + 
+                    atomic_load_explicit(&slot->busy, memory_order_relaxed)) + 
+                    2 * (node >= 0 && slot->node != node) + 
+                    atomic_load_explicit(&slot->parked, memory_order_relaxed);
+        if (load < best_load) {
+            best = slot;
+            best_load = load;
+            // Nothing beats a free local worker that is awake
+            if (load == 0) {
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+/*
+ * Function: pool_take
+ * --------------------
+ *  Takes the oldest connection from a worker's own queue, or failing that 
+ *  steals one from a peer.
+ * 
+ *  pool: The pool.
+ *  slot: The worker's slot.
+ * 
+ *  returns: The connection, or NULL if every queue is empty.
+ */
+struct conn* pool_take(struct worker_pool* pool, struct worker_slot* slot) {
+    struct conn* conn = fifo_take(&slot->fifo);
+    if (conn != NULL) {
+        return conn;
+    }
+
+    // Start after our own slot so thieves spread over their peers
+    int n_slots = atomic_load(&pool->n_slots);
+    int index = slot - pool->slots;
+    for (int i = 1; i < n_slots; i++) {
+        struct worker_slot* peer = &pool->slots[(index + i) % n_slots];
+        if ((conn = fifo_take(&peer->fifo)) != NULL) {
+            atomic_fetch_add_explicit(&pool->stolen, 1, memory_order_relaxed);
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: pool_park
+ * --------------------
+ *  Parks a worker on its futex until it is woken or the timeout passes, 
+ *  unless work turns up first.
+ * 
+ *  pool: The pool.
+ *  slot: The worker's slot.
+ *  timeout_ns: Longest time to park.
+ * 
+ *  returns: Nothing.
+ */
+void pool_park(struct worker_pool* pool, struct worker_slot* slot, 
+                uint64_t timeout_ns) {
+    struct timespec timeout = { timeout_ns / 1000000000ULL, 
+                                timeout_ns % 1000000000ULL };
+
+    // Announce ourselves before the final check, so a dispatch after it 
+    // is guaranteed to see us parked and bump wake_seq
+    unsigned int seq = atomic_load(&slot->wake_seq);
+    atomic_store(&slot->parked, true);
+    atomic_fetch_add(&pool->idle, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (pool_queued(pool) == 0) {
+        // Returns straight away if wake_seq moved on since we read it
+        syscall(SYS_futex, &slot->wake_seq, FUTEX_WAIT_PRIVATE, seq, 
+                &timeout, NULL, 0);
+    }
+    atomic_fetch_sub(&pool->idle, 1);
+    atomic_store(&slot->parked, false);
+}
+
+/*
+ * Function: pool_wake
+ * --------------------
+ *  Wakes the worker on a slot if it is parked, or with no slot any parked 
+ *  worker, which will steal the work. A worker is only woken once, so 
+ *  every successful call brings another worker.
+ * 
+ *  pool: The pool.
+ *  slot: The worker's slot, or NULL for any.
+ * 
+ *  returns: true if a worker was woken, false if none was parked.
+ */
+bool pool_wake(struct worker_pool* pool, struct worker_slot* slot) {
+    int n_slots = slot != NULL ? 1 : atomic_load(&pool->n_slots);
+
+    for (int i = 0; i < n_slots; i++) {
+        struct worker_slot* parked = slot != NULL ? slot : &pool->slots[i];
+        bool expected = true;
+        // Clearing the flag claims the worker, so a second wake before it 
+        // runs looks for another one
+        if (atomic_compare_exchange_strong(&parked->parked, &expected, 
+                                        false)) {
+            atomic_fetch_add(&parked->wake_seq, 1);
+            syscall(SYS_futex, &parked->wake_seq, FUTEX_WAKE_PRIVATE, 1, 
+                    NULL, NULL, 0);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Function: pool_queued
+ * --------------------
+ *  Counts the connections waiting in the pool's queues.
+ * 
+ *  pool: The pool.
+ * 
+ *  returns: The number of connections.
+ */
+size_t pool_queued(struct worker_pool* pool) {
+    size_t queued = 0;
+    if (pool->slots == NULL) {
+        return 0;
+    }
+    int n_slots = atomic_load(&pool->n_slots);
+    for (int i = 0; i < n_slots; i++) {
+        queued += fifo_size(&pool->slots[i].fifo);
+    }
+    return queued;
+}
+
+/*
+ * Function: pool_grow
+ * --------------------
+ *  Starts another worker on a free slot, unless the pool is at its 
+ *  maximum.
+ * 
+ *  pool: The pool.
+ * 
+ *  returns: true if a worker was started, false otherwise.
+ */
+bool pool_grow(struct worker_pool* pool) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    int threads = atomic_load(&pool->threads);
+
+    // Claim the thread first, so racing callers cannot overshoot the 
+    // maximum, then a slot
+    do {
+        if (threads >= pool->max_threads) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&pool->threads, &threads, 
+                                        threads + 1));
+    struct worker_slot* slot = NULL;
+    for (int i = 0; slot == NULL; i = (i + 1) % pool->max_threads) {
+        bool active = false;
+        if (atomic_compare_exchange_strong(&pool->slots[i].active, &active, 
+                                        true)) {
+            slot = &pool->slots[i];
+        }
+    }
+    atomic_store(&slot->busy, false);
+    int index = slot - pool->slots;
+    int n_slots = atomic_load(&pool->n_slots);
+    while (index + 1 > n_slots && 
+            !atomic_compare_exchange_weak(&pool->n_slots, &n_slots, 
+                                        index + 1)) {
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int status = pthread_create(&thread, &attr, handle_work, slot);
+    pthread_attr_destroy(&attr);
+    if (status != 0) {
+        atomic_store(&slot->active, false);
+        atomic_fetch_sub(&pool->threads, 1);
+        return false;
+    }
+
+    atomic_fetch_add_explicit(&pool->grown, 1, memory_order_relaxed);
+    int peak = atomic_load(&pool->peak);
+    while (threads + 1 > peak && 
+            !atomic_compare_exchange_weak(&pool->peak, &peak, threads + 1)) {
+    }
+    return true;
+}
+
+/*
+ * Function: pool_retire
+ * --------------------
+ *  Takes an idle worker out of the pool, unless the pool is at its 
+ *  minimum. Connections pushed to its queue meanwhile are left for the 
+ *  others to steal.
+ * 
+ *  pool: The pool.
+ *  slot: The worker's slot.
+ * 
+ *  returns: true if the calling worker should exit, false otherwise.
+ */
+bool pool_retire(struct worker_pool* pool, struct worker_slot* slot) {
+    int threads = atomic_load(&pool->threads);
+
+    do {
+        if (threads <= pool->min_threads) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&pool->threads, &threads, 
+                                        threads - 1));
+
+    // Looking busy makes an acceptor that picked this slot before seeing 
+    // it go hand the connection on, and the fence pairs with the one in 
+    // pool_dispatch so otherwise it is seen here
+    atomic_store(&slot->busy, true);
+    atomic_store(&slot->active, false);
+    atomic_fetch_add_explicit(&pool->shrunk, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (fifo_size(&slot->fifo) > 0 && !pool_wake(pool, NULL)) {
+        pool_grow(pool);
+    }
+    return true;
+}
+
+/*
+ * Function: place_worker
+ * --------------------
+ *  Works out where the worker on a slot runs. Given worker CPUs are dealt 
+ *  out in turn across the shards. In auto affinity mode workers stay on 
+ *  their shard's node when every node has a shard, and are spread over 
+ *  the nodes otherwise.
+ * 
+ *  pool: The pool.
+ *  slot: The worker's slot.
+ * 
+ *  returns: Nothing.
+ */
+void place_worker(struct worker_pool* pool, struct worker_slot* slot) {
+    struct cpu_list* cpus = &server_options.worker_cpus;
+    int index = slot - pool->slots;
+    int n_shards = server_options.shards;
+    int n_nodes = topology_nodes();
+
+    slot->cpu = -1;
+    slot->node = -1;
+    if (cpus->n > 0) {
+        slot->cpu = cpus->cpus[(index * n_shards + pool->shard->id) % 
+                                cpus->n];
+        slot->node = topology_node_of(slot->cpu);
+    } else if (server_options.affinity == AFFINITY_AUTO) {
+        int home = pool->shard->node >= 0 ? pool->shard->node : 0;
+        slot->node = n_shards >= n_nodes ? home : (home + index) % n_nodes;
+    }
+}
+
+/*
+ * Function: handle_work
+ * --------------------
+ *  Serves connections from the worker's queue, stealing from peers when it 
+ *  is empty, until the worker has been idle long enough to retire.
+ * 
+ *  arg: The worker's slot.
+ * 
+ *  returns: NULL.
+ */
+void* handle_work(void* arg) {
+    struct worker_slot* slot = (struct worker_slot*)arg;
+    struct worker_pool* pool = slot->pool;
+    struct conn* conn = NULL;
+    uint64_t idle_since = monotonic_ns();
+
+    // Workers start out wherever the thread that started them runs. What 
+    // they allocate from here on, such as their metrics and log ring, 
+    // comes from their own node.
+    if (slot->cpu >= 0) {
+        pin_thread(slot->cpu);
+        prefer_node_memory(slot->node);
+    } else if (slot->node >= 0) {
+        pin_thread_to_node(slot->node);
+    }
+
+    while (true) {
+        if ((conn = pool_take(pool, slot)) == NULL) {
+            uint64_t idle_ns = monotonic_ns() - idle_since;
+            if (idle_ns < pool->idle_ns) {
+                pool_park(pool, slot, pool->idle_ns - idle_ns);
+            } else if (pool_retire(pool, slot)) {
+                return NULL;
+            } else {
+                idle_since = monotonic_ns();
+            }
+            continue;
+        }
+
+        // A connection that waited this long found every worker busy, so 
+        // make sure the next one does not
+        if (monotonic_ns() - conn->accepted_ns > pool->grow_wait_ns && 
+                atomic_load(&pool->idle) == 0) {
+            pool_grow(pool);
+        }
+
+        // Handle connection, which returns it to the pool
+        atomic_store_explicit(&slot->busy, true, memory_order_relaxed);
+        handle_client(conn, pool->shard);
+        atomic_store_explicit(&slot->busy, false, memory_order_relaxed);
+        idle_since = monotonic_ns();
+    }
+    return NULL;
+}
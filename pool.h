@@ -0,0 +1,248 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "fifo.h"
+
+#define POOL_MAX_THREADS_DEFAULT 256
+#define POOL_IDLE_DEFAULT 30
+#define POOL_GROW_WAIT_DEFAULT 10
+#define DISPATCH_BATCH 64
+#define DISPATCH_OPTION "--dispatch="
+#define DISPATCH_LEAST_str "least"
+#define DISPATCH_ROUND_ROBIN_str "rr"
+
+struct shard;
+struct conn;
+
+/*
+ * How the acceptor picks the worker whose queue gets a new connection.
+ */
+typedef enum dispatch {
+    // Fewest queued connections, counting the one being served
+    DISPATCH_LEAST,
+    DISPATCH_ROUND_ROBIN
+} dispatch_t;
+
+/*
+ * A worker's place in the pool. The acceptor is the only thread that 
+ * pushes to its queue, while the worker and any idle peers take from the 
+ * head alike. Slots are reused as workers come and go.
+ */
+struct worker_slot {
+    fifo_t fifo;
+    struct worker_pool* pool;
+    _Alignas(CACHE_LINE) atomic_bool active;
+    // Serving a connection
+    atomic_bool busy;
+    // Waiting on wake_seq for work
+    atomic_bool parked;
+    // Bumped on every wake so the worker can detect a missed one
+    atomic_uint wake_seq;
+    // CPU the worker is pinned to, or -1
+    int cpu;
+    // NUMA node the worker runs on, or -1 if it is not placed
+    int node;
+};
+
+/*
+ * The worker threads of one shard. A worker keeps its connection until the 
+ * client closes it or goes idle, so the pool grows whenever a connection 
+ * arrives with no worker free to take it, and threads that have had 
+ * nothing to do for a while exit, down to the minimum.
+ */
+struct worker_pool {
+    struct shard* shard;
+    dispatch_t dispatch;
+    int min_threads;
+    int max_threads;
+    // How long a worker waits for work before exiting
+    uint64_t idle_ns;
+    // Queue wait that makes a worker start another one
+    uint64_t grow_wait_ns;
+    // One slot per possible worker
+    struct worker_slot* slots;
+    // Slots ever used, the range searched for work to steal
+    atomic_int n_slots;
+    // Where round robin dispatch continues, only used by the acceptor
+    int next_slot;
+    atomic_int threads;
+    // Workers parked waiting for work
+    atomic_int idle;
+    atomic_int peak;
+    atomic_ulong grown;
+    atomic_ulong shrunk;
+    // Connections taken from another worker's queue
+    atomic_ulong stolen;
+};
+
+/*
+ * Function: pool_start
+ * --------------------
+ *  Sets up a shard's worker slots and starts its initial workers, sized 
+ *  and placed from the server options.
+ * 
+ *  pool: The pool.
+ *  shard: The shard the workers serve.
+ * 
+ *  returns: The number of workers started.
+ */
+int pool_start(struct worker_pool* pool, struct shard* shard);
+
+/*
+ * Function: pool_dispatch
+ * --------------------
+ *  Pushes a connection onto a worker's queue and makes sure a worker will 
+ *  take it, waking a parked one or starting another. Only the accepting 
+ *  thread may dispatch.
+ * 
+ *  pool: The pool.
+ *  conn: The connection.
+ *  node: NUMA node that received the connection, or -1.
+ * 
+ *  returns: Nothing.
+ */
+void pool_dispatch(struct worker_pool* pool, struct conn* conn, int node);
+
+/*
+ * Function: pool_dispatch_batch
+ * --------------------
+ *  Hands a batch of connections to the workers. Free workers get one 
+ *  each, the rest of the batch is pushed onto the least loaded queue in 
+ *  one go, and then as many workers are woken or started as there are 
+ *  connections left waiting. Only the accepting thread may dispatch.
+ * 
+ *  pool: The pool.
+ *  conns: The connections.
+ *  nodes: NUMA node that received each connection, or -1.
+ *  n: Number of connections, at most DISPATCH_BATCH.
+ * 
+ *  returns: Nothing.
+ */
+void pool_dispatch_batch(struct worker_pool* pool, struct conn** conns, 
+                        int* nodes, int n);
+
+/*
+ * Function: pool_pick
+ * --------------------
+ *  Chooses the worker to give the next connection to, following the 
+ *  pool's dispatch policy. Least loaded dispatch prefers workers on the 
+ *  given node among equally loaded ones.
+ * 
+ *  pool: The pool.
+ *  node: NUMA node that received the connection, or -1.
+ * 
+ *  returns: The worker's slot.
+ */
+struct worker_slot* pool_pick(struct worker_pool* pool, int node);
+
+/*
+ * Function: pool_take
+ * --------------------
+ *  Takes the oldest connection from a worker's own queue, or failing that 
+ *  steals one from a peer.
+ * 
+ *  pool: The pool.
+ *  slot: The worker's slot.
+ * 
+ *  returns: The connection, or NULL if every queue is empty.
+ */
+struct conn* pool_take(struct worker_pool* pool, struct worker_slot* slot);
+
+/*
+ * Function: pool_park
+ * --------------------
+ *  Parks a worker on its futex until it is woken or the timeout passes, 
+ *  unless work turns up first.
+ * 
+ *  pool: The pool.
+ *  slot: The worker's slot.
+ *  timeout_ns: Longest time to park.
+ * 
+ *  returns: Nothing.
+ */
+void pool_park(struct worker_pool* pool, struct worker_slot* slot, 
+                uint64_t timeout_ns);
+
+/*
+ * Function: pool_wake
+ * --------------------
+ *  Wakes the worker on a slot if it is parked, or with no slot any parked 
+ *  worker, which will steal the work. A worker is only woken once, so 
+ *  every successful call brings another worker.
+ * 
+ *  pool: The pool.
+ *  slot: The worker's slot, or NULL for any.
+ * 
+ *  returns: true if a worker was woken, false if none was parked.
+ */
+bool pool_wake(struct worker_pool* pool, struct worker_slot* slot);
+
+/*
+ * Function: pool_queued
+ * --------------------
+ *  Counts the connections waiting in the pool's queues.
+ * 
+ *  pool: The pool.
+ * 
+ *  returns: The number of connections.
+ */
+size_t pool_queued(struct worker_pool* pool);
+
+/*
+ * Function: pool_grow
+ * --------------------
+ *  Starts another worker on a free slot, unless the pool is at its 
+ *  maximum.
+ * 
+ *  pool: The pool.
+ * 
+ *  returns: true if a worker was started, false otherwise.
+ */
+bool pool_grow(struct worker_pool* pool);
+
+/*
+ * Function: pool_retire
+ * --------------------
+ *  Takes an idle worker out of the pool, unless the pool is at its 
+ *  minimum. Connections pushed to its queue meanwhile are left for the 
+ *  others to steal.
+ * 
+ *  pool: The pool.
+ *  slot: The worker's slot.
+ * 
+ *  returns: true if the calling worker should exit, false otherwise.
+ */
+bool pool_retire(struct worker_pool* pool, struct worker_slot* slot);
+
+/*
+ * Function: place_worker
+ * --------------------
+ *  Works out where the worker on a slot runs. Given worker CPUs are dealt 
+ *  out in turn across the shards. In auto affinity mode workers stay on 
+ *  their shard's node when every node has a shard, and are spread over 
+ *  the nodes otherwise.
+ * 
+ *  pool: The pool.
+ *  slot: The worker's slot.
+ * 
+ *  returns: Nothing.
+ */
+void place_worker(struct worker_pool* pool, struct worker_slot* slot);
+
+/*
+ * Function: handle_work
+ * --------------------
+ *  Serves connections from the worker's queue, stealing from peers when it 
+ *  is empty, until the worker has been idle long enough to retire.
+ * 
+ *  arg: The worker's slot.
+ * 
+ *  returns: NULL.
+ */
+void* handle_work(void* arg);
+
+#endif
@@ -0,0 +1,270 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file contains the incremental HTTP request parser, which
+         records where each part of a request lies in the connection
+         buffer without copying it.
+*/
+#include "request.h"
+#include "connops.h"
+#include "scan.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define DEL 0x7f
+#define IS_CTL(c) ((unsigned char)(c) < ' ' || (c) == DEL)
+#define IS_OWS(c) ((c) == ' ' || (c) == '\t')
+
+static char* header_names[HEADER_SLOTS] = {
+    HOST_HEADER,
+    CONNECTION_HEADER,
+    ACCEPT_ENCODING_HEADER,
+    RANGE_HEADER,
+    IF_RANGE_HEADER,
+    IF_NONE_MATCH_HEADER,
+    IF_MODIFIED_SINCE_HEADER
+};
+
+static size_t header_lens[HEADER_SLOTS] = {
+    sizeof(HOST_HEADER) - 1,
+    sizeof(CONNECTION_HEADER) - 1,
+    sizeof(ACCEPT_ENCODING_HEADER) - 1,
+    sizeof(RANGE_HEADER) - 1,
+    sizeof(IF_RANGE_HEADER) - 1,
+    sizeof(IF_NONE_MATCH_HEADER) - 1,
+    sizeof(IF_MODIFIED_SINCE_HEADER) - 1
+};
+
+/*
+ * Function: request_init
+ * --------------------
+ *  Readies a request for parsing from its first byte.
+ * 
+ *  req: The request.
+ * 
+ *  returns: Nothing.
+ */
+void request_init(struct http_request* req) {
+    memset(req, 0, sizeof(struct http_request));
+    req->state = PARSE_METHOD;
+    req->slot = -1;
+}
+
+/*
+ * Function: request_parse
+ * --------------------
+ *  Parses as much of a request as has arrived, resuming where the last 
+ *  call stopped.
+ * 
+ *  req: The request.
+ *  start: Start of the request.
+ *  len: Bytes of the request received so far.
+ * 
+ *  returns: PARSE_COMPLETE once the empty line ending the headers has been 
+ *  seen, PARSE_PARTIAL if more bytes are needed, or PARSE_ERROR.
+ */
+parse_status_t request_parse(struct http_request* req, char* start, 
+                            size_t len) {
+    req->start = start;
+
+    while (req->pos < len && req->state != PARSE_DONE && 
+            req->state != PARSE_FAILED) {
+        size_t pos = req->pos;
+
+        // Skip runs of bytes that cannot end the path, name or value at once
+        switch (req->state) {
+        case PARSE_PATH:
+            pos += scan_delimiter(start + pos, len - pos, ' ' + 1, DEL);
+            break;
+        case PARSE_HEADER_NAME:
+            pos += scan_delimiter(start + pos, len - pos, ' ' + 1, ':');
+            break;
+        case PARSE_HEADER_VALUE:
+            // Whitespace before the value is still skipped byte by byte
+            if (pos > req->mark) {
+                pos += scan_delimiter(start + pos, len - pos, ' ', DEL);
+            }
+            break;
+        default:
+            break;
+        }
+        if (pos == len) {
+            req->pos = pos;
+            break;
+        }
+        char c = start[pos];
+
+        switch (req->state) {
+        // REQUEST LINE
+        case PARSE_METHOD:
+            if (c == ' ' && pos > req->mark) {
+                req->method = (struct span){ req->mark, pos - req->mark };
+                req->mark = pos + 1;
+                req->state = PARSE_PATH;
+            } else if ((c == '\r' || c == '\n') && pos == req->mark) {
+                // Empty lines before the request line are ignored
+                req->mark++;
+            } else if (c == ' ' || IS_CTL(c)) {
+                req->state = PARSE_FAILED;
+            }
+            break;
+        case PARSE_PATH:
+            if (c == ' ' && pos > req->mark) {
+                req->path = (struct span){ req->mark, pos - req->mark };
+                req->mark = pos + 1;
+                req->state = PARSE_VERSION;
+            } else {
+                req->state = PARSE_FAILED;
+            }
+            break;
+        case PARSE_VERSION:
+            if (c == '\r' && pos > req->mark) {
+                req->version = (struct span){ req->mark, pos - req->mark };
+                req->state = PARSE_REQUEST_LINE_END;
+            } else if (c == ' ' || IS_CTL(c)) {
+                req->state = PARSE_FAILED;
+            }
+            break;
+        case PARSE_REQUEST_LINE_END:
+            req->state = c == '\n' ? PARSE_HEADER_START : PARSE_FAILED;
+            break;
+
+        // HEADERS
+        case PARSE_HEADER_START:
+            if (c == '\r') {
+                req->state = PARSE_HEADERS_END;
+            } else if (c == ':' || IS_OWS(c) || IS_CTL(c)) {
+                // Folded header lines are not supported
+                req->state = PARSE_FAILED;
+            } else {
+                req->mark = pos;
+                req->state = PARSE_HEADER_NAME;
+            }
+            break;
+        case PARSE_HEADER_NAME:
+            if (c == ':') {
+                req->slot = header_slot_of(start + req->mark, pos - req->mark);
+                req->mark = pos + 1;
+                req->state = PARSE_HEADER_VALUE;
+            } else {
+                req->state = PARSE_FAILED;
+            }
+            break;
+        case PARSE_HEADER_VALUE:
+            if (c == '\r') {
+                // Whitespace after the value is left out
+                size_t end = pos;
+                while (end > req->mark && IS_OWS(start[end - 1])) {
+                    end--;
+                }
+                // The first of repeated headers is kept
+                if (req->slot >= 0 && req->headers[req->slot].offset == 0) {
+                    req->headers[req->slot] = (struct span){
+                        req->mark, end - req->mark };
+                }
+                req->state = PARSE_HEADER_END;
+            } else if (IS_OWS(c)) {
+                // Skip whitespace before the value
+                if (pos == req->mark) {
+                    req->mark = pos + 1;
+                }
+            } else if (IS_CTL(c)) {
+                req->state = PARSE_FAILED;
+            }
+            break;
+        case PARSE_HEADER_END:
+            req->state = c == '\n' ? PARSE_HEADER_START : PARSE_FAILED;
+            break;
+        case PARSE_HEADERS_END:
+            if (c == '\n') {
+                req->length = pos + 1;
+                req->state = PARSE_DONE;
+            } else {
+                req->state = PARSE_FAILED;
+            }
+            break;
+        case PARSE_DONE:
+        case PARSE_FAILED:
+            break;
+        }
+        req->pos = pos + 1;
+    }
+
+    if (req->state == PARSE_DONE) {
+        return PARSE_COMPLETE;
+    }
+    return req->state == PARSE_FAILED ? PARSE_ERROR : PARSE_PARTIAL;
+}
+
+/*
+ * Function: request_header
+ * --------------------
+ *  Gets the value of a header, without surrounding whitespace.
+ * 
+ *  req: A complete request.
+ *  slot: The header.
+ *  len: Set to the length of the value.
+ * 
+ *  returns: Pointer to the value, or NULL if the header was not sent.
+ */
+char* request_header(struct http_request* req, header_slot_t slot, 
+                    size_t* len) {
+    // A header value never starts the request, so offset 0 means unset
+    if (req->headers[slot].offset == 0) {
+        return NULL;
+    }
+    *len = req->headers[slot].len;
+    return req->start + req->headers[slot].offset;
+}
+
+/*
+ * Function: request_token
+ * --------------------
+ *  Terminates part of a complete request in place so it can be used as a 
+ *  string. This overwrites the delimiter after it.
+ * 
+ *  req: A complete request.
+ *  span: The part of the request line.
+ * 
+ *  returns: Pointer to the string.
+ */
+char* request_token(struct http_request* req, struct span span) {
+    req->start[span.offset + span.len] = '\0';
+    return req->start + span.offset;
+}
+
+/*
+ * Function: request_matches
+ * --------------------
+ *  Checks if part of a request is exactly a string.
+ * 
+ *  req: The request.
+ *  span: The part of the request.
+ *  str: The string.
+ * 
+ *  returns: true if they are equal, false otherwise.
+ */
+bool request_matches(struct http_request* req, struct span span, char* str) {
+    return span.len == strlen(str) && 
+            memcmp(req->start + span.offset, str, span.len) == 0;
+}
+
+/*
+ * Function: header_slot_of
+ * --------------------
+ *  Finds the slot of a header name, ignoring case.
+ * 
+ *  name: The header name.
+ *  len: Length of the name.
+ * 
+ *  returns: The slot, or -1 if the header is not kept.
+ */
+int header_slot_of(char* name, size_t len) {
+    for (int i = 0; i < HEADER_SLOTS; i++) {
+        if (header_lens[i] == len && 
+                strncasecmp(name, header_names[i], len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
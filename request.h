@@ -0,0 +1,152 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/*
+ * Headers the server acts on. Each has a slot in a parsed request, any 
+ * other header is skipped over.
+ */
+typedef enum header_slot {
+    HEADER_HOST,
+    HEADER_CONNECTION,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_RANGE,
+    HEADER_IF_RANGE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_SLOTS
+} header_slot_t;
+
+typedef enum parse_state {
+    PARSE_METHOD,
+    PARSE_PATH,
+    PARSE_VERSION,
+    PARSE_REQUEST_LINE_END,
+    PARSE_HEADER_START,
+    PARSE_HEADER_NAME,
+    PARSE_HEADER_VALUE,
+    PARSE_HEADER_END,
+    PARSE_HEADERS_END,
+    PARSE_DONE,
+    PARSE_FAILED
+} parse_state_t;
+
+typedef enum parse_status {
+    PARSE_PARTIAL,
+    PARSE_COMPLETE,
+    PARSE_ERROR
+} parse_status_t;
+
+/*
+ * Part of a request, as an offset from its start and a length. Nothing is 
+ * copied out of the connection buffer.
+ */
+struct span {
+    size_t offset;
+    size_t len;
+};
+
+/*
+ * A request parsed in place. Parsing resumes from where the previous call 
+ * stopped, so each byte is examined once however the request arrives.
+ */
+struct http_request {
+    // Start of the request, refreshed on every call as the buffer may move
+    char* start;
+    parse_state_t state;
+    // Bytes of the request examined so far
+    size_t pos;
+    struct span method;
+    struct span path;
+    struct span version;
+    struct span headers[HEADER_SLOTS];
+    // Start of the token or header value being parsed
+    size_t mark;
+    // Slot of the header being parsed, or -1 if it is not kept
+    int slot;
+    // Length including the empty line that ends it, once complete
+    size_t length;
+};
+
+/*
+ * Function: request_init
+ * --------------------
+ *  Readies a request for parsing from its first byte.
+ * 
+ *  req: The request.
+ * 
+ *  returns: Nothing.
+ */
+void request_init(struct http_request* req);
+
+/*
+ * Function: request_parse
+ * --------------------
+ *  Parses as much of a request as has arrived, resuming where the last 
+ *  call stopped.
+ * 
+ *  req: The request.
+ *  start: Start of the request.
+ *  len: Bytes of the request received so far.
+ * 
+ *  returns: PARSE_COMPLETE once the empty line ending the headers has been 
+ *  seen, PARSE_PARTIAL if more bytes are needed, or PARSE_ERROR.
+ */
+parse_status_t request_parse(struct http_request* req, char* start, 
+                            size_t len);
+
+/*
+ * Function: request_header
+ * --------------------
+ *  Gets the value of a header, without surrounding whitespace.
+ * 
+ *  req: A complete request.
+ *  slot: The header.
+ *  len: Set to the length of the value.
+ * 
+ *  returns: Pointer to the value, or NULL if the header was not sent.
+ */
+char* request_header(struct http_request* req, header_slot_t slot, 
+                    size_t* len);
+
+/*
+ * Function: request_token
+ * --------------------
+ *  Terminates part of a complete request in place so it can be used as a 
+ *  string. This overwrites the delimiter after it.
+ * 
+ *  req: A complete request.
+ *  span: The part of the request line.
+ * 
+ *  returns: Pointer to the string.
+ */
+char* request_token(struct http_request* req, struct span span);
+
+/*
+ * Function: request_matches
+ * --------------------
+ *  Checks if part of a request is exactly a string.
+ * 
+ *  req: The request.
+ *  span: The part of the request.
+ *  str: The string.
+ * 
+ *  returns: true if they are equal, false otherwise.
+ */
+bool request_matches(struct http_request* req, struct span span, char* str);
+
+/*
+ * Function: header_slot_of
+ * --------------------
+ *  Finds the slot of a header name, ignoring case.
+ * 
+ *  name: The header name.
+ *  len: Length of the name.
+ * 
+ *  returns: The slot, or -1 if the header is not kept.
+ */
+int header_slot_of(char* name, size_t len);
+
+#endif
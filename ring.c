@@ -0,0 +1,217 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file is a bounded lock-free queue used to hand work to 
+         threads.
+*/
+
+#include "ring.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * Function: ring_create
+ * --------------------
+ *  Creates a new ring.
+ * 
+ *  capacity: Number of slots, rounded up to a power of two.
+ * 
+ *  returns: Pointer to the new ring.
+ */
+ring_t* ring_create(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    ring_t* ring = aligned_alloc(CACHE_LINE, sizeof(ring_t));
+    ring_cell_t* cells = malloc(sizeof(ring_cell_t) * size);
+    if (ring == NULL || cells == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // A cell is free for the producer whose position matches its sequence
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&cells[i].seq, i);
+        cells[i].data = NULL;
+    }
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->wake_seq, 0);
+    atomic_init(&ring->sleepers, 0);
+    ring->mask = size - 1;
+    ring->cells = cells;
+
+    return ring;
+}
+
+/*
+ * Function: ring_enqueue
+ * --------------------
+ *  Adds data to the ring without blocking.
+ * 
+ *  ring: Pointer to the ring.
+ *  data: Data to insert.
+ * 
+ *  returns: True if inserted, false if the ring is full.
+ */
+bool ring_enqueue(ring_t* ring, void* data) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while (true) {
+        ring_cell_t* cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            // Cell is free, try to claim this position
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, 
+                    pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                cell->data = data;
+                // Publish to the consumer of this position
+                atomic_store_explicit(&cell->seq, pos + 1, 
+                                    memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            // Cell still holds data from the previous lap
+            return false;
+        } else {
+            // Another producer claimed it first
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Function: ring_dequeue
+ * --------------------
+ *  Removes the oldest data from the ring without blocking.
+ * 
+ *  ring: Pointer to the ring.
+ * 
+ *  returns: Pointer to the data, or NULL if the ring is empty.
+ */
+void* ring_dequeue(ring_t* ring) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    while (true) {
+        ring_cell_t* cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            // Cell is filled, try to claim this position
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, 
+                    pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                void* data = cell->data;
+                // Hand the cell back to the producer one lap ahead
+                atomic_store_explicit(&cell->seq, pos + ring->mask + 1, 
+                                    memory_order_release);
+                return data;
+            }
+        } else if (diff < 0) {
+            // Nothing has been published here yet
+            return NULL;
+        } else {
+            // Another consumer claimed it first
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Function: ring_enqueue_wake
+ * --------------------
+ *  Adds data to the ring, yielding while it is full, then wakes one parked 
+ *  consumer if there are any.
+ * 
+ *  ring: Pointer to the ring.
+ *  data: Data to insert.
+ * 
+ *  returns: Nothing.
+ */
+void ring_enqueue_wake(ring_t* ring, void* data) {
+    // Back pressure: let consumers catch up rather than grow without bound
+    while (!ring_enqueue(ring, data)) {
+        sched_yield();
+    }
+
+    // Only pay for the syscall when somebody is actually parked. The fence 
+    // orders the publish above before reading sleepers, pairing with the 
+    // one in ring_dequeue_wait.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&ring->sleepers) > 0) {
+        atomic_fetch_add(&ring->wake_seq, 1);
+        syscall(SYS_futex, &ring->wake_seq, FUTEX_WAKE_PRIVATE, 1, 
+                NULL, NULL, 0);
+    }
+}
+
+/*
+ * Function: ring_dequeue_wait
+ * --------------------
+ *  Removes the oldest data from the ring, parking the thread on a futex 
+ *  while the ring is empty.
+ * 
+ *  ring: Pointer to the ring.
+ * 
+ *  returns: Pointer to the data.
+ */
+void* ring_dequeue_wait(ring_t* ring) {
+    void* data = NULL;
+
+    while ((data = ring_dequeue(ring)) == NULL) {
+        // Announce ourselves before the final check, so a producer that 
+        // enqueues after it is guaranteed to see us and bump wake_seq
+        unsigned int seq = atomic_load(&ring->wake_seq);
+        atomic_fetch_add(&ring->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if ((data = ring_dequeue(ring)) != NULL) {
+            atomic_fetch_sub(&ring->sleepers, 1);
+            break;
+        }
+        // Returns straight away if wake_seq moved on since we read it
+        syscall(SYS_futex, &ring->wake_seq, FUTEX_WAIT_PRIVATE, seq, 
+                NULL, NULL, 0);
+        atomic_fetch_sub(&ring->sleepers, 1);
+    }
+    return data;
+}
+
+/*
+ * Function: ring_size
+ * --------------------
+ *  Gets an approximate count of the items in the ring.
+ * 
+ *  ring: Pointer to the ring.
+ * 
+ *  returns: The number of items.
+ */
+size_t ring_size(ring_t* ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+/*
+ * Function: ring_free
+ * --------------------
+ *  Frees the ring. Items still in it are not freed.
+ * 
+ *  ring: Pointer to the ring.
+ * 
+ *  returns: Nothing.
+ */
+void ring_free(ring_t* ring) {
+    if (ring == NULL) {
+        return;
+    }
+    free(ring->cells);
+    free(ring);
+}
@@ -0,0 +1,115 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define CACHE_LINE 64
+
+/*
+ * A bounded multi-producer multi-consumer queue based on Dmitry Vyukov's 
+ * sequence ring. Each cell carries a sequence number telling producers and 
+ * consumers whose turn it is, so neither side takes a lock or allocates. 
+ * The pool now hands work over through per-worker FIFOs, so only the 
+ * benchmarks use it, as a baseline.
+ */
+typedef struct ring_cell {
+    atomic_size_t seq;
+    void* data;
+} ring_cell_t;
+
+typedef struct ring {
+    // Producers and consumers each get their own cache line
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    // Bumped on every wake so sleepers can detect a missed one
+    _Alignas(CACHE_LINE) atomic_uint wake_seq;
+    atomic_uint sleepers;
+    _Alignas(CACHE_LINE) size_t mask;
+    ring_cell_t* cells;
+} ring_t;
+
+/*
+ * Function: ring_create
+ * --------------------
+ *  Creates a new ring.
+ * 
+ *  capacity: Number of slots, rounded up to a power of two.
+ * 
+ *  returns: Pointer to the new ring.
+ */
+ring_t* ring_create(size_t capacity);
+
+/*
+ * Function: ring_enqueue
+ * --------------------
+ *  Adds data to the ring without blocking.
+ * 
+ *  ring: Pointer to the ring.
+ *  data: Data to insert.
+ * 
+ *  returns: True if inserted, false if the ring is full.
+ */
+bool ring_enqueue(ring_t* ring, void* data);
+
+/*
+ * Function: ring_dequeue
+ * --------------------
+ *  Removes the oldest data from the ring without blocking.
+ * 
+ *  ring: Pointer to the ring.
+ * 
+ *  returns: Pointer to the data, or NULL if the ring is empty.
+ */
+void* ring_dequeue(ring_t* ring);
+
+/*
+ * Function: ring_enqueue_wake
+ * --------------------
+ *  Adds data to the ring, yielding while it is full, then wakes one parked 
+ *  consumer if there are any.
+ * 
+ *  ring: Pointer to the ring.
+ *  data: Data to insert.
+ * 
+ *  returns: Nothing.
+ */
+void ring_enqueue_wake(ring_t* ring, void* data);
+
+/*
+ * Function: ring_dequeue_wait
+ * --------------------
+ *  Removes the oldest data from the ring, parking the thread on a futex 
+ *  while the ring is empty.
+ * 
+ *  ring: Pointer to the ring.
+ * 
+ *  returns: Pointer to the data.
+ */
+void* ring_dequeue_wait(ring_t* ring);
+
+/*
+ * Function: ring_size
+ * --------------------
+ *  Gets an approximate count of the items in the ring.
+ * 
+ *  ring: Pointer to the ring.
+ * 
+ *  returns: The number of items.
+ */
+size_t ring_size(ring_t* ring);
+
+/*
+ * Function: ring_free
+ * --------------------
+ *  Frees the ring. Items still in it are not freed.
+ * 
+ *  ring: Pointer to the ring.
+ * 
+ *  returns: Nothing.
+ */
+void ring_free(ring_t* ring);
+
+#endif
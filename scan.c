@@ -0,0 +1,215 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file contains the delimiter scans used by the request parser, 
+         with SSE2 and AVX2 versions that test 16 or 32 bytes at a time and
+         a scalar fallback.
+*/
+#include "scan.h"
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+#define DEL 0x7f
+
+typedef size_t (*scan_fn)(char* p, size_t len, unsigned char limit, 
+                        char stop);
+
+static size_t scan_scalar(char* p, size_t len, unsigned char limit, 
+                        char stop);
+#ifdef SCAN_X86
+static size_t scan_sse2(char* p, size_t len, unsigned char limit, char stop);
+static size_t scan_avx2(char* p, size_t len, unsigned char limit, char stop);
+#endif
+
+static scan_fn scan_impl = scan_scalar;
+
+static char* kernel_names[SCAN_KERNELS] = {"scalar", "sse2", "avx2"};
+
+/*
+ * Function: scan_init
+ * --------------------
+ *  Selects the fastest delimiter scan the CPU supports. Until it is called 
+ *  the scalar scan is used.
+ * 
+ *  returns: Nothing.
+ */
+void scan_init(void) {
+    if (!scan_use(SCAN_AVX2)) {
+        scan_use(SCAN_SSE2);
+    }
+}
+
+/*
+ * Function: scan_use
+ * --------------------
+ *  Selects a delimiter scan.
+ * 
+ *  kernel: The implementation to use.
+ * 
+ *  returns: true if selected, false if the CPU does not support it.
+ */
+bool scan_use(scan_kernel_t kernel) {
+    switch (kernel) {
+        case SCAN_SCALAR:
+            scan_impl = scan_scalar;
+            return true;
+#ifdef SCAN_X86
+        // Both check CPUID, and for AVX2 that the OS saves the YMM registers
+        case SCAN_SSE2:
+            if (__builtin_cpu_supports("sse2")) {
+                scan_impl = scan_sse2;
+                return true;
+            }
+            return false;
+        case SCAN_AVX2:
+            if (__builtin_cpu_supports("avx2")) {
+                scan_impl = scan_avx2;
+                return true;
+            }
+            return false;
+#endif
+        default:
+            return false;
+    }
+}
+
+/*
+ * Function: scan_kernel_name
+ * --------------------
+ *  Gets the name of a delimiter scan.
+ * 
+ *  kernel: The implementation.
+ * 
+ *  returns: The name.
+ */
+char* scan_kernel_name(scan_kernel_t kernel) {
+    return kernel < SCAN_KERNELS ? kernel_names[kernel] : "unknown";
+}
+
+/*
+ * Function: scan_delimiter
+ * --------------------
+ *  Finds the first byte that can end a token: a byte below limit, the stop 
+ *  byte, or DEL. Bytes from 0x80 up never match.
+ * 
+ *  p: Start of the bytes.
+ *  len: Number of bytes.
+ *  limit: Bytes below this match.
+ *  stop: One more byte that matches.
+ * 
+ *  returns: Offset of the first match, or len if there is none.
+ */
+size_t scan_delimiter(char* p, size_t len, unsigned char limit, char stop) {
+    return scan_impl(p, len, limit, stop);
+}
+
+/*
+ * Function: scan_scalar
+ * --------------------
+ *  Finds the first delimiter one byte at a time.
+ * 
+ *  p: Start of the bytes.
+ *  len: Number of bytes.
+ *  limit: Bytes below this match.
+ *  stop: One more byte that matches.
+ * 
+ *  returns: Offset of the first match, or len if there is none.
+ */
+static size_t scan_scalar(char* p, size_t len, unsigned char limit, 
+                        char stop) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = p[i];
+        if (c < limit || c == (unsigned char)stop || c == DEL) {
+            return i;
+        }
+    }
+    return len;
+}
+
+#ifdef SCAN_X86
+/*
+ * Function: scan_sse2
+ * --------------------
+ *  Finds the first delimiter 16 bytes at a time.
+ * 
+ *  p: Start of the bytes.
+ *  len: Number of bytes.
+ *  limit: Bytes below this match.
+ *  stop: One more byte that matches.
+ * 
+ *  returns: Offset of the first match, or len if there is none.
+ */
+__attribute__((target("sse2")))
+static size_t scan_sse2(char* p, size_t len, unsigned char limit, char stop) {
+    __m128i limits = _mm_set1_epi8((char)limit);
+    __m128i stops = _mm_set1_epi8(stop);
+    __m128i dels = _mm_set1_epi8(DEL);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i*)(p + i));
+        // SSE2 only compares signed bytes, so test c >= limit as 
+        // max(c, limit) == c on unsigned bytes
+        __m128i above = _mm_cmpeq_epi8(_mm_max_epu8(v, limits), v);
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(v, stops), 
+                                    _mm_cmpeq_epi8(v, dels));
+        uint32_t mask = (~_mm_movemask_epi8(above) & 0xffff) |
+                        _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_scalar(p + i, len - i, limit, stop);
+}
+
+/*
+ * Function: scan_avx2
+ * --------------------
+ *  Finds the first delimiter 32 bytes at a time.
+ * 
+ *  p: Start of the bytes.
+ *  len: Number of bytes.
+ *  limit: Bytes below this match.
+ *  stop: One more byte that matches.
+ * 
+ *  returns: Offset of the first match, or len if there is none.
+ */
+__attribute__((target("avx2")))
+static size_t scan_avx2(char* p, size_t len, unsigned char limit, char stop) {
+    __m256i limits = _mm256_set1_epi8((char)limit);
+    __m256i stops = _mm256_set1_epi8(stop);
+    __m256i dels = _mm256_set1_epi8(DEL);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i*)(p + i));
+        __m256i above = _mm256_cmpeq_epi8(_mm256_max_epu8(v, limits), v);
+        __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(v, stops), 
+                                        _mm256_cmpeq_epi8(v, dels));
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(above) |
+                        (uint32_t)_mm256_movemask_epi8(hits);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    // Finish with one 16 byte step, kept in VEX form as calling the SSE2 
+    // scan here would mix legacy SSE and AVX instructions
+    if (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((__m128i*)(p + i));
+        __m128i above = _mm_cmpeq_epi8(
+                        _mm_max_epu8(v, _mm256_castsi256_si128(limits)), v);
+        __m128i hits = _mm_or_si128(
+                        _mm_cmpeq_epi8(v, _mm256_castsi256_si128(stops)), 
+                        _mm_cmpeq_epi8(v, _mm256_castsi256_si128(dels)));
+        uint32_t mask = (~_mm_movemask_epi8(above) & 0xffff) | 
+                        _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+    return i + scan_scalar(p + i, len - i, limit, stop);
+}
+#endif
@@ -0,0 +1,65 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/*
+ * Implementations of the delimiter scan. The widest one the CPU supports is 
+ * picked by scan_init, the others stay available for benchmarking.
+ */
+typedef enum scan_kernel {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2,
+    SCAN_KERNELS
+} scan_kernel_t;
+
+/*
+ * Function: scan_init
+ * --------------------
+ *  Selects the fastest delimiter scan the CPU supports. Until it is called 
+ *  the scalar scan is used.
+ * 
+ *  returns: Nothing.
+ */
+void scan_init(void);
+
+/*
+ * Function: scan_use
+ * --------------------
+ *  Selects a delimiter scan.
+ * 
+ *  kernel: The implementation to use.
+ * 
+ *  returns: true if selected, false if the CPU does not support it.
+ */
+bool scan_use(scan_kernel_t kernel);
+
+/*
+ * Function: scan_kernel_name
+ * --------------------
+ *  Gets the name of a delimiter scan.
+ * 
+ *  kernel: The implementation.
+ * 
+ *  returns: The name.
+ */
+char* scan_kernel_name(scan_kernel_t kernel);
+
+/*
+ * Function: scan_delimiter
+ * --------------------
+ *  Finds the first byte that can end a token: a byte below limit, the stop 
+ *  byte, or DEL. Bytes from 0x80 up never match.
+ * 
+ *  p: Start of the bytes.
+ *  len: Number of bytes.
+ *  limit: Bytes below this match.
+ *  stop: One more byte that matches.
+ * 
+ *  returns: Offset of the first match, or len if there is none.
+ */
+size_t scan_delimiter(char* p, size_t len, unsigned char limit, char stop);
+
+#endif
@@ -3,10 +3,18 @@ Author : Surya Venkatesh
 Purpose: This file contains the functions that are used to handle 
          the server operations.
 */
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
 #include "serverops.h"
 #include "queue.h"
+#include "ring.h"
 #include "connops.h"
+#include "eventloop.h"
+#include "uring.h"
+#include "filecache.h"
+#include "arena.h"
+#include "accesslog.h"
+#include "metrics.h"
+#include "scan.h"
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,11 +22,15 @@ Purpose: This file contains the functions that are used to handle
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
 
-// Work queue for thread pool.
-queue_t work_queue = { NULL, NULL };
-pthread_mutex_t work_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t work_queue_cond = PTHREAD_COND_INITIALIZER;
+// Options the server was started with
+struct server_options server_options;
 
 /*
  * Function: init_server
@@ -31,11 +43,7 @@ pthread_cond_t work_queue_cond = PTHREAD_COND_INITIALIZER;
  *  returns: Nothing.
  */
 void init_server(int argc, char** argv) {
-    int sockfd= 0, newsockfd = 0, s = 0;
-	struct addrinfo* hints = NULL, * res = NULL;
-	struct sockaddr_storage client_addr;
-	socklen_t client_addr_size;
-    struct thread_data thread_pool[THREAD_POOL_SIZE] = {0};
+    char port_buf[PORT_STR_LEN + 1] = {0};
 
 	if (argc < 4) {
 		fprintf(stderr, "ERROR, not enough arguments provided\n");
@@ -53,6 +61,82 @@ void init_server(int argc, char** argv) {
             absolute path\n");
         exit(EXIT_FAILURE);
     }
+    parse_options(argc, argv, &server_options);
+
+    // A client hanging up mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    scan_init();
+    access_log_init(server_options.access_log, server_options.log_format);
+    file_cache_init(root_path, server_options.fd_cache, 
+                    server_options.mem_cache, server_options.small_file_max);
+
+    int n_shards = server_options.shards;
+    // Given CPUs are used as they are, otherwise spread over the nodes
+    struct cpu_list* cpus = &server_options.shard_cpus;
+    topology_init();
+    if (cpus->n == 0 && (server_options.affinity == AFFINITY_AUTO || 
+            (server_options.affinity == AFFINITY_SHARDS && n_shards > 1))) {
+        topology_online(cpus);
+    }
+    struct shard* shards = calloc(n_shards, sizeof(struct shard));
+    malloc_check(shards);
+    metrics_init(shards, n_shards);
+
+    // Every shard owns a listener on the same port, the kernel spreads 
+    // incoming connections between them
+    for (int i = 0; i < n_shards; i++) {
+        shards[i].id = i;
+        shards[i].root_path = root_path;
+        // With a single shard leave placement to the scheduler
+        shards[i].cpu = cpus->n > 0 ? cpus->cpus[i % cpus->n] : -1;
+        shards[i].node = shards[i].cpu >= 0 ? 
+                        topology_node_of(shards[i].cpu) : -1;
+        shards[i].sockfd = open_listener(port, protocol, n_shards > 1);
+
+        // Have the kernel prefer the listener on the CPU whose receive 
+        // queue took the connection
+        if (server_options.affinity == AFFINITY_AUTO && n_shards > 1 && 
+                setsockopt(shards[i].sockfd, SOL_SOCKET, SO_INCOMING_CPU, 
+                        &shards[i].cpu, sizeof(int)) < 0) {
+            perror("setsockopt SO_INCOMING_CPU");
+        }
+
+        // A random port is picked once, the remaining shards join it
+        if (i == 0 && strcmp(port, RANDOM_PORT) == 0) {
+            port = bound_port(shards[i].sockfd, port_buf);
+        }
+    }
+    // Print server is listening on port
+    printf("Server is listening on port %s%s\n", port, 
+            protocol == atoi(DUAL_STACK_str) ? " (IPv4 and IPv6)" : "");
+    report_listener(shards[0].sockfd);
+
+    for (int i = 0; i < n_shards; i++) {
+        if (pthread_create(&shards[i].thread, NULL, run_shard, 
+                        &shards[i]) != 0) {
+            fprintf(stderr, "ERROR: Could not create shard %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Shards never return, so this only reports on them
+    report_shards(shards, n_shards);
+}
+
+/*
+ * Function: open_listener
+ * --------------------
+ *  Creates a socket listening on the given port.
+ * 
+ *  port: The port to listen on.
+ *  protocol: The protocol number.
+ *  reuse_port: Whether other sockets may bind the same port.
+ * 
+ *  returns: The socket file descriptor.
+ */
+int open_listener(char* port, int protocol, bool reuse_port) {
+    int sockfd = 0, s = 0;
+	struct addrinfo* hints = NULL, * res = NULL;
 
 	// Create address we're going to listen on (with given port number)
     hints = create_hints(protocol);
@@ -64,64 +148,524 @@ void init_server(int argc, char** argv) {
 	}
     free(hints);
 
-    sockfd = get_socket(res, protocol);
+    sockfd = get_socket(res, protocol, reuse_port);
 
 	// Listen on socket - means we're ready to accept connections,
 	// incoming connection requests will be queued, man 3 listen
-	if (listen(sockfd, BACKLOG_SIZE) < 0) {
+	if (listen(sockfd, server_options.backlog) < 0) {
 		perror("listen");
 		exit(EXIT_FAILURE);
 	}
-    // Print server is listening on port
-    printf("Server is listening on port %s\n", port);
+    return sockfd;
+}
 
-    // Create thread pool which work on the handle_work function
-    int thread_count = create_thread_pool(thread_pool, THREAD_POOL_SIZE);
-    if (thread_count <= 0) {
-        fprintf(stderr, "ERROR: Could not create thread pool\n");
+/*
+ * Function: bound_port
+ * --------------------
+ *  Gets the port a socket is bound to.
+ * 
+ *  sockfd: The socket file descriptor.
+ *  port_buf: Buffer of at least PORT_STR_LEN + 1 characters.
+ * 
+ *  returns: port_buf, holding the port.
+ */
+char* bound_port(int sockfd, char* port_buf) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int port = 0;
+
+    if (getsockname(sockfd, (struct sockaddr*)&addr, &addr_len) < 0) {
+        perror("getsockname");
         exit(EXIT_FAILURE);
     }
+    if (addr.ss_family == AF_INET6) {
+        port = ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+    } else {
+        port = ntohs(((struct sockaddr_in*)&addr)->sin_port);
+    }
+    snprintf(port_buf, PORT_STR_LEN + 1, "%d", port);
+    return port_buf;
+}
+
+/*
+ * Function: run_shard
+ * --------------------
+ *  Runs one shard's engine on its own listener, pinned to its CPU. 
+ *  Never returns.
+ * 
+ *  arg: The shard.
+ * 
+ *  returns: NULL.
+ */
+void* run_shard(void* arg) {
+    struct shard* shard = (struct shard*)arg;
+
+    // Threads created from here on inherit the placement, and what the 
+    // shard allocates comes from its node
+    if (shard->cpu >= 0) {
+        pin_thread(shard->cpu);
+        prefer_node_memory(shard->node);
+    }
+
+    if (server_options.engine == ENGINE_EPOLL) {
+        run_event_loop(shard);
+    } else if (server_options.engine == ENGINE_URING) {
+        run_uring_loop(shard);
+    } else {
+        run_thread_pool(shard);
+    }
+
+	// Close socket
+	close(shard->sockfd);
+    return NULL;
+}
+
+/*
+ * Function: pin_thread
+ * --------------------
+ *  Restricts the calling thread to one CPU.
+ * 
+ *  cpu: The CPU to run on.
+ * 
+ *  returns: SUCCESS or ERROR.
+ */
+int pin_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "ERROR: could not pin thread to CPU %d\n", cpu);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Function: report_shards
+ * --------------------
+ *  Periodically prints each shard's counters, so the spread of connections 
+ *  across shards can be checked, the worker pool sizes, the file cache 
+ *  counters, the arena and slab allocation count and dropped access log 
+ *  lines. Only reports when something changed. Never returns.
+ * 
+ *  shards: The shards.
+ *  n_shards: The number of shards.
+ * 
+ *  returns: Nothing.
+ */
+void report_shards(struct shard* shards, int n_shards) {
+    unsigned long last_total = 0;
+    struct file_cache_stats cache_stats;
 
     while (true) {
-        // Accept a connection - blocks until a connection is ready to be accepted
-        // Get back a new file descriptor to communicate on
-        client_addr_size = sizeof client_addr;
-        newsockfd = accept(sockfd, (struct sockaddr*)&client_addr, 
-                        &client_addr_size);
-        if (newsockfd < 0) {
-            perror("accept");
+        sleep(SHARD_STATS_INTERVAL);
+
+        unsigned long total = 0;
+        for (int i = 0; i < n_shards; i++) {
+            total += atomic_load(&shards[i].accepted) + 
+                     atomic_load(&shards[i].requests);
+        }
+        if (total == last_total) {
             continue;
         }
+        last_total = total;
+
+        if (n_shards > 1) {
+            for (int i = 0; i < n_shards; i++) {
+                printf("shard %d cpu %d: accepted %lu, requests %lu\n", 
+                        shards[i].id, shards[i].cpu, 
+                        atomic_load(&shards[i].accepted), 
+                        atomic_load(&shards[i].requests));
+            }
+        }
+        if (server_options.engine == ENGINE_THREADS) {
+            for (int i = 0; i < n_shards; i++) {
+                struct worker_pool* pool = &shards[i].pool;
+                printf("shard %d workers: %d (idle %d, peak %d), started "
+                        "%lu, retired %lu, stolen %lu\n", shards[i].id, 
+                        atomic_load(&pool->threads), 
+                        atomic_load(&pool->idle), atomic_load(&pool->peak), 
+                        atomic_load(&pool->grown), 
+                        atomic_load(&pool->shrunk), 
+                        atomic_load(&pool->stolen));
+            }
+        }
+        file_cache_stats(&cache_stats);
+        printf("file cache: hits %lu (memory %lu), misses %lu, open files "
+                "%zu, memory bytes %zu\n", cache_stats.hits, 
+                cache_stats.memory_hits, cache_stats.misses, 
+                cache_stats.fd_count, cache_stats.memory_bytes);
+        // Stays flat under steady load once arenas and pools have grown
+        printf("arena/slab allocations: %lu, access log drops: %lu\n", 
+                arena_slab_allocs(), access_log_drops());
+        fflush(stdout);
+    }
+}
 
-        // Create work data for thread
-        struct arg* w_arg = create_work_arg(newsockfd, root_path);
-        if (w_arg == NULL) {
-            close(newsockfd);
-            fprintf(stderr, "ERROR: unable to create work arg\n");
-            continue;
+/*
+ * Function: parse_options
+ * --------------------
+ *  Parses the optional "--name=value" arguments that follow the protocol, 
+ *  port and root path. Unknown options are reported and ignored.
+ * 
+ *  argc: The number of arguments passed to the program.
+ *  argv: The array of arguments passed to the program.
+ *  options: The options struct to fill in.
+ * 
+ *  returns: Nothing.
+ */
+void parse_options(int argc, char** argv, struct server_options* options) {
+    char* value = NULL;
+    bool min_given = false, max_given = false;
+
+    // Defaults
+    options->engine = ENGINE_EPOLL;
+    options->idle_timeout = IDLE_TIMEOUT_DEFAULT;
+    options->shards = 1;
+    options->fd_cache = FD_CACHE_DEFAULT;
+    options->mem_cache = MEM_CACHE_DEFAULT;
+    options->small_file_max = SMALL_FILE_MAX_DEFAULT;
+    options->access_log = LOG_STDOUT;
+    options->log_format = LOG_FORMAT_TEXT;
+    options->dispatch = DISPATCH_LEAST;
+    // Thread pool bounds depend on the shard count, see below
+    options->min_threads = 0;
+    options->max_threads = 0;
+    options->threads = 0;
+    options->pool_idle = POOL_IDLE_DEFAULT;
+    options->grow_wait = POOL_GROW_WAIT_DEFAULT;
+    options->backlog = 0;
+    options->defer_accept = 0;
+    options->fastopen = 0;
+    options->nodelay = true;
+    options->sndbuf = 0;
+    options->rcvbuf = 0;
+    options->affinity = AFFINITY_SHARDS;
+    options->shard_cpus.n = 0;
+    options->worker_cpus.n = 0;
+
+    for (int i = FIRST_OPTION_ARG; i < argc; i++) {
+        if ((value = option_value(argv[i], ENGINE_OPTION)) != NULL) {
+            if (strcmp(value, ENGINE_EPOLL_str) == 0) {
+                options->engine = ENGINE_EPOLL;
+            } else if (strcmp(value, ENGINE_THREADS_str) == 0) {
+                options->engine = ENGINE_THREADS;
+            } else if (strcmp(value, ENGINE_URING_str) == 0) {
+                options->engine = ENGINE_URING;
+            } else {
+                fprintf(stderr, "Invalid engine provided, defaulting to %s\n",
+                        ENGINE_EPOLL_str);
+            }
+        } else if ((value = option_value(argv[i], IDLE_TIMEOUT_OPTION)) 
+                    != NULL) {
+            options->idle_timeout = atoi(value);
+            if (options->idle_timeout <= 0) {
+                fprintf(stderr, "Invalid idle timeout provided, defaulting "
+                        "to %d\n", IDLE_TIMEOUT_DEFAULT);
+                options->idle_timeout = IDLE_TIMEOUT_DEFAULT;
+            }
+        } else if ((value = option_value(argv[i], SHARDS_OPTION)) != NULL) {
+            options->shards = atoi(value);
+            if (options->shards <= 0 || options->shards > MAX_SHARDS) {
+                fprintf(stderr, "Invalid shard count provided, defaulting "
+                        "to 1\n");
+                options->shards = 1;
+            }
+        } else if ((value = option_value(argv[i], FD_CACHE_OPTION)) != NULL) {
+            options->fd_cache = atoi(value);
+            if (options->fd_cache < 0) {
+                fprintf(stderr, "Invalid fd cache size provided, defaulting "
+                        "to %d\n", FD_CACHE_DEFAULT);
+                options->fd_cache = FD_CACHE_DEFAULT;
+            }
+        } else if ((value = option_value(argv[i], MEM_CACHE_OPTION)) != NULL) {
+            options->mem_cache = strtoul(value, NULL, 10);
+        } else if ((value = option_value(argv[i], SMALL_FILE_MAX_OPTION)) 
+                    != NULL) {
+            options->small_file_max = strtoul(value, NULL, 10);
+        } else if ((value = option_value(argv[i], ACCESS_LOG_OPTION)) 
+                    != NULL) {
+            options->access_log = value;
+        } else if ((value = option_value(argv[i], LOG_FORMAT_OPTION)) 
+                    != NULL) {
+            if (strcmp(value, LOG_FORMAT_TEXT_str) == 0) {
+                options->log_format = LOG_FORMAT_TEXT;
+            } else if (strcmp(value, LOG_FORMAT_COMPACT_str) == 0) {
+                options->log_format = LOG_FORMAT_COMPACT;
+            } else {
+                fprintf(stderr, "Invalid log format provided, defaulting "
+                        "to %s\n", LOG_FORMAT_TEXT_str);
+            }
+        } else if ((value = option_value(argv[i], DISPATCH_OPTION)) != NULL) {
+            if (strcmp(value, DISPATCH_LEAST_str) == 0) {
+                options->dispatch = DISPATCH_LEAST;
+            } else if (strcmp(value, DISPATCH_ROUND_ROBIN_str) == 0) {
+                options->dispatch = DISPATCH_ROUND_ROBIN;
+            } else {
+                fprintf(stderr, "Invalid dispatch policy provided, "
+                        "defaulting to %s\n", DISPATCH_LEAST_str);
+            }
+        } else if ((value = option_value(argv[i], THREADS_OPTION)) != NULL) {
+            options->threads = atoi(value);
+        } else if ((value = option_value(argv[i], MIN_THREADS_OPTION)) 
+                    != NULL) {
+            options->min_threads = atoi(value);
+            min_given = true;
+        } else if ((value = option_value(argv[i], MAX_THREADS_OPTION)) 
+                    != NULL) {
+            options->max_threads = atoi(value);
+            max_given = true;
+        } else if ((value = option_value(argv[i], POOL_IDLE_OPTION)) != NULL) {
+            options->pool_idle = atoi(value);
+            if (options->pool_idle <= 0) {
+                fprintf(stderr, "Invalid pool idle time provided, "
+                        "defaulting to %d\n", POOL_IDLE_DEFAULT);
+                options->pool_idle = POOL_IDLE_DEFAULT;
+            }
+        } else if ((value = option_value(argv[i], GROW_WAIT_OPTION)) != NULL) {
+            options->grow_wait = atoi(value);
+            if (options->grow_wait < 0) {
+                fprintf(stderr, "Invalid grow wait provided, defaulting "
+                        "to %d\n", POOL_GROW_WAIT_DEFAULT);
+                options->grow_wait = POOL_GROW_WAIT_DEFAULT;
+            }
+        } else if ((value = option_value(argv[i], BACKLOG_OPTION)) != NULL) {
+            options->backlog = atoi(value);
+            if (options->backlog <= 0) {
+                fprintf(stderr, "Invalid backlog provided, defaulting "
+                        "to somaxconn\n");
+                options->backlog = 0;
+            }
+        } else if ((value = option_value(argv[i], DEFER_ACCEPT_OPTION)) 
+                    != NULL) {
+            options->defer_accept = atoi(value);
+            if (options->defer_accept < 0) {
+                fprintf(stderr, "Invalid defer accept provided, disabling "
+                        "it\n");
+                options->defer_accept = 0;
+            }
+        } else if ((value = option_value(argv[i], FASTOPEN_OPTION)) != NULL) {
+            options->fastopen = atoi(value);
+            if (options->fastopen < 0) {
+                fprintf(stderr, "Invalid Fast Open queue provided, disabling "
+                        "it\n");
+                options->fastopen = 0;
+            }
+        } else if ((value = option_value(argv[i], NODELAY_OPTION)) != NULL) {
+            if (strcmp(value, ON_str) == 0) {
+                options->nodelay = true;
+            } else if (strcmp(value, OFF_str) == 0) {
+                options->nodelay = false;
+            } else {
+                fprintf(stderr, "Invalid nodelay provided, defaulting to "
+                        "%s\n", ON_str);
+                options->nodelay = true;
+            }
+        } else if ((value = option_value(argv[i], SNDBUF_OPTION)) != NULL) {
+            options->sndbuf = atoi(value);
+            if (options->sndbuf < 0) {
+                fprintf(stderr, "Invalid send buffer provided, leaving it "
+                        "to the kernel\n");
+                options->sndbuf = 0;
+            }
+        } else if ((value = option_value(argv[i], RCVBUF_OPTION)) != NULL) {
+            options->rcvbuf = atoi(value);
+            if (options->rcvbuf < 0) {
+                fprintf(stderr, "Invalid receive buffer provided, leaving it "
+                        "to the kernel\n");
+                options->rcvbuf = 0;
+            }
+        } else if ((value = option_value(argv[i], AFFINITY_OPTION)) != NULL) {
+            if (strcmp(value, AFFINITY_SHARDS_str) == 0) {
+                options->affinity = AFFINITY_SHARDS;
+            } else if (strcmp(value, AFFINITY_OFF_str) == 0) {
+                options->affinity = AFFINITY_OFF;
+            } else if (strcmp(value, AFFINITY_AUTO_str) == 0) {
+                options->affinity = AFFINITY_AUTO;
+            } else {
+                fprintf(stderr, "Invalid affinity provided, defaulting "
+                        "to %s\n", AFFINITY_SHARDS_str);
+            }
+        } else if ((value = option_value(argv[i], CPUS_OPTION)) != NULL) {
+            if (cpu_list_parse(value, &options->shard_cpus) <= 0) {
+                fprintf(stderr, "Invalid CPU list provided, ignoring it\n");
+                options->shard_cpus.n = 0;
+            }
+        } else if ((value = option_value(argv[i], WORKER_CPUS_OPTION)) 
+                    != NULL) {
+            if (cpu_list_parse(value, &options->worker_cpus) <= 0) {
+                fprintf(stderr, "Invalid worker CPU list provided, ignoring "
+                        "it\n");
+                options->worker_cpus.n = 0;
+            }
+        } else {
+            fprintf(stderr, "Ignoring unknown option %s\n", argv[i]);
         }
+    }
 
-        pthread_mutex_lock(&work_queue_mutex);
-        // Add work data to work queue
-        queue_enqueue(&work_queue, w_arg);
-        // Signal threads to wake up and start working
-        pthread_cond_signal(&work_queue_cond);
-        pthread_mutex_unlock(&work_queue_mutex);
+    // The kernel silently caps the backlog at somaxconn, so use what it 
+    // will actually allow
+    int somaxconn = read_sysctl(SOMAXCONN_PATH, SOMAXCONN);
+    if (options->backlog > somaxconn) {
+        fprintf(stderr, "Backlog above somaxconn, using %d\n", somaxconn);
+    }
+    if (options->backlog == 0 || options->backlog > somaxconn) {
+        options->backlog = somaxconn;
     }
 
-	// Close socket
-	close(sockfd);
+    // Every shard runs its own pool, so the defaults share the CPUs, and 
+    // the default cap of POOL_MAX_THREADS_DEFAULT threads, between them. 
+    // Hosts with more CPUs than that cap still get one worker per CPU.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int shards = options->shards;
+    if (!min_given) {
+        options->min_threads = (cpus + shards - 1) / shards;
+    }
+    if (!max_given) {
+        long max = cpus > POOL_MAX_THREADS_DEFAULT ? 
+                    cpus : POOL_MAX_THREADS_DEFAULT;
+        options->max_threads = (max + shards - 1) / shards;
+    }
+
+    // Keep the pool bounds consistent, starting at the minimum by default
+    if (options->min_threads <= 0) {
+        fprintf(stderr, "Invalid minimum thread count provided, defaulting "
+                "to 1\n");
+        options->min_threads = 1;
+    }
+    if (options->max_threads < options->min_threads) {
+        fprintf(stderr, "Maximum thread count below the minimum, using %d\n", 
+                options->min_threads);
+        options->max_threads = options->min_threads;
+    }
+    if (options->threads < options->min_threads) {
+        options->threads = options->min_threads;
+    } else if (options->threads > options->max_threads) {
+        options->threads = options->max_threads;
+    }
+}
 
-    // Destroy mutex and cond
-    pthread_mutex_destroy(&work_queue_mutex);
-    pthread_cond_destroy(&work_queue_cond);
+/*
+ * Function: option_value
+ * --------------------
+ *  Gets the value of an option argument of the form "--name=value".
+ * 
+ *  arg: The argument to check.
+ *  name: The option prefix, including the "=".
+ * 
+ *  returns: Pointer to the value, or NULL if arg is not that option.
+ */
+char* option_value(char* arg, char* name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0) {
+        return NULL;
+    }
+    return arg + len;
+}
+
+/*
+ * Function: run_thread_pool
+ * --------------------
+ *  Accepts connections on the calling thread and hands them to a pool of 
+ *  blocking worker threads, a batch per wake-up. Never returns.
+ * 
+ *  shard: The shard whose listener and workers to use.
+ * 
+ *  returns: Nothing.
+ */
+void run_thread_pool(struct shard* shard) {
+    struct pollfd listener = { shard->sockfd, POLLIN, 0 };
+
+    // Start the workers, which grow and shrink with the load from here on
+    if (pool_start(&shard->pool, shard) <= 0) {
+        fprintf(stderr, "ERROR: Could not create thread pool\n");
+        exit(EXIT_FAILURE);
+    }
+    // Draining the backlog must stop at the first pending connection 
+    // missing rather than block
+    if (set_nonblocking(shard->sockfd) != SUCCESS) {
+        exit(EXIT_FAILURE);
+    }
+
+    while (true) {
+        // Wait for connections to be ready to be accepted
+        if (poll(&listener, 1, -1) < 0) {
+            if (errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+        // Full batches mean more are pending, so keep draining
+        while (accept_batch(shard) == DISPATCH_BATCH) {
+        }
+    }
+}
+
+/*
+ * Function: accept_batch
+ * --------------------
+ *  Accepts pending connections until the listener has none left or a 
+ *  batch is full, then hands the batch to the workers at once.
+ * 
+ *  shard: The shard whose listener and workers to use.
+ * 
+ *  returns: The number of connections accepted.
+ */
+int accept_batch(struct shard* shard) {
+    struct conn* conns[DISPATCH_BATCH];
+    int nodes[DISPATCH_BATCH];
+    int n = 0;
+
+    while (n < DISPATCH_BATCH) {
+        // Workers block on their connections, so those stay blocking
+        int newsockfd = accept4(shard->sockfd, NULL, NULL, SOCK_CLOEXEC);
+        if (newsockfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept4");
+            }
+            break;
+        }
+        conns[n] = conn_create(newsockfd, shard->root_path);
+        nodes[n++] = incoming_node(newsockfd);
+    }
+    if (n > 0) {
+        atomic_fetch_add_explicit(&shard->accepted, n, memory_order_relaxed);
+        pool_dispatch_batch(&shard->pool, conns, nodes, n);
+    }
+    return n;
+}
+
+/*
+ * Function: incoming_node
+ * --------------------
+ *  Finds the NUMA node whose CPU received a connection, in auto affinity 
+ *  mode.
+ * 
+ *  sockfd: The connection.
+ * 
+ *  returns: The node, or -1 if it is unknown or not wanted.
+ */
+int incoming_node(int sockfd) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+
+    if (server_options.affinity != AFFINITY_AUTO || 
+            topology_nodes() <= 1 || 
+            getsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || 
+            cpu < 0) {
+        return -1;
+    }
+    return topology_node_of(cpu);
 }
 
 /*
  * Function: get_protocol
  * --------------------
  *  Converts the protocol string to an integer, and also
- *  validates the protocol. Defaults to IPv4 if invalid.
+ *  validates the protocol. Defaults to IPv4 if invalid, or if dual stack 
+ *  is asked for on a host without IPv6.
  * 
  *  protocol: The protocol string.
  * 
@@ -132,6 +676,14 @@ int get_protocol(char* protocol) {
         return atoi(IPv4_str);
     } else if (strcmp(protocol, IPv6_str) == 0) {
         return atoi(IPv6_str);
+    } else if (strcmp(protocol, DUAL_STACK_str) == 0) {
+        // IPv4 clients reach the IPv6 listener too, so only fall back 
+        // where the host has no IPv6 at all
+        if (!ipv6_supported()) {
+            fprintf(stderr, "IPv6 unavailable, listening on IPv4 only\n");
+            return atoi(IPv4_str);
+        }
+        return atoi(DUAL_STACK_str);
     } else {
         fprintf(stderr, "Invalid protocol provided, defaulting to IPv4\n");
         return atoi(IPv4_str);
@@ -148,13 +700,30 @@ int get_protocol(char* protocol) {
  *  returns: True if valid, false otherwise.
  */
 bool is_valid_protocol(int protocol) {
-    if (protocol != atoi(IPv4_str) && protocol != atoi(IPv6_str)) {
+    if (protocol != atoi(IPv4_str) && protocol != atoi(IPv6_str) && 
+            protocol != atoi(DUAL_STACK_str)) {
         fprintf(stderr, "Invalid protocol provided, defaulting to IPv4\n");
         return false;
     }
     return true;
 }
 
+/*
+ * Function: ipv6_supported
+ * --------------------
+ *  Checks if the host can create IPv6 sockets.
+ * 
+ *  returns: True if it can, false otherwise.
+ */
+bool ipv6_supported(void) {
+    int sockfd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        return false;
+    }
+    close(sockfd);
+    return true;
+}
+
 /*
  * Function: create_hints
  * --------------------
@@ -171,7 +740,7 @@ struct addrinfo* create_hints(int protocol) {
 
 	if (protocol == 4) {
 		hints->ai_family = AF_INET;
-	} else if (protocol == 6) {
+	} else if (protocol == 6 || protocol == 46) {
 		hints->ai_family = AF_INET6;
 	} else {
 		fprintf(stderr, "ERROR, invalid protocol\n");
@@ -190,10 +759,11 @@ struct addrinfo* create_hints(int protocol) {
  * 
  *  res: The address to bind to.
  *  protocol: The protocol number.
+ *  reuse_port: Whether other sockets may bind the same port.
  * 
  *  returns: The socket file descriptor.
  */
-int get_socket(struct addrinfo* res, int protocol) {
+int get_socket(struct addrinfo* res, int protocol, bool reuse_port) {
     if (res == NULL) {
         fprintf(stderr, "ERROR, no address info returned\n");
         exit(EXIT_FAILURE);
@@ -215,7 +785,8 @@ int get_socket(struct addrinfo* res, int protocol) {
 				perror("socket");
 				continue;
 			}
-		} else if (protocol == 6 && p->ai_family == AF_INET6) {
+		} else if ((protocol == 6 || protocol == 46) && 
+                    p->ai_family == AF_INET6) {
 			if ((sockfd = socket(p->ai_family, p->ai_socktype, 
 				p->ai_protocol)) == -1) {
 				perror("socket");
@@ -230,6 +801,25 @@ int get_socket(struct addrinfo* res, int protocol) {
 			perror("setsockopt");
 			exit(EXIT_FAILURE);
 		}
+        // Let each shard bind its own listener to the same port
+        if (reuse_port && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &re, 
+                        sizeof(int)) < 0) {
+            perror("setsockopt");
+            exit(EXIT_FAILURE);
+        }
+
+        // One IPv6 socket also takes IPv4 connections as mapped addresses, 
+        // whatever net.ipv6.bindv6only defaults to. Plain IPv6 still 
+        // follows the sysctl, as it always has.
+        int v6only = 0;
+        if (protocol == 46 && setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, 
+                    &v6only, sizeof(int)) < 0) {
+            perror("setsockopt");
+            exit(EXIT_FAILURE);
+        }
+        // Connections inherit these, and some only take effect if set 
+        // before listen
+        configure_listener(sockfd);
 
 		// Bind address to the socket
 		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
@@ -250,145 +840,123 @@ int get_socket(struct addrinfo* res, int protocol) {
 }
 
 /*
- * Function: create_thread_pool
+ * Function: configure_listener
  * --------------------
- *  Creates a thread pool of the given size.
+ *  Applies the listener options to a socket before it is bound. Accepted 
+ *  connections inherit its buffer sizes and TCP_NODELAY.
  * 
- *  thread_pool: The thread pool struct.
- *  len: The number of threads to create.
+ *  sockfd: The socket file descriptor.
  * 
- *  returns: The number of threads created.
+ *  returns: Nothing.
  */
-int create_thread_pool(struct thread_data* thread_pool, size_t len) {
-    int t_status = 0;
-    int thread_count = 0;
-    pthread_attr_t attr;
-
-    // Initialize thread attributes, set as detached
-    if (pthread_attr_init(&attr) != 0) {
-        fprintf(stderr, "ERROR: pthread_attr_init failed\n");
-        exit(EXIT_FAILURE);
+void configure_listener(int sockfd) {
+    int nodelay = server_options.nodelay;
+
+    // Responses are written whole, with MSG_MORE where more follows, so 
+    // Nagle's algorithm would only hold back their last segment
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, 
+                sizeof(int)) < 0) {
+        perror("setsockopt TCP_NODELAY");
     }
-    if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0) {
-        fprintf(stderr, "ERROR: pthread_attr_setdetachstate failed\n");
-        exit(EXIT_FAILURE);
+    // Only hand a connection over once its request has arrived, so no 
+    // worker or read is spent on an empty connection
+    if (server_options.defer_accept > 0 && 
+            setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, 
+                    &server_options.defer_accept, sizeof(int)) < 0) {
+        perror("setsockopt TCP_DEFER_ACCEPT");
     }
-    
-    // Create threads to work on handle_work function
-    for (size_t i = 0; i < len; i++) {
-        t_status = pthread_create(&(thread_pool[i].id), &attr, 
-                    handle_work, NULL);
-        thread_pool[i].status = t_status;
-
-        // Check if thread was created successfully
-        if (t_status != 0) {
-            thread_pool[i].id = 0;
-            continue;
-        }
-
-        thread_count++;
+    // Let returning clients send their request in the SYN
+    if (server_options.fastopen > 0 && 
+            setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, 
+                    &server_options.fastopen, sizeof(int)) < 0) {
+        perror("setsockopt TCP_FASTOPEN");
+    }
+    // Set before listen, as the window scale is fixed by the handshake
+    if (server_options.sndbuf > 0 && 
+            setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &server_options.sndbuf, 
+                    sizeof(int)) < 0) {
+        perror("setsockopt SO_SNDBUF");
+    }
+    if (server_options.rcvbuf > 0 && 
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &server_options.rcvbuf, 
+                    sizeof(int)) < 0) {
+        perror("setsockopt SO_RCVBUF");
     }
-
-    pthread_attr_destroy(&attr);
-
-    return thread_count;
 }
 
 /*
- * Function: create_work_arg
+ * Function: report_listener
  * --------------------
- *  Creates a work argument struct.
+ *  Prints the listener settings in effect, as read back from the socket.
  * 
- *  clienfd: The client socket file descriptor.
- *  root_path: The root path of the server.
- * 
- *  returns: The argument struct.
- */
-struct arg* create_work_arg(int clientfd, char* root_path) {
-    struct arg* work_arg = malloc(sizeof(struct arg));
-    malloc_check(work_arg);
-
-    // Client socket file descriptor
-    work_arg->clientfd = malloc(sizeof(int));
-    malloc_check(work_arg->clientfd);
-    *(work_arg->clientfd) = clientfd;
-
-    // Root path
-    work_arg->root_path = malloc(strlen(root_path) + 1);
-    malloc_check(work_arg->root_path);
-    strcpy(work_arg->root_path, root_path);
-
-    return work_arg;
-}
-
-/*
- * Function: malloc_check
- * --------------------
- *  Checks if malloc was successful. If not, prints an error message and exits.
- * 
- *  ptr: The pointer to check.
+ *  sockfd: A listening socket.
  * 
  *  returns: Nothing.
  */
-void malloc_check(void* ptr) {
-    if (ptr == NULL) {
-        fprintf(stderr, "ERROR, malloc failed\n");
-        exit(EXIT_FAILURE);
-    }
+void report_listener(int sockfd) {
+    int defer_accept = 0, fastopen = 0, nodelay = 0, sndbuf = 0, rcvbuf = 0;
+    socklen_t len = sizeof(int);
+
+    getsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, &len);
+    len = sizeof(int);
+    getsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, &len);
+    len = sizeof(int);
+    getsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+    len = sizeof(int);
+    getsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+    len = sizeof(int);
+    getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+
+    // Listeners only take Fast Open when the sysctl allows it
+    bool fastopen_allowed = read_sysctl(TCP_FASTOPEN_PATH, 0) & 
+                            TCP_FASTOPEN_SERVER;
+    printf("Listener: backlog %d (somaxconn %d), defer accept %ds, fast "
+            "open %d%s, nodelay %s, sndbuf %d%s, rcvbuf %d%s\n", 
+            server_options.backlog, read_sysctl(SOMAXCONN_PATH, SOMAXCONN), 
+            defer_accept, fastopen, 
+            fastopen > 0 && !fastopen_allowed ? 
+                " (off in net.ipv4.tcp_fastopen)" : "", 
+            nodelay ? ON_str : OFF_str, sndbuf, 
+            server_options.sndbuf > 0 ? "" : " (autotuned)", rcvbuf, 
+            server_options.rcvbuf > 0 ? "" : " (autotuned)");
 }
 
 /*
- * Function: handle_work
+ * Function: read_sysctl
  * --------------------
- *  Handles work for each thread.
+ *  Reads an integer kernel setting from /proc/sys.
  * 
- *  arg: unused, required by pthread_create.
+ *  path: The setting's file.
+ *  fallback: Value to use if it cannot be read.
  * 
- *  returns: The hints struct.
+ *  returns: The setting.
  */
-void* handle_work(void* arg) {
-    // Unused arg
-    void* arg_unused __attribute__ ((unused)) = arg;
-
-    void* queue_data = NULL;
-    struct arg* work_arg = NULL;
-
-    // Let each thread wait for work, and then process it when work is available
-    while (true) {
-        pthread_mutex_lock(&work_queue_mutex);
-        if ((queue_data = queue_dequeue(&work_queue)) == NULL) {
-            // Wait for work to be available
-            pthread_cond_wait(&work_queue_cond, &work_queue_mutex);
-        }
-        pthread_mutex_unlock(&work_queue_mutex);
+int read_sysctl(char* path, int fallback) {
+    int value = fallback;
+    FILE* file = fopen(path, "r");
 
-        if (queue_data != NULL) {
-            work_arg = (struct arg*)queue_data;
-            if (work_arg == NULL) {
-                continue;
-            }
-
-            // Handle connection
-            handle_client(work_arg);
-            
-            free_work_arg(work_arg);
-        }
+    if (file == NULL) {
+        return fallback;
     }
-    return NULL;
+    if (fscanf(file, "%d", &value) != 1) {
+        value = fallback;
+    }
+    fclose(file);
+    return value;
 }
 
 /*
- * Function: free_work_arg
+ * Function: malloc_check
  * --------------------
- *  Frees the work argument struct.
+ *  Checks if malloc was successful. If not, prints an error message and exits.
  * 
- *  work_arg: The work argument struct.
+ *  ptr: The pointer to check.
  * 
  *  returns: Nothing.
  */
-void free_work_arg(struct arg* work_arg) {
-    if (work_arg == NULL) return;
-    free(work_arg->clientfd);
-    free(work_arg->root_path);
-    free(work_arg);
+void malloc_check(void* ptr) {
+    if (ptr == NULL) {
+        fprintf(stderr, "ERROR, malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
 }
\ No newline at end of file
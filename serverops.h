@@ -4,23 +4,145 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include "queue.h"
+#include "ring.h"
+#include "accesslog.h"
+#include "pool.h"
+#include "topology.h"
 
 #define IPv4_str "4"
 #define IPv6_str "6"
+#define DUAL_STACK_str "46"
 #define RANDOM_PORT "0"
-#define BACKLOG_SIZE 10
-#define THREAD_POOL_SIZE 10
-#define VALID_THREAD 0
+#define SOMAXCONN_PATH "/proc/sys/net/core/somaxconn"
+#define TCP_FASTOPEN_PATH "/proc/sys/net/ipv4/tcp_fastopen"
+// Bit of net.ipv4.tcp_fastopen that lets listeners accept Fast Open
+#define TCP_FASTOPEN_SERVER 0x2
+#define FIRST_OPTION_ARG 4
+#define ENGINE_OPTION "--engine="
+#define ENGINE_EPOLL_str "epoll"
+#define ENGINE_THREADS_str "threads"
+#define ENGINE_URING_str "uring"
+#define IDLE_TIMEOUT_OPTION "--idle-timeout="
+#define IDLE_TIMEOUT_DEFAULT 5
+#define SHARDS_OPTION "--shards="
+#define MAX_SHARDS 1024
+#define SHARD_STATS_INTERVAL 10
+#define PORT_STR_LEN 5
+#define FD_CACHE_OPTION "--fd-cache="
+#define MEM_CACHE_OPTION "--mem-cache="
+#define SMALL_FILE_MAX_OPTION "--small-file-max="
+#define ACCESS_LOG_OPTION "--access-log="
+#define LOG_FORMAT_OPTION "--log-format="
+#define LOG_FORMAT_TEXT_str "text"
+#define LOG_FORMAT_COMPACT_str "compact"
+#define THREADS_OPTION "--threads="
+#define MIN_THREADS_OPTION "--min-threads="
+#define MAX_THREADS_OPTION "--max-threads="
+#define POOL_IDLE_OPTION "--pool-idle="
+#define GROW_WAIT_OPTION "--grow-wait="
+#define BACKLOG_OPTION "--backlog="
+#define DEFER_ACCEPT_OPTION "--defer-accept="
+#define FASTOPEN_OPTION "--fastopen="
+#define NODELAY_OPTION "--nodelay="
+#define SNDBUF_OPTION "--sndbuf="
+#define RCVBUF_OPTION "--rcvbuf="
+#define ON_str "on"
+#define OFF_str "off"
+#define CPUS_OPTION "--cpus="
+#define WORKER_CPUS_OPTION "--worker-cpus="
+#define AFFINITY_OPTION "--affinity="
+#define AFFINITY_SHARDS_str "shards"
+#define AFFINITY_OFF_str "off"
+#define AFFINITY_AUTO_str "auto"
 
-struct arg {
-    int* clientfd;
-    char* root_path;
+/*
+ * Where threads run when no CPUs are given.
+ */
+typedef enum affinity {
+    // Pin shards round robin to the online CPUs when there are several
+    AFFINITY_SHARDS,
+    // Leave every thread to the scheduler
+    AFFINITY_OFF,
+    // Spread shards over the NUMA nodes, keep workers and their memory on 
+    // a node, and steer connections by the CPU that received them
+    AFFINITY_AUTO
+} affinity_t;
+
+typedef enum engine {
+    ENGINE_EPOLL,
+    ENGINE_THREADS,
+    ENGINE_URING
+} engine_t;
+
+struct server_options {
+    engine_t engine;
+    // Seconds a connection may sit idle before it is closed
+    int idle_timeout;
+    // Number of listeners, each with its own engine
+    int shards;
+    // Most files the file cache keeps open, 0 disables it
+    int fd_cache;
+    // Byte budget for small files held in memory, 0 disables it
+    size_t mem_cache;
+    // Largest file held in memory
+    size_t small_file_max;
+    // Access log file, LOG_STDOUT or LOG_OFF
+    char* access_log;
+    log_format_t log_format;
+    // How the thread pool engine spreads connections over its workers
+    dispatch_t dispatch;
+    // Workers each shard's thread pool starts with, and its bounds
+    int threads;
+    int min_threads;
+    int max_threads;
+    // Seconds a worker above the minimum may sit idle before exiting
+    int pool_idle;
+    // Milliseconds of queue wait after which the pool grows
+    int grow_wait;
+    // Pending connections the kernel queues on each listener, at most 
+    // somaxconn, which 0 stands for
+    int backlog;
+    // Seconds the kernel holds a connection back until its request 
+    // arrives, 0 disables it
+    int defer_accept;
+    // Pending Fast Open requests each listener takes, 0 disables it
+    int fastopen;
+    // Send small writes at once instead of coalescing them
+    bool nodelay;
+    // Buffer sizes connections inherit from the listener, 0 leaves them 
+    // to the kernel's autotuning
+    int sndbuf;
+    int rcvbuf;
+    affinity_t affinity;
+    // CPUs for the shards and for the thread pool workers, empty if not 
+    // given
+    struct cpu_list shard_cpus;
+    struct cpu_list worker_cpus;
 };
 
-struct thread_data {
-    int status;
-    pthread_t id;
+// Options the server was started with
+extern struct server_options server_options;
+
+/*
+ * A shard owns a listener and the threads serving it. With several shards 
+ * each listener uses SO_REUSEPORT and the kernel spreads connections 
+ * between them, so shards share no queue.
+ */
+struct shard {
+    int id;
+    int sockfd;
+    // CPU the shard is pinned to, -1 if unpinned
+    int cpu;
+    // NUMA node of that CPU, -1 if unpinned
+    int node;
+    char* root_path;
+    pthread_t thread;
+    // Only used by the thread pool engine
+    struct worker_pool pool;
+    atomic_ulong accepted;
+    atomic_ulong requests;
 };
 
 /*
@@ -35,11 +157,137 @@ struct thread_data {
  */
 void init_server(int argc, char** argv);
 
+/*
+ * Function: parse_options
+ * --------------------
+ *  Parses the optional "--name=value" arguments that follow the protocol, 
+ *  port and root path. Unknown options are reported and ignored.
+ * 
+ *  argc: The number of arguments passed to the program.
+ *  argv: The array of arguments passed to the program.
+ *  options: The options struct to fill in.
+ * 
+ *  returns: Nothing.
+ */
+void parse_options(int argc, char** argv, struct server_options* options);
+
+/*
+ * Function: option_value
+ * --------------------
+ *  Gets the value of an option argument of the form "--name=value".
+ * 
+ *  arg: The argument to check.
+ *  name: The option prefix, including the "=".
+ * 
+ *  returns: Pointer to the value, or NULL if arg is not that option.
+ */
+char* option_value(char* arg, char* name);
+
+/*
+ * Function: open_listener
+ * --------------------
+ *  Creates a socket listening on the given port.
+ * 
+ *  port: The port to listen on.
+ *  protocol: The protocol number.
+ *  reuse_port: Whether other sockets may bind the same port.
+ * 
+ *  returns: The socket file descriptor.
+ */
+int open_listener(char* port, int protocol, bool reuse_port);
+
+/*
+ * Function: bound_port
+ * --------------------
+ *  Gets the port a socket is bound to.
+ * 
+ *  sockfd: The socket file descriptor.
+ *  port_buf: Buffer of at least PORT_STR_LEN + 1 characters.
+ * 
+ *  returns: port_buf, holding the port.
+ */
+char* bound_port(int sockfd, char* port_buf);
+
+/*
+ * Function: run_shard
+ * --------------------
+ *  Runs one shard's engine on its own listener, pinned to its CPU. 
+ *  Never returns.
+ * 
+ *  arg: The shard.
+ * 
+ *  returns: NULL.
+ */
+void* run_shard(void* arg);
+
+/*
+ * Function: pin_thread
+ * --------------------
+ *  Restricts the calling thread to one CPU.
+ * 
+ *  cpu: The CPU to run on.
+ * 
+ *  returns: SUCCESS or ERROR.
+ */
+int pin_thread(int cpu);
+
+/*
+ * Function: report_shards
+ * --------------------
+ *  Periodically prints each shard's counters, so the spread of connections 
+ *  across shards can be checked, the worker pool sizes, the file cache 
+ *  counters, the arena and slab allocation count and dropped access log 
+ *  lines. Only reports when something changed. Never returns.
+ * 
+ *  shards: The shards.
+ *  n_shards: The number of shards.
+ * 
+ *  returns: Nothing.
+ */
+void report_shards(struct shard* shards, int n_shards);
+
+/*
+ * Function: run_thread_pool
+ * --------------------
+ *  Accepts connections on the calling thread and hands them to a pool of 
+ *  blocking worker threads, a batch per wake-up. Never returns.
+ * 
+ *  shard: The shard whose listener and workers to use.
+ * 
+ *  returns: Nothing.
+ */
+void run_thread_pool(struct shard* shard);
+
+/*
+ * Function: accept_batch
+ * --------------------
+ *  Accepts pending connections until the listener has none left or a 
+ *  batch is full, then hands the batch to the workers at once.
+ * 
+ *  shard: The shard whose listener and workers to use.
+ * 
+ *  returns: The number of connections accepted.
+ */
+int accept_batch(struct shard* shard);
+
+/*
+ * Function: incoming_node
+ * --------------------
+ *  Finds the NUMA node whose CPU received a connection, in auto affinity 
+ *  mode.
+ * 
+ *  sockfd: The connection.
+ * 
+ *  returns: The node, or -1 if it is unknown or not wanted.
+ */
+int incoming_node(int sockfd);
+
 /*
  * Function: get_protocol
  * --------------------
  *  Converts the protocol string to an integer, and also
- *  validates the protocol. Defaults to IPv4 if invalid.
+ *  validates the protocol. Defaults to IPv4 if invalid, or if dual stack 
+ *  is asked for on a host without IPv6.
  * 
  *  protocol: The protocol string.
  * 
@@ -58,6 +306,15 @@ int get_protocol(char* protocol);
  */
 bool valid_protocol(int protocol);
 
+/*
+ * Function: ipv6_supported
+ * --------------------
+ *  Checks if the host can create IPv6 sockets.
+ * 
+ *  returns: True if it can, false otherwise.
+ */
+bool ipv6_supported(void);
+
 /*
  * Function: create_hints
  * --------------------
@@ -76,67 +333,57 @@ struct addrinfo* create_hints(int protocol);
  * 
  *  res: The address to bind to.
  *  protocol: The protocol number.
+ *  reuse_port: Whether other sockets may bind the same port.
  * 
  *  returns: The socket file descriptor.
  */
-int get_socket(struct addrinfo* res, int protocol);
+int get_socket(struct addrinfo* res, int protocol, bool reuse_port);
 
 /*
- * Function: create_thread_pool
+ * Function: configure_listener
  * --------------------
- *  Creates a thread pool of the given size.
+ *  Applies the listener options to a socket before it is bound. Accepted 
+ *  connections inherit its buffer sizes and TCP_NODELAY.
  * 
- *  thread_pool: The thread pool struct.
- *  len: The number of threads to create.
+ *  sockfd: The socket file descriptor.
  * 
- *  returns: The number of threads created.
+ *  returns: Nothing.
  */
-int create_thread_pool(struct thread_data thread_pool[], size_t len);
+void configure_listener(int sockfd);
 
 /*
- * Function: malloc_check
+ * Function: report_listener
  * --------------------
- *  Checks if malloc was successful. If not, prints an error message and exits.
+ *  Prints the listener settings in effect, as read back from the socket.
  * 
- *  ptr: The pointer to check.
+ *  sockfd: A listening socket.
  * 
  *  returns: Nothing.
  */
-void malloc_check(void* ptr);
+void report_listener(int sockfd);
 
 /*
- * Function: create_work_arg
+ * Function: read_sysctl
  * --------------------
- *  Creates a work argument struct.
+ *  Reads an integer kernel setting from /proc/sys.
  * 
- *  clienfd: The client socket file descriptor.
- *  root_path: The root path of the server.
+ *  path: The setting's file.
+ *  fallback: Value to use if it cannot be read.
  * 
- *  returns: The argument struct.
+ *  returns: The setting.
  */
-struct arg* create_work_arg(int clientfd, char* root_path);
+int read_sysctl(char* path, int fallback);
 
 /*
- * Function: free_work_arg
+ * Function: malloc_check
  * --------------------
- *  Frees the work argument struct.
+ *  Checks if malloc was successful. If not, prints an error message and exits.
  * 
- *  work_arg: The work argument struct.
+ *  ptr: The pointer to check.
  * 
  *  returns: Nothing.
  */
-void free_work_arg(struct arg* work_arg);
-
-/*
- * Function: handle_work
- * --------------------
- *  Handles work for each thread.
- * 
- *  arg: unused, required by pthread_create.
- * 
- *  returns: The hints struct.
- */
-void* handle_work(void* arg);
+void malloc_check(void* ptr);
 
 
 #endif
\ No newline at end of file
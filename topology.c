@@ -0,0 +1,276 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file reads the CPU and NUMA topology from /sys and places
+         threads and their memory on it.
+*/
+#define _GNU_SOURCE
+#include "topology.h"
+#include "connops.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+static struct cpu_list online;
+static struct cpu_list node_cpus[MAX_NODES];
+static int cpu_nodes[MAX_CPUS];
+static int n_nodes = 1;
+
+/*
+ * Function: read_cpu_list
+ * --------------------
+ *  Reads a CPU list file from /sys.
+ * 
+ *  path: The file.
+ *  list: Filled with the CPUs.
+ * 
+ *  returns: The number of CPUs, or -1 if the file cannot be read.
+ */
+static int read_cpu_list(char* path, struct cpu_list* list) {
+    char buffer[CPU_LIST_LEN];
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char* line = fgets(buffer, sizeof(buffer), f);
+    fclose(f);
+    if (line == NULL) {
+        return -1;
+    }
+    buffer[strcspn(buffer, "\n")] = '\0';
+    return cpu_list_parse(buffer, list);
+}
+
+/*
+ * Function: topology_init
+ * --------------------
+ *  Reads the online CPUs and the NUMA node each belongs to from /sys. 
+ *  Without NUMA information every CPU is on node 0.
+ * 
+ *  returns: Nothing.
+ */
+void topology_init(void) {
+    char path[SYS_PATH_LEN];
+
+    if (read_cpu_list(SYS_ONLINE_CPUS_PATH, &online) <= 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        online.n = 0;
+        for (long i = 0; i < n_cpus && i < MAX_CPUS; i++) {
+            online.cpus[online.n++] = i;
+        }
+    }
+
+    int found = 0;
+    for (int node = 0; node < MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "%s/node%d/cpulist", SYS_NODE_PATH, 
+                node);
+        if (read_cpu_list(path, &node_cpus[node]) <= 0) {
+            node_cpus[node].n = 0;
+            continue;
+        }
+        for (int i = 0; i < node_cpus[node].n; i++) {
+            cpu_nodes[node_cpus[node].cpus[i]] = node;
+        }
+        found = node + 1;
+    }
+    if (found == 0) {
+        node_cpus[0] = online;
+        found = 1;
+    }
+    n_nodes = found;
+}
+
+/*
+ * Function: cpu_list_parse
+ * --------------------
+ *  Parses a CPU list such as "0-3,8,10-11", the format used by /sys and 
+ *  taskset.
+ * 
+ *  str: The list.
+ *  list: Filled with the CPUs, in the order given. A CPU named more than 
+ *      once is only kept the first time.
+ * 
+ *  returns: The number of CPUs, or -1 if the list is malformed.
+ */
+int cpu_list_parse(char* str, struct cpu_list* list) {
+    char* p = str;
+    bool seen[MAX_CPUS] = { false };
+    list->n = 0;
+
+    while (*p != '\0') {
+        char* end = NULL;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0) {
+            return -1;
+        }
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+        if (last >= MAX_CPUS) {
+            return -1;
+        }
+        // Skipping repeats keeps n within MAX_CPUS however the ranges 
+        // overlap.
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (!seen[cpu]) {
+                seen[cpu] = true;
+                list->cpus[list->n++] = cpu;
+            }
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            return -1;
+        }
+    }
+    return list->n;
+}
+
+/*
+ * Function: topology_online
+ * --------------------
+ *  Gets the online CPUs ordered so that consecutive entries alternate 
+ *  between NUMA nodes, so taking the first n spreads them over the nodes.
+ * 
+ *  list: Filled with the CPUs.
+ * 
+ *  returns: Nothing.
+ */
+void topology_online(struct cpu_list* list) {
+    bool taken[MAX_CPUS] = {false};
+    bool is_online[MAX_CPUS] = {false};
+
+    for (int i = 0; i < online.n; i++) {
+        is_online[online.cpus[i]] = true;
+    }
+    list->n = 0;
+    for (int round = 0; list->n < online.n; round++) {
+        bool any = false;
+        for (int node = 0; node < n_nodes; node++) {
+            if (round >= node_cpus[node].n) {
+                continue;
+            }
+            any = true;
+            int cpu = node_cpus[node].cpus[round];
+            if (is_online[cpu] && !taken[cpu]) {
+                taken[cpu] = true;
+                list->cpus[list->n++] = cpu;
+            }
+        }
+        if (!any) {
+            break;
+        }
+    }
+    // CPUs missing from the node lists go last
+    for (int i = 0; i < online.n; i++) {
+        if (!taken[online.cpus[i]]) {
+            list->cpus[list->n++] = online.cpus[i];
+        }
+    }
+}
+
+/*
+ * Function: topology_nodes
+ * --------------------
+ *  Gets the number of NUMA nodes with online CPUs.
+ * 
+ *  returns: The number of nodes, at least 1.
+ */
+int topology_nodes(void) {
+    return n_nodes;
+}
+
+/*
+ * Function: topology_node_of
+ * --------------------
+ *  Gets the NUMA node a CPU belongs to.
+ * 
+ *  cpu: The CPU.
+ * 
+ *  returns: The node, 0 if unknown.
+ */
+int topology_node_of(int cpu) {
+    if (cpu < 0 || cpu >= MAX_CPUS) {
+        return 0;
+    }
+    return cpu_nodes[cpu];
+}
+
+/*
+ * Function: topology_node_cpus
+ * --------------------
+ *  Gets the online CPUs of a NUMA node.
+ * 
+ *  node: The node.
+ *  list: Filled with the CPUs.
+ * 
+ *  returns: Nothing.
+ */
+void topology_node_cpus(int node, struct cpu_list* list) {
+    *list = node_cpus[node];
+}
+
+/*
+ * Function: pin_thread_to_node
+ * --------------------
+ *  Restricts the calling thread to the CPUs of a NUMA node and has its 
+ *  future allocations prefer that node's memory. A node without online 
+ *  CPUs only has its memory preferred.
+ * 
+ *  node: The node.
+ * 
+ *  returns: SUCCESS or ERROR.
+ */
+int pin_thread_to_node(int node) {
+    // An empty cpuset is rejected by pthread_setaffinity_np.
+    if (node_cpus[node].n == 0) {
+        return prefer_node_memory(node);
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < node_cpus[node].n; i++) {
+        CPU_SET(node_cpus[node].cpus[i], &set);
+    }
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "ERROR: could not pin thread to node %d\n", node);
+        return ERROR;
+    }
+    return prefer_node_memory(node);
+}
+
+/*
+ * Function: prefer_node_memory
+ * --------------------
+ *  Has the calling thread's future allocations come from a NUMA node's 
+ *  memory when it has some free. Pages are placed when first touched, so 
+ *  this covers everything the thread goes on to allocate and fill in.
+ * 
+ *  node: The node.
+ * 
+ *  returns: SUCCESS or ERROR.
+ */
+int prefer_node_memory(int node) {
+    unsigned long mask = 1UL << node;
+
+    // Single node machines have nothing to choose between
+    if (n_nodes <= 1) {
+        return SUCCESS;
+    }
+    // The kernel reads one bit fewer than maxnode
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, 
+                MAX_NODES + 1) != 0) {
+        perror("set_mempolicy");
+        return ERROR;
+    }
+    return SUCCESS;
+}
@@ -0,0 +1,116 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#define MAX_CPUS 1024
+#define MAX_NODES 64
+#define SYS_NODE_PATH "/sys/devices/system/node"
+#define SYS_ONLINE_CPUS_PATH "/sys/devices/system/cpu/online"
+#define CPU_LIST_LEN 4096
+#define SYS_PATH_LEN 128
+
+/*
+ * CPU numbers in the order they are to be used.
+ */
+struct cpu_list {
+    int n;
+    int cpus[MAX_CPUS];
+};
+
+/*
+ * Function: topology_init
+ * --------------------
+ *  Reads the online CPUs and the NUMA node each belongs to from /sys. 
+ *  Without NUMA information every CPU is on node 0.
+ * 
+ *  returns: Nothing.
+ */
+void topology_init(void);
+
+/*
+ * Function: cpu_list_parse
+ * --------------------
+ *  Parses a CPU list such as "0-3,8,10-11", the format used by /sys and 
+ *  taskset.
+ * 
+ *  str: The list.
+ *  list: Filled with the CPUs, in the order given. A CPU named more than 
+ *      once is only kept the first time.
+ * 
+ *  returns: The number of CPUs, or -1 if the list is malformed.
+ */
+int cpu_list_parse(char* str, struct cpu_list* list);
+
+/*
+ * Function: topology_online
+ * --------------------
+ *  Gets the online CPUs ordered so that consecutive entries alternate 
+ *  between NUMA nodes, so taking the first n spreads them over the nodes.
+ * 
+ *  list: Filled with the CPUs.
+ * 
+ *  returns: Nothing.
+ */
+void topology_online(struct cpu_list* list);
+
+/*
+ * Function: topology_nodes
+ * --------------------
+ *  Gets the number of NUMA nodes with online CPUs.
+ * 
+ *  returns: The number of nodes, at least 1.
+ */
+int topology_nodes(void);
+
+/*
+ * Function: topology_node_of
+ * --------------------
+ *  Gets the NUMA node a CPU belongs to.
+ * 
+ *  cpu: The CPU.
+ * 
+ *  returns: The node, 0 if unknown.
+ */
+int topology_node_of(int cpu);
+
+/*
+ * Function: topology_node_cpus
+ * --------------------
+ *  Gets the online CPUs of a NUMA node.
+ * 
+ *  node: The node.
+ *  list: Filled with the CPUs.
+ * 
+ *  returns: Nothing.
+ */
+void topology_node_cpus(int node, struct cpu_list* list);
+
+/*
+ * Function: pin_thread_to_node
+ * --------------------
+ *  Restricts the calling thread to the CPUs of a NUMA node and has its 
+ *  future allocations prefer that node's memory. A node without online 
+ *  CPUs only has its memory preferred.
+ * 
+ *  node: The node.
+ * 
+ *  returns: SUCCESS or ERROR.
+ */
+int pin_thread_to_node(int node);
+
+/*
+ * Function: prefer_node_memory
+ * --------------------
+ *  Has the calling thread's future allocations come from a NUMA node's 
+ *  memory when it has some free. Pages are placed when first touched, so 
+ *  this covers everything the thread goes on to allocate and fill in.
+ * 
+ *  node: The node.
+ * 
+ *  returns: SUCCESS or ERROR.
+ */
+int prefer_node_memory(int node);
+
+#endif
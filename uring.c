@@ -0,0 +1,555 @@
+/*
+Author : Surya Venkatesh
+Purpose: This file contains the io_uring engine, which serves connections
+         from a single thread by queueing their socket I/O to the kernel
+         in batches.
+*/
+#define _GNU_SOURCE
+#include "uring.h"
+#include "eventloop.h"
+#include "connops.h"
+#include "serverops.h"
+#include "filecache.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+static slab_t uring_conn_pool = SLAB_INITIALIZER(struct uring_conn);
+
+/*
+ * Function: run_uring_loop
+ * --------------------
+ *  Serves every connection from a single thread by queueing accepts, 
+ *  receives, sends and splices to io_uring. Falls back to the epoll loop 
+ *  if the kernel does not support io_uring. Never returns.
+ * 
+ *  shard: The shard whose listener to serve.
+ * 
+ *  returns: Nothing.
+ */
+void run_uring_loop(struct shard* shard) {
+    struct uring_loop* ul = calloc(1, sizeof(struct uring_loop));
+    malloc_check(ul);
+
+    if (uring_init(&ul->ring, URING_ENTRIES) != SUCCESS) {
+        // Old kernels lack io_uring, and it can be disabled by sysctl
+        fprintf(stderr, "io_uring unavailable (%s), shard %d falling back "
+                "to epoll\n", strerror(errno), shard->id);
+        free(ul);
+        run_event_loop(shard);
+        return;
+    }
+    ul->loop = (struct event_loop){ -1, shard->sockfd, shard->root_path, 
+                                    shard, NULL, NULL };
+    ul->multishot = true;
+    ul->tick.tv_sec = URING_TICK_SEC;
+
+    uring_arm_accept(ul);
+    uring_arm_tick(ul);
+
+    while (true) {
+        // One system call both submits what was queued and waits
+        if (uring_submit(&ul->ring, 1) != SUCCESS) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+
+        // Handlers only queue entries, so every completion seen is reaped
+        unsigned head = *ul->ring.cq_head;
+        unsigned tail = __atomic_load_n(ul->ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe cqe = ul->ring.cqes[head & ul->ring.cq_mask];
+            uring_complete(ul, &cqe);
+        }
+        __atomic_store_n(ul->ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Function: uring_init
+ * --------------------
+ *  Sets up an io_uring instance and maps its rings.
+ * 
+ *  ring: The ring to set up.
+ *  entries: Size of the submission queue.
+ * 
+ *  returns: SUCCESS, or ERROR with errno set.
+ */
+int uring_init(struct uring* ring, unsigned entries) {
+    struct io_uring_params params = {0};
+
+    // Completions outnumber submissions with multishot accepts and links. 
+    // Only this thread submits, so completion work can also wait until it 
+    // asks for events (6.1), rather than interrupting it.
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | 
+                    IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = entries * URING_CQ_FACTOR;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * URING_CQ_FACTOR;
+        ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring->fd < 0) {
+        return ERROR;
+    }
+    // Both rings in one mapping, and no dropped completions, from 5.5
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || 
+            !(params.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return ERROR;
+    }
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes + 
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->rings = mmap(NULL, ring->rings_len, PROT_READ | PROT_WRITE, 
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) {
+        close(ring->fd);
+        return ERROR;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, 
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->rings, ring->rings_len);
+        close(ring->fd);
+        return ERROR;
+    }
+
+    char* rings = ring->rings;
+    ring->sq_head = (unsigned*)(rings + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(rings + params.sq_off.tail);
+    ring->sq_array = (unsigned*)(rings + params.sq_off.array);
+    ring->sq_mask = *(unsigned*)(rings + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned*)(rings + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(rings + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+    ring->pending = 0;
+
+    return SUCCESS;
+}
+
+/*
+ * Function: uring_prep
+ * --------------------
+ *  Takes the next free submission queue entry and fills in its common 
+ *  fields, submitting queued entries first if the queue is full.
+ * 
+ *  ring: The ring.
+ *  opcode: The operation.
+ *  fd: File descriptor the operation acts on.
+ *  user_data: Value handed back with the completion.
+ * 
+ *  returns: The entry.
+ */
+struct io_uring_sqe* uring_prep(struct uring* ring, int opcode, int fd, 
+                                uint64_t user_data) {
+    uring_reserve(ring, 1);
+
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+
+    // Without SQPOLL the kernel only reads the queue inside io_uring_enter, 
+    // so the entry can be published before the caller fills in the rest
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+
+    return sqe;
+}
+
+/*
+ * Function: uring_reserve
+ * --------------------
+ *  Makes sure a number of entries can be queued without a submit in 
+ *  between, so a linked chain is submitted whole.
+ * 
+ *  ring: The ring.
+ *  n: The number of entries needed.
+ * 
+ *  returns: Nothing.
+ */
+void uring_reserve(struct uring* ring, unsigned n) {
+    while (*ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+            + n > ring->sq_entries) {
+        if (uring_submit(ring, 0) != SUCCESS && errno != EINTR && 
+                errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Function: uring_submit
+ * --------------------
+ *  Submits every queued entry and waits for completions.
+ * 
+ *  ring: The ring.
+ *  wait_nr: The number of completions to wait for.
+ * 
+ *  returns: SUCCESS, or ERROR with errno set.
+ */
+int uring_submit(struct uring* ring, unsigned wait_nr) {
+    int n = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait_nr, 
+                    wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0) {
+        return ERROR;
+    }
+    ring->pending -= n;
+    return SUCCESS;
+}
+
+/*
+ * Function: uring_arm_accept
+ * --------------------
+ *  Queues an accept on the listener, multishot when supported.
+ * 
+ *  ul: The loop.
+ * 
+ *  returns: Nothing.
+ */
+void uring_arm_accept(struct uring_loop* ul) {
+    struct io_uring_sqe* sqe = uring_prep(&ul->ring, IORING_OP_ACCEPT, 
+                                        ul->loop.sockfd, URING_ACCEPT);
+    // Sockets stay blocking, io_uring polls them itself
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (ul->multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+}
+
+/*
+ * Function: uring_arm_tick
+ * --------------------
+ *  Queues the timeout that periodically closes idle connections.
+ * 
+ *  ul: The loop.
+ * 
+ *  returns: Nothing.
+ */
+void uring_arm_tick(struct uring_loop* ul) {
+    struct io_uring_sqe* sqe = uring_prep(&ul->ring, IORING_OP_TIMEOUT, -1, 
+                                        URING_TICK);
+    sqe->addr = (uintptr_t)&ul->tick;
+    sqe->len = 1;
+}
+
+/*
+ * Function: uring_complete
+ * --------------------
+ *  Handles one completion.
+ * 
+ *  ul: The loop.
+ *  cqe: The completion.
+ * 
+ *  returns: Nothing.
+ */
+void uring_complete(struct uring_loop* ul, struct io_uring_cqe* cqe) {
+    uring_op_t op = cqe->user_data & URING_OP_MASK;
+    struct uring_conn* uc = 
+        (struct uring_conn*)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+
+    switch (op) {
+    case URING_ACCEPT:
+        if (cqe->res >= 0) {
+            atomic_fetch_add_explicit(&ul->loop.shard->accepted, 1, 
+                                    memory_order_relaxed);
+            uc = slab_get(&uring_conn_pool);
+            uc->conn = conn_create(cqe->res, ul->loop.root_path);
+            uc->pipe[0] = uc->pipe[1] = -1;
+            uc->piped = 0;
+            uc->splice_failed = false;
+            uring_serve(ul, uc);
+        } else if (cqe->res == -EINVAL && ul->multishot) {
+            // Multishot accepts need 5.19, accept one at a time instead
+            ul->multishot = false;
+        } else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+            fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            uring_arm_accept(ul);
+        }
+        break;
+    case URING_TICK:
+        uring_close_idle(ul);
+        uring_arm_tick(ul);
+        break;
+    case URING_RECV:
+        idle_remove(&ul->loop, uc->conn);
+        // Client disconnected, or was shut down for idling
+        if (cqe->res <= 0) {
+            uring_close(ul, uc);
+            break;
+        }
+        conn_received(uc->conn, cqe->res);
+        uring_serve(ul, uc);
+        break;
+    case URING_SEND:
+        idle_remove(&ul->loop, uc->conn);
+        if (cqe->res <= 0) {
+            uring_close(ul, uc);
+            break;
+        }
+        advance_responses(uc->conn, cqe->res);
+        uring_serve(ul, uc);
+        break;
+    case URING_SPLICE_IN:
+        // Only account for it, the linked splice out completes the step
+        if (cqe->res > 0) {
+            uc->piped += cqe->res;
+            uc->conn->responses[uc->conn->cur_response].file_offset += 
+                cqe->res;
+        } else {
+            uc->splice_failed = true;
+        }
+        break;
+    case URING_SPLICE_OUT:
+        idle_remove(&ul->loop, uc->conn);
+        // A short splice in cancels the splice out, the rest of the file 
+        // is queued again
+        if (uc->splice_failed || 
+                (cqe->res <= 0 && cqe->res != -ECANCELED)) {
+            uring_close(ul, uc);
+            break;
+        }
+        if (cqe->res > 0) {
+            uc->piped -= cqe->res;
+        }
+        uring_serve(ul, uc);
+        break;
+    }
+}
+
+/*
+ * Function: uring_serve
+ * --------------------
+ *  Runs a connection until it has to wait for an operation, serving each 
+ *  kept-alive request in turn. Frees the connection once it is finished.
+ * 
+ *  ul: The loop.
+ *  uc: The connection.
+ * 
+ *  returns: Nothing.
+ */
+void uring_serve(struct uring_loop* ul, struct uring_conn* uc) {
+    struct conn* conn = uc->conn;
+
+    while (true) {
+        switch (conn->state) {
+        case CONN_READ_REQUEST: {
+            if (request_ready(conn)) {
+                conn->state = CONN_PREPARE_RESPONSE;
+                break;
+            }
+            if (conn->buffer_len == BUFFER_LEN) {
+                // Buffer has been filled without a complete request
+                fprintf(stderr, "ERROR, buffer full\n");
+                uring_close(ul, uc);
+                return;
+            }
+            // Wait for more of the request
+            struct io_uring_sqe* sqe = uring_prep(&ul->ring, IORING_OP_RECV, 
+                                    conn->clientfd, 
+                                    (uintptr_t)uc | URING_RECV);
+            sqe->addr = (uintptr_t)(conn->buffer + conn->buffer_len);
+            sqe->len = BUFFER_LEN - conn->buffer_len;
+            idle_touch(&ul->loop, conn);
+            return;
+        }
+        case CONN_PREPARE_RESPONSE:
+            if (prepare_responses(conn) != SUCCESS) {
+                uring_close(ul, uc);
+                return;
+            }
+            conn->state = CONN_SEND_RESPONSE;
+            break;
+        case CONN_SEND_RESPONSE:
+            if (uring_send(ul, uc)) {
+                idle_touch(&ul->loop, conn);
+                return;
+            }
+            if (uc->splice_failed) {
+                uring_close(ul, uc);
+                return;
+            }
+            conn->state = CONN_DONE;
+            break;
+        case CONN_DONE:
+            atomic_fetch_add_explicit(&ul->loop.shard->requests, 
+                                    conn->n_responses, memory_order_relaxed);
+            if (!conn_next_request(conn)) {
+                uring_close(ul, uc);
+                return;
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * Function: uring_send
+ * --------------------
+ *  Queues the next write of the connection's responses: a gathered send of 
+ *  headers and in-memory bodies, or a splice of a file.
+ * 
+ *  ul: The loop.
+ *  uc: The connection.
+ * 
+ *  returns: true if a write was queued, false if every response is sent.
+ */
+bool uring_send(struct uring_loop* ul, struct uring_conn* uc) {
+    struct conn* conn = uc->conn;
+
+    while (conn->cur_response < conn->n_responses) {
+        struct response* res = &conn->responses[conn->cur_response];
+
+        // SEND HEADERS AND CACHED BODIES
+        if (res->sent < response_memory_len(res)) {
+            bool file_follows = false;
+            memset(&uc->msg, 0, sizeof(struct msghdr));
+            uc->msg.msg_iov = uc->iov;
+            uc->msg.msg_iovlen = gather_responses(conn, uc->iov, 
+                                                &file_follows);
+
+            struct io_uring_sqe* sqe = uring_prep(&ul->ring, 
+                                        IORING_OP_SENDMSG, conn->clientfd, 
+                                        (uintptr_t)uc | URING_SEND);
+            sqe->addr = (uintptr_t)&uc->msg;
+            sqe->msg_flags = MSG_NOSIGNAL | (file_follows ? MSG_MORE : 0);
+            return true;
+        }
+
+        // SPLICE FILE
+        if (response_streams_file(res) && 
+                (res->file_offset < res->file_end || uc->piped > 0)) {
+            if (uring_splice(ul, uc, res) != SUCCESS) {
+                uc->splice_failed = true;
+                return false;
+            }
+            return true;
+        }
+
+        finish_response(res);
+        conn->cur_response++;
+    }
+    return false;
+}
+
+/*
+ * Function: uring_splice
+ * --------------------
+ *  Queues the next chunk of a file, spliced into the connection's pipe and 
+ *  from there to the socket by two linked entries.
+ * 
+ *  ul: The loop.
+ *  uc: The connection.
+ *  res: The response streaming the file.
+ * 
+ *  returns: SUCCESS, or ERROR if no pipe could be made.
+ */
+int uring_splice(struct uring_loop* ul, struct uring_conn* uc, 
+                struct response* res) {
+    struct io_uring_sqe* sqe = NULL;
+    int clientfd = uc->conn->clientfd;
+
+    if (uc->pipe[0] < 0) {
+        if (pipe2(uc->pipe, O_CLOEXEC) < 0) {
+            perror("pipe2");
+            return ERROR;
+        }
+        // Bigger chunks mean fewer round trips, keep the default if refused
+        fcntl(uc->pipe[1], F_SETPIPE_SZ, URING_SPLICE_CHUNK);
+    }
+    size_t chunk = fcntl(uc->pipe[1], F_GETPIPE_SZ);
+
+    size_t len = uc->piped;
+    // Only refill the pipe once the socket has taken everything in it
+    if (uc->piped == 0) {
+        len = res->file_end - res->file_offset;
+        if (len > chunk) {
+            len = chunk;
+        }
+        uring_reserve(&ul->ring, 2);
+        sqe = uring_prep(&ul->ring, IORING_OP_SPLICE, uc->pipe[1], 
+                        (uintptr_t)uc | URING_SPLICE_IN);
+        sqe->splice_fd_in = res->file->fd;
+        sqe->splice_off_in = res->file_offset;
+        sqe->off = (uint64_t)-1;
+        sqe->len = len;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->flags = IOSQE_IO_LINK;
+    }
+
+    sqe = uring_prep(&ul->ring, IORING_OP_SPLICE, clientfd, 
+                    (uintptr_t)uc | URING_SPLICE_OUT);
+    sqe->splice_fd_in = uc->pipe[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->off = (uint64_t)-1;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    return SUCCESS;
+}
+
+/*
+ * Function: uring_close
+ * --------------------
+ *  Closes a connection and returns it to the pool. It must have no operations in flight.
+ * 
+ *  ul: The loop.
+ *  uc: The connection.
+ * 
+ *  returns: Nothing.
+ */
+void uring_close(struct uring_loop* ul, struct uring_conn* uc) {
+    idle_remove(&ul->loop, uc->conn);
+    if (uc->pipe[0] >= 0) {
+        close(uc->pipe[0]);
+        close(uc->pipe[1]);
+    }
+    conn_free(uc->conn);
+    slab_put(&uring_conn_pool, uc);
+}
+
+/*
+ * Function: uring_close_idle
+ * --------------------
+ *  Shuts down every connection that has been idle for longer than the 
+ *  timeout. Its pending operation then completes and frees it.
+ * 
+ *  ul: The loop.
+ * 
+ *  returns: Nothing.
+ */
+void uring_close_idle(struct uring_loop* ul) {
+    time_t now = monotonic_seconds();
+
+    // The list is ordered by activity, so stop at the first live connection
+    while (ul->loop.idle_head != NULL && 
+            now - ul->loop.idle_head->last_active >= 
+            server_options.idle_timeout) {
+        struct conn* conn = ul->loop.idle_head;
+        idle_remove(&ul->loop, conn);
+        shutdown(conn->clientfd, SHUT_RDWR);
+    }
+}
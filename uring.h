@@ -0,0 +1,246 @@
+#ifndef URING_H
+#define URING_H
+
+#include "connops.h"
+#include "eventloop.h"
+#include "serverops.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 1024
+#define URING_CQ_FACTOR 4
+#define URING_SPLICE_CHUNK 1048576
+#define URING_TICK_SEC 1
+#define URING_OP_MASK 7
+
+/*
+ * What a completion belongs to. The tag is kept in the low bits of the 
+ * user data, above it sits the connection, if any.
+ */
+typedef enum uring_op {
+    URING_ACCEPT,
+    URING_TICK,
+    URING_RECV,
+    URING_SEND,
+    URING_SPLICE_IN,
+    URING_SPLICE_OUT
+} uring_op_t;
+
+/*
+ * A submission and completion queue pair shared with the kernel, set up 
+ * with the raw system calls.
+ */
+struct uring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    // Entries queued since the last submit
+    unsigned pending;
+    void* rings;
+    size_t rings_len;
+    size_t sqes_len;
+};
+
+/*
+ * A connection served by the io_uring engine, with the state its queued 
+ * operations refer to until they complete.
+ */
+struct uring_conn {
+    struct conn* conn;
+    // The gathered write in flight
+    struct msghdr msg;
+    struct iovec iov[2 * PIPELINE_MAX];
+    // Pipe a streamed file is spliced through, and the bytes sitting in it
+    int pipe[2];
+    size_t piped;
+    // The file could not be spliced into the pipe
+    bool splice_failed;
+};
+
+struct uring_loop {
+    struct uring ring;
+    // Listener, shard and idle list, shared with the epoll helpers
+    struct event_loop loop;
+    // Whether one accept keeps delivering connections
+    bool multishot;
+    struct __kernel_timespec tick;
+};
+
+/*
+ * Function: run_uring_loop
+ * --------------------
+ *  Serves every connection from a single thread by queueing accepts, 
+ *  receives, sends and splices to io_uring. Falls back to the epoll loop 
+ *  if the kernel does not support io_uring. Never returns.
+ * 
+ *  shard: The shard whose listener to serve.
+ * 
+ *  returns: Nothing.
+ */
+void run_uring_loop(struct shard* shard);
+
+/*
+ * Function: uring_init
+ * --------------------
+ *  Sets up an io_uring instance and maps its rings.
+ * 
+ *  ring: The ring to set up.
+ *  entries: Size of the submission queue.
+ * 
+ *  returns: SUCCESS, or ERROR with errno set.
+ */
+int uring_init(struct uring* ring, unsigned entries);
+
+/*
+ * Function: uring_prep
+ * --------------------
+ *  Takes the next free submission queue entry and fills in its common 
+ *  fields, submitting queued entries first if the queue is full.
+ * 
+ *  ring: The ring.
+ *  opcode: The operation.
+ *  fd: File descriptor the operation acts on.
+ *  user_data: Value handed back with the completion.
+ * 
+ *  returns: The entry.
+ */
+struct io_uring_sqe* uring_prep(struct uring* ring, int opcode, int fd, 
+                                uint64_t user_data);
+
+/*
+ * Function: uring_reserve
+ * --------------------
+ *  Makes sure a number of entries can be queued without a submit in 
+ *  between, so a linked chain is submitted whole.
+ * 
+ *  ring: The ring.
+ *  n: The number of entries needed.
+ * 
+ *  returns: Nothing.
+ */
+void uring_reserve(struct uring* ring, unsigned n);
+
+/*
+ * Function: uring_submit
+ * --------------------
+ *  Submits every queued entry and waits for completions.
+ * 
+ *  ring: The ring.
+ *  wait_nr: The number of completions to wait for.
+ * 
+ *  returns: SUCCESS, or ERROR with errno set.
+ */
+int uring_submit(struct uring* ring, unsigned wait_nr);
+
+/*
+ * Function: uring_arm_accept
+ * --------------------
+ *  Queues an accept on the listener, multishot when supported.
+ * 
+ *  ul: The loop.
+ * 
+ *  returns: Nothing.
+ */
+void uring_arm_accept(struct uring_loop* ul);
+
+/*
+ * Function: uring_arm_tick
+ * --------------------
+ *  Queues the timeout that periodically closes idle connections.
+ * 
+ *  ul: The loop.
+ * 
+ *  returns: Nothing.
+ */
+void uring_arm_tick(struct uring_loop* ul);
+
+/*
+ * Function: uring_complete
+ * --------------------
+ *  Handles one completion.
+ * 
+ *  ul: The loop.
+ *  cqe: The completion.
+ * 
+ *  returns: Nothing.
+ */
+void uring_complete(struct uring_loop* ul, struct io_uring_cqe* cqe);
+
+/*
+ * Function: uring_serve
+ * --------------------
+ *  Runs a connection until it has to wait for an operation, serving each 
+ *  kept-alive request in turn. Frees the connection once it is finished.
+ * 
+ *  ul: The loop.
+ *  uc: The connection.
+ * 
+ *  returns: Nothing.
+ */
+void uring_serve(struct uring_loop* ul, struct uring_conn* uc);
+
+/*
+ * Function: uring_send
+ * --------------------
+ *  Queues the next write of the connection's responses: a gathered send of 
+ *  headers and in-memory bodies, or a splice of a file.
+ * 
+ *  ul: The loop.
+ *  uc: The connection.
+ * 
+ *  returns: true if a write was queued, false if every response is sent.
+ */
+bool uring_send(struct uring_loop* ul, struct uring_conn* uc);
+
+/*
+ * Function: uring_splice
+ * --------------------
+ *  Queues the next chunk of a file, spliced into the connection's pipe and 
+ *  from there to the socket by two linked entries.
+ * 
+ *  ul: The loop.
+ *  uc: The connection.
+ *  res: The response streaming the file.
+ * 
+ *  returns: SUCCESS, or ERROR if no pipe could be made.
+ */
+int uring_splice(struct uring_loop* ul, struct uring_conn* uc, 
+                struct response* res);
+
+/*
+ * Function: uring_close
+ * --------------------
+ *  Closes a connection and returns it to the pool. It must have no operations in flight.
+ * 
+ *  ul: The loop.
+ *  uc: The connection.
+ * 
+ *  returns: Nothing.
+ */
+void uring_close(struct uring_loop* ul, struct uring_conn* uc);
+
+/*
+ * Function: uring_close_idle
+ * --------------------
+ *  Shuts down every connection that has been idle for longer than the 
+ *  timeout. Its pending operation then completes and frees it.
+ * 
+ *  ul: The loop.
+ * 
+ *  returns: Nothing.
+ */
+void uring_close_idle(struct uring_loop* ul);
+
+#endif